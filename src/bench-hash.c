@@ -0,0 +1,248 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+
+
+/**
+ * The number of slots a map starts with, must be a power of two
+ */
+#define BENCH_HASH_INITIAL  64
+
+
+
+/**
+ * The name of the map backend the benchmark is built with
+ */
+const char* bench_backend = "hash";
+
+
+
+/**
+ * Slot in an open addressing hash map
+ */
+struct bench_slot
+{
+  /**
+   * The hash of the key
+   */
+  uint64_t hash;
+  
+  /**
+   * The key, `NULL` if the slot is empty
+   */
+  char* key;
+  
+  /**
+   * The key's value
+   */
+  void* value;
+};
+
+
+/**
+ * Open addressing hash map with linear probing
+ */
+struct bench_hash
+{
+  /**
+   * The slots
+   */
+  struct bench_slot* slots;
+  
+  /**
+   * The number of slots, a power of two
+   */
+  size_t capacity;
+  
+  /**
+   * The number of used slots
+   */
+  size_t count;
+};
+
+
+
+/**
+ * Hash a key with FNV-1a
+ * 
+ * @param   key  The key
+ * @return       The hash
+ */
+static uint64_t bench__hash(const char* key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  while (*key)
+    hash = (hash ^ (unsigned char)*key++) * 1099511628211ULL;
+  return hash;
+}
+
+
+/**
+ * Gets the slot a key is in, or the empty slot it would be put in
+ * 
+ * @param   map   The map
+ * @param   key   The key
+ * @param   hash  The hash of the key
+ * @return        The slot
+ */
+static struct bench_slot* bench__find(struct bench_hash* map, const char* key, uint64_t hash)
+{
+  size_t mask = map->capacity - 1, i = (size_t)hash & mask;
+  struct bench_slot* slot;
+  for (;; i = (i + 1) & mask)
+    {
+      slot = map->slots + i;
+      if ((slot->key == NULL) || ((slot->hash == hash) && !strcmp(slot->key, key)))
+	return slot;
+    }
+}
+
+
+/**
+ * Creates an empty map
+ * 
+ * @return  The map, `NULL` on error
+ */
+void* bench_new(void)
+{
+  struct bench_hash* map = (struct bench_hash*)malloc(sizeof(struct bench_hash));
+  if (map == NULL)
+    return NULL;
+  map->capacity = BENCH_HASH_INITIAL;
+  map->count = 0;
+  if ((map->slots = (struct bench_slot*)calloc(map->capacity, sizeof(struct bench_slot))) == NULL)
+    {
+      free(map);
+      return NULL;
+    }
+  return map;
+}
+
+
+/**
+ * Gets the value for a key in a map
+ * 
+ * @param   map     The map
+ * @param   key     The key
+ * @param   shared  Not used
+ * @return          The value, `NULL` if not found
+ */
+void* bench_get(void* map, const char* key, size_t shared)
+{
+  (void) shared;
+  return bench__find((struct bench_hash*)map, key, bench__hash(key))->value;
+}
+
+
+/**
+ * Double the number of slots in a map
+ * 
+ * @param   map  The map
+ * @return       Zero on success, -1 on error
+ */
+static int bench__grow(struct bench_hash* map)
+{
+  struct bench_slot* old = map->slots;
+  size_t i, n = map->capacity;
+  struct bench_slot* new = (struct bench_slot*)calloc(n * 2, sizeof(struct bench_slot));
+  if (new == NULL)
+    return -1;
+  map->slots = new;
+  map->capacity = n * 2;
+  for (i = 0; i < n; i++)
+    if ((old + i)->key)
+      *bench__find(map, (old + i)->key, (old + i)->hash) = *(old + i);
+  free(old);
+  return 0;
+}
+
+
+/**
+ * Sets the value for a key in a map
+ * 
+ * @param  map    The map
+ * @param  key    The key
+ * @param  value  The value, `NULL` to remove
+ */
+void bench_put(void* map, const char* key, void* value)
+{
+  struct bench_hash* hash_map = (struct bench_hash*)map;
+  uint64_t hash = bench__hash(key);
+  struct bench_slot* slot = bench__find(hash_map, key, hash);
+  struct bench_slot* next;
+  size_t mask = hash_map->capacity - 1, i, j, home;
+  if (slot->key)
+    {
+      if (value)
+	{
+	  slot->value = value;
+	  return;
+	}
+      /* Move later keys in the probe sequence back, so that no tombstones are needed */
+      free(slot->key);
+      hash_map->count--;
+      for (i = (size_t)(slot - hash_map->slots), j = (i + 1) & mask;; j = (j + 1) & mask)
+	{
+	  next = hash_map->slots + j;
+	  if (next->key == NULL)
+	    break;
+	  home = (size_t)next->hash & mask;
+	  if (((j - home) & mask) >= ((j - i) & mask))
+	    {
+	      *(hash_map->slots + i) = *next;
+	      i = j;
+	    }
+	}
+      (hash_map->slots + i)->key = NULL;
+      (hash_map->slots + i)->value = NULL;
+      return;
+    }
+  if (value == NULL)
+    return;
+  if ((slot->key = strdup(key)) == NULL)
+    return;
+  slot->hash = hash;
+  slot->value = value;
+  /* Keep the load factor at most three quarters */
+  if (++(hash_map->count) * 4 > hash_map->capacity * 3)
+    bench__grow(hash_map);
+}
+
+
+/**
+ * Frees a map, but not its values
+ * 
+ * @param  map  The map
+ */
+void bench_free(void* map)
+{
+  struct bench_hash* hash_map = (struct bench_hash*)map;
+  size_t i;
+  for (i = 0; i < hash_map->capacity; i++)
+    free((hash_map->slots + i)->key);
+  free(hash_map->slots);
+  free(hash_map);
+}
+
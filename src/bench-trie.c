@@ -0,0 +1,179 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include <stdlib.h>
+
+
+
+/**
+ * The binary logarithm of the number of levels per character in the map data structure
+ */
+#ifndef MAP_LB_LEVELS
+  #define MAP_LB_LEVELS  1
+#endif
+
+/**
+ * The levels per character in the map data structure
+ */
+#define MAP_LEVELS  (1 << MAP_LB_LEVELS)
+
+/**
+ * The number of bits per level in the map data structure
+ */
+#define MAP_BIT_PER_LEVEL  (8 >> MAP_LB_LEVELS)
+
+/**
+ * The number of combinations per level in the map data structure
+ */
+#define MAP_PER_LEVEL  (1 << MAP_BIT_PER_LEVEL)
+
+/**
+ * Expands to its argument as a string literal, after expanding it
+ */
+#define MAP_STR(X)   MAP_STR_(X)
+#define MAP_STR_(X)  #X
+
+
+
+/**
+ * The name of the map backend the benchmark is built with
+ */
+const char* bench_backend = "trie" MAP_STR(MAP_LB_LEVELS);
+
+
+
+/**
+ * Creates an empty map, the trie `pram_map` used before it became an adaptive
+ * radix tree, each character is split into `MAP_LEVELS` levels, and the last
+ * level of each character has a value at its last position
+ * 
+ * @return  The map, `NULL` on error
+ */
+void* bench_new(void)
+{
+  return calloc(MAP_PER_LEVEL + 1, sizeof(void*));
+}
+
+
+/**
+ * Gets the value for a key in a map
+ * 
+ * @param   map     The map
+ * @param   key     The key
+ * @param   shared  Not used
+ * @return          The value, `NULL` if not found
+ */
+void* bench_get(void* map, const char* key, size_t shared)
+{
+  void** at = (void**)map;
+  long lv;
+  (void) shared;
+  while (*key)
+    {
+      #define __(L)											\
+	lv = (long)((*key >> ((MAP_LEVELS - L - 1) * MAP_BIT_PER_LEVEL)) & (MAP_PER_LEVEL - 1));	\
+	if ((at = (void**)*(at + lv)) == NULL)								\
+	  return NULL
+      __(0);
+      #if MAP_LB_LEVELS >= 1
+      __(1);
+      #endif
+      #if MAP_LB_LEVELS >= 2
+      __(2);  __(3);
+      #endif
+      #if MAP_LB_LEVELS >= 3
+      __(4);  __(5);  __(6);  __(7);
+      #endif
+      #undef __
+      key++;
+    }
+  return *(at + MAP_PER_LEVEL);
+}
+
+
+/**
+ * Sets the value for a key in a map
+ * 
+ * @param  map    The map
+ * @param  key    The key
+ * @param  value  The value, `NULL` to remove
+ */
+void bench_put(void* map, const char* key, void* value)
+{
+  void** at = (void**)map;
+  void** node;
+  long lv;
+  while (*key)
+    {
+      #define __(L, END)										\
+	lv = (long)((*key >> ((MAP_LEVELS - L - 1) * MAP_BIT_PER_LEVEL)) & (MAP_PER_LEVEL - 1));	\
+	if (*(at + lv))											\
+	  at = (void**)*(at + lv);									\
+	else												\
+	  {												\
+	    if ((node = (void**)calloc(MAP_PER_LEVEL + (END), sizeof(void*))) == NULL)			\
+	      return;											\
+	    *(at + lv) = (void*)node;									\
+	    at = node;											\
+	  }
+      __(0, MAP_LB_LEVELS == 0);
+      #if MAP_LB_LEVELS >= 1
+      __(1, MAP_LB_LEVELS == 1);
+      #endif
+      #if MAP_LB_LEVELS >= 2
+      __(2, 0);  __(3, MAP_LB_LEVELS == 2);
+      #endif
+      #if MAP_LB_LEVELS >= 3
+      __(4, 0);  __(5, 0);  __(6, 0);  __(7, MAP_LB_LEVELS == 3);
+      #endif
+      #undef __
+      key++;
+    }
+  *(at + MAP_PER_LEVEL) = value;
+}
+
+
+/**
+ * Frees a level and all sublevels in a map
+ * 
+ * @param  level  The level
+ */
+static void bench__free(void** level)
+{
+  long i;
+  if (level == NULL)
+    return;
+  for (i = 0; i < MAP_PER_LEVEL; i++)
+    bench__free((void**)*(level + i));
+  free(level);
+}
+
+
+/**
+ * Frees a map, but not its values
+ * 
+ * @param  map  The map
+ */
+void bench_free(void* map)
+{
+  bench__free((void**)map);
+}
+
@@ -0,0 +1,244 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <malloc.h>
+
+
+
+/**
+ * The number of times all keys are looked up, unless specified
+ */
+#define BENCH_ROUNDS  5
+
+
+
+/**
+ * Gets the current time
+ * 
+ * @return  The current time in nanoseconds, on the monotonic clock
+ */
+static double bench__now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)(ts.tv_sec) * 1000000000. + (double)(ts.tv_nsec);
+}
+
+
+/**
+ * Gets the number of bytes allocated on the heap
+ * 
+ * @return  The number of allocated bytes
+ */
+static size_t bench__heap(void)
+{
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+
+/**
+ * Read the keys to benchmark with, one per line, such as the output of `find`
+ * 
+ * @param   file  The file to read from
+ * @param   keys  Output parameter for the keys
+ * @param   n     Output parameter for the number of keys
+ * @return        Zero on success, -1 on error
+ */
+static int bench__read(FILE* file, char*** keys, size_t* n)
+{
+  char* line = NULL;
+  size_t size = 0, capacity = 0;
+  ssize_t len;
+  char** new;
+  *keys = NULL;
+  *n = 0;
+  while ((len = getline(&line, &size, file)) >= 0)
+    {
+      if (len && (*(line + len - 1) == '\n'))
+	*(line + --len) = 0;
+      if (len == 0)
+	continue;
+      if (*n == capacity)
+	{
+	  capacity = capacity ? capacity * 2 : 1024;
+	  if ((new = (char**)realloc(*keys, capacity * sizeof(char*))) == NULL)
+	    goto fail;
+	  *keys = new;
+	}
+      if ((*(*keys + *n) = strdup(line)) == NULL)
+	goto fail;
+      (*n)++;
+    }
+  free(line);
+  return ferror(file) ? -1 : 0;
+ fail:
+  free(line);
+  return -1;
+}
+
+
+/**
+ * Check the value a key was looked up with, a key that is listed more than once
+ * has the value of its last listing, and no value once any listing is removed
+ * 
+ * @param   keys     The keys, the value of the key at index `i` is `i + 1`
+ * @param   n        The number of keys
+ * @param   i        The index of the looked up key
+ * @param   value    The value the key was looked up with
+ * @param   removed  Whether the keys at even indices have been removed
+ * @return           Whether the value is correct
+ */
+static int bench__check(char** keys, size_t n, size_t i, void* value, int removed)
+{
+  void* expected = removed && !(i & 1) ? NULL : (void*)(i + 1);
+  size_t j;
+  if (value == expected)
+    return 1;
+  for (j = 0; j < n; j++)
+    if (!strcmp(*(keys + j), *(keys + i)))
+      {
+	if (expected && removed && !(j & 1))
+	  expected = NULL;
+	else if (expected)
+	  expected = (void*)(j + 1);
+      }
+  return value == expected;
+}
+
+
+/**
+ * Replay a set of file names against the map backend the program is built with,
+ * and print the time it takes to insert and look up the names, the memory used
+ * per name, and the time it takes to free the map, the values that are looked
+ * up are checked, and so is the removal of the names, without being timed
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The program, the file with one name per line (standard input if
+ *                omitted or "-"), and the number of rounds of look ups
+ * @return        Zero on success, 1 on error
+ */
+int main(int argc, char** argv)
+{
+  FILE* file = stdin;
+  long rounds = argc > 2 ? atol(*(argv + 2)) : BENCH_ROUNDS;
+  char** keys;
+  size_t* shared;
+  const char* name;
+  size_t i, n, heap;
+  double inserted, looked_up, freed, t;
+  long round;
+  void* map;
+  void* value;
+  
+  if ((argc > 1) && strcmp(*(argv + 1), "-") && ((file = fopen(*(argv + 1), "r")) == NULL))
+    {
+      perror(*argv);
+      return 1;
+    }
+  if (bench__read(file, &keys, &n) < 0)
+    {
+      perror(*argv);
+      return 1;
+    }
+  if (file != stdin)
+    fclose(file);
+  if ((n == 0) || (rounds < 1))
+    {
+      fprintf(stderr, "%s: no keys to benchmark with\n", *argv);
+      return 1;
+    }
+  if ((shared = (size_t*)malloc(n * sizeof(size_t))) == NULL)
+    {
+      perror(*argv);
+      return 1;
+    }
+  for (i = 0; i < n; i++)
+    *(shared + i) = (name = strrchr(*(keys + i), '/')) ? (size_t)(name - *(keys + i)) + 1 : 0;
+  
+  heap = bench__heap();
+  t = bench__now();
+  if ((map = bench_new()) == NULL)
+    {
+      perror(*argv);
+      return 1;
+    }
+  for (i = 0; i < n; i++)
+    bench_put(map, *(keys + i), (void*)(i + 1));
+  inserted = bench__now() - t;
+  heap = bench__heap() - heap;
+  
+  t = bench__now();
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < n; i++)
+      if (((value = bench_get(map, *(keys + i), *(shared + i))) != (void*)(i + 1)) &&
+	  !bench__check(keys, n, i, value, 0))
+	{
+	  fprintf(stderr, "%s: %s: %s was %s\n", *argv, bench_backend, *(keys + i),
+		  value ? "found with the wrong value" : "not found");
+	  return 1;
+	}
+  looked_up = bench__now() - t;
+  
+  t = bench__now();
+  bench_free(map);
+  freed = bench__now() - t;
+  
+  /* Half of the keys are removed, and then the rest, from a new map, so that
+     the map is checked as nodes are shrunk, merged and pruned */
+  if ((map = bench_new()) == NULL)
+    {
+      perror(*argv);
+      return 1;
+    }
+  for (i = 0; i < n; i++)
+    bench_put(map, *(keys + i), (void*)(i + 1));
+  for (round = 0; round < 2; round++)
+    {
+      for (i = (size_t)round; i < n; i += 2)
+	bench_put(map, *(keys + i), NULL);
+      for (i = 0; i < n; i++)
+	{
+	  value = bench_get(map, *(keys + i), *(shared + i));
+	  if (round ? (value == NULL) : bench__check(keys, n, i, value, 1))
+	    continue;
+	  fprintf(stderr, "%s: %s: %s has the wrong value after removal\n", *argv, bench_backend, *(keys + i));
+	  return 1;
+	}
+    }
+  bench_free(map);
+  
+  printf("%-6s %9zu keys %9.1f ns/lookup %9.1f ns/insert %9.1f bytes/key %9.3f ms teardown\n",
+	 bench_backend, n, looked_up / (double)n / (double)rounds, inserted / (double)n,
+	 (double)heap / (double)n, freed / 1000000.);
+  
+  for (i = 0; i < n; i++)
+    free(*(keys + i));
+  free(keys);
+  free(shared);
+  return 0;
+}
+
@@ -0,0 +1,65 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stddef.h>
+
+
+
+/**
+ * The name of the map backend the benchmark is built with
+ */
+extern const char* bench_backend;
+
+
+
+/**
+ * Creates an empty map
+ * 
+ * @return  The map, `NULL` on error
+ */
+void* bench_new(void);
+
+/**
+ * Gets the value for a key in a map
+ * 
+ * @param   map     The map
+ * @param   key     The key
+ * @param   shared  The number of bytes at the beginning of the key that the next
+ *                  key is expected to begin with too, the directory of the file
+ * @return          The value, `NULL` if not found
+ */
+void* bench_get(void* map, const char* key, size_t shared);
+
+/**
+ * Sets the value for a key in a map
+ * 
+ * @param  map    The map
+ * @param  key    The key
+ * @param  value  The value, `NULL` to remove
+ */
+void bench_put(void* map, const char* key, void* value);
+
+/**
+ * Frees a map, but not its values
+ * 
+ * @param  map  The map
+ */
+void bench_free(void* map);
+
@@ -0,0 +1,294 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "io.h"
+
+
+
+/**
+ * Account for the result of one attempt at an operation
+ * 
+ * @param  op   The operation
+ * @param  res  The number of bytes read or written, or a negative error code
+ */
+static void pram__io_complete(struct pram_io_op* op, ssize_t res);
+
+/**
+ * Make the queued operations that are not finished with io_uring
+ * 
+ * @param   io  The queue, io_uring must be set up
+ * @return      Zero on success, -1 if io_uring failed and was shut down,
+ *              the operations that are not finished must then be made otherwise
+ */
+static int pram__io_ring(pram_io* io);
+
+/**
+ * Shut down io_uring for a queue, no operation may be in the kernel
+ * 
+ * @param  io  The queue
+ */
+static void pram__io_stop(pram_io* io);
+
+
+
+/**
+ * Initialise a queue of reads and writes, setting up io_uring if it is used
+ * 
+ * @param  io  The queue
+ */
+void pram_io_init(pram_io* io)
+{
+  memset(io, 0, sizeof(pram_io));
+  io->ring = -1;
+#ifdef PRAM_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(struct io_uring_params));
+  int ring = (int)syscall(__NR_io_uring_setup, PRAM_IO_DEPTH, &params);
+  if (ring < 0)
+    return;
+  io->ring = ring;
+  io->entries = params.sq_entries;
+  io->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  io->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  /* Newer kernels map both rings at once */
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) && (io->sq_size < io->cq_size))
+    io->sq_size = io->cq_size;
+  io->sq = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  if (io->sq == MAP_FAILED)
+    io->sq = NULL;
+  else if (params.features & IORING_FEAT_SINGLE_MMAP)
+    io->cq = io->sq;
+  else if ((io->cq = mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    io->cq = NULL;
+  if (io->cq && ((io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  ring, IORING_OFF_SQES)) == MAP_FAILED))
+    io->sqes = NULL;
+  if (io->sqes == NULL)
+    {
+      pram__io_stop(io);
+      return;
+    }
+  io->sq_head = (unsigned*)((char*)(io->sq) + params.sq_off.head);
+  io->sq_tail = (unsigned*)((char*)(io->sq) + params.sq_off.tail);
+  io->sq_mask = (unsigned*)((char*)(io->sq) + params.sq_off.ring_mask);
+  io->sq_array = (unsigned*)((char*)(io->sq) + params.sq_off.array);
+  io->cq_head = (unsigned*)((char*)(io->cq) + params.cq_off.head);
+  io->cq_tail = (unsigned*)((char*)(io->cq) + params.cq_off.tail);
+  io->cq_mask = (unsigned*)((char*)(io->cq) + params.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe*)((char*)(io->cq) + params.cq_off.cqes);
+#endif
+}
+
+
+/**
+ * Queue a read or a write
+ * 
+ * @param   io     The queue
+ * @param   fd     The file descriptor
+ * @param   write  Whether to write rather than read
+ * @param   buf    The buffer to read into or write from, it must be kept until `pram_io_run` returns
+ * @param   len    The number of bytes to read or write
+ * @param   off    The offset in the file
+ * @return         Zero on success, -1 if `PRAM_IO_DEPTH` operations are already queued
+ */
+int pram_io_queue(pram_io* io, int fd, int write, void* buf, size_t len, off_t off)
+{
+  if (io->opn == PRAM_IO_DEPTH)
+    return -1;
+  struct pram_io_op* op = io->ops + io->opn++;
+  op->fd = fd;
+  op->write = (char)(write != 0);
+  op->finished = len == 0;
+  op->submitted = 0;
+  op->buf = (char*)buf;
+  op->len = len;
+  op->off = off;
+  op->done = 0;
+  op->error = 0;
+  return 0;
+}
+
+
+/**
+ * Make all queued reads and writes, and wait for them to finish, the results are
+ * left in `io->ops` until the queue is cleared with `pram_io_clear`, writes are
+ * made whole unless they fail, reads stop early only at the end of the file or if
+ * they fail, the operations are not made in any specific order
+ * 
+ * @param  io  The queue
+ */
+void pram_io_run(pram_io* io)
+{
+  if ((io->ring >= 0) && (pram__io_ring(io) == 0))
+    return;
+  for (size_t i = 0; i < io->opn; i++)
+    {
+      struct pram_io_op* op = io->ops + i;
+      while (!(op->finished))
+	{
+	  ssize_t res = op->write ? pwrite(op->fd, op->buf + op->done, op->len - op->done, op->off + (off_t)(op->done))
+				  : pread(op->fd, op->buf + op->done, op->len - op->done, op->off + (off_t)(op->done));
+	  pram__io_complete(op, res < 0 ? -errno : res);
+	}
+    }
+}
+
+
+/**
+ * Remove all operations from a queue
+ * 
+ * @param  io  The queue
+ */
+void pram_io_clear(pram_io* io)
+{
+  io->opn = 0;
+}
+
+
+/**
+ * Free the resources of a queue
+ * 
+ * @param  io  The queue
+ */
+void pram_io_destroy(pram_io* io)
+{
+  pram__io_stop(io);
+  io->opn = 0;
+}
+
+
+/**
+ * Account for the result of one attempt at an operation
+ * 
+ * @param  op   The operation
+ * @param  res  The number of bytes read or written, or a negative error code
+ */
+static void pram__io_complete(struct pram_io_op* op, ssize_t res)
+{
+  /* Interrupted attempts are made again */
+  if ((res == -EINTR) || (res == -EAGAIN))
+    return;
+  if (res < 0)
+    op->error = (int)-res;
+  else if ((res == 0) && op->write)
+    op->error = EIO;
+  else
+    op->done += (size_t)res;
+  op->finished = (res <= 0) || (op->done == op->len);
+}
+
+
+/**
+ * Make the queued operations that are not finished with io_uring
+ * 
+ * @param   io  The queue, io_uring must be set up
+ * @return      Zero on success, -1 if io_uring failed and was shut down,
+ *              the operations that are not finished must then be made otherwise
+ */
+static int pram__io_ring(pram_io* io)
+{
+#ifdef PRAM_IO_URING
+  /* `pending` entries have been put in the submission queue but not
+     consumed by the kernel, and `flying` operations are not completed */
+  unsigned pending = 0, flying = 0;
+  int broken = 0;
+  for (;;)
+    {
+      unsigned head = *(io->cq_head);
+      unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++, flying--)
+	{
+	  struct io_uring_cqe* cqe = io->cqes + (head & *(io->cq_mask));
+	  struct pram_io_op* op = io->ops + cqe->user_data;
+	  op->submitted = 0;
+	  pram__io_complete(op, cqe->res);
+	}
+      __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+      /* Unfinished reads and writes, including the rest of short ones, are submitted */
+      tail = *(io->sq_tail);
+      head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+      for (size_t i = 0; !broken && (i < io->opn) && (tail - head < io->entries); i++)
+	{
+	  struct pram_io_op* op = io->ops + i;
+	  if (op->finished || op->submitted)
+	    continue;
+	  unsigned index = tail++ & *(io->sq_mask);
+	  struct io_uring_sqe* sqe = io->sqes + index;
+	  memset(sqe, 0, sizeof(struct io_uring_sqe));
+	  sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+	  sqe->fd = op->fd;
+	  sqe->addr = (uintptr_t)(op->buf + op->done);
+	  sqe->len = (unsigned)(op->len - op->done < (1U << 30) ? op->len - op->done : (1U << 30));
+	  sqe->off = (unsigned long long)(op->off + (off_t)(op->done));
+	  sqe->user_data = i;
+	  *(io->sq_array + index) = index;
+	  op->submitted = 1;
+	  pending++;
+	  flying++;
+	}
+      __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+      if (flying == 0)
+	return 0;
+      if (broken && (flying == pending))
+	{
+	  /* Entries the kernel has not consumed are never consumed once the ring is closed */
+	  for (size_t i = 0; i < io->opn; i++)
+	    (io->ops + i)->submitted = 0;
+	  pram__io_stop(io);
+	  return -1;
+	}
+      int got = (int)syscall(__NR_io_uring_enter, io->ring, broken ? 0 : pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (got >= 0)
+	pending -= broken ? 0 : (unsigned)got;
+      else if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+	/* Operations in the kernel use the buffers, so wait for them before giving up */
+	broken = 1;
+    }
+#else
+  (void) io;
+  return -1;
+#endif
+}
+
+
+/**
+ * Shut down io_uring for a queue, no operation may be in the kernel
+ * 
+ * @param  io  The queue
+ */
+static void pram__io_stop(pram_io* io)
+{
+#ifdef PRAM_IO_URING
+  if (io->sqes)
+    munmap(io->sqes, io->sqes_size);
+  if (io->cq && (io->cq != io->sq))
+    munmap(io->cq, io->cq_size);
+  if (io->sq)
+    munmap(io->sq, io->sq_size);
+#endif
+  if (io->ring >= 0)
+    close(io->ring);
+  io->ring = -1;
+  io->sq = io->cq = NULL;
+  io->sqes = NULL;
+}
+
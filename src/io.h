@@ -0,0 +1,239 @@
+/* -*- coding: utf-8 -*- */
+/**
+ * pramfusehpc — Persistent RAM FUSE filesystem
+ * 
+ * Copyright (C) 2013  André Technology (mattias@andretechnology.com)
+ * 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef PRAM_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+
+/**
+ * The maximum number of reads and writes that are queued to be made together
+ */
+#ifndef PRAM_IO_DEPTH
+  #define PRAM_IO_DEPTH  8
+#endif
+
+
+
+/**
+ * A queued read or write
+ */
+struct pram_io_op
+{
+  /**
+   * The file descriptor
+   */
+  int fd;
+  
+  /**
+   * Whether the operation is a write rather than a read
+   */
+  char write;
+  
+  /**
+   * Whether the operation is done, successfully or not
+   */
+  char finished;
+  
+  /**
+   * Whether the operation is submitted to the kernel and not yet completed
+   */
+  char submitted;
+  
+  /**
+   * The buffer to read into or write from
+   */
+  char* buf;
+  
+  /**
+   * The number of bytes to read or write
+   */
+  size_t len;
+  
+  /**
+   * The offset in the file
+   */
+  off_t off;
+  
+  /**
+   * The number of bytes that have been read or written, reads stop early at the end of the file
+   */
+  size_t done;
+  
+  /**
+   * The error that stopped the operation, zero if none
+   */
+  int error;
+};
+
+
+/**
+ * Reads and writes that are queued and then made together, with io_uring
+ * if the program is built with `PRAM_IO_URING` and the kernel allows it,
+ * otherwise one by one with `pread` and `pwrite`, each thread needs its own
+ */
+typedef struct
+{
+  /**
+   * The queued operations, in the order they were queued
+   */
+  struct pram_io_op ops[PRAM_IO_DEPTH];
+  
+  /**
+   * The number of queued operations
+   */
+  size_t opn;
+  
+  /**
+   * The io_uring file descriptor, -1 if io_uring is not used
+   */
+  int ring;
+  
+  /**
+   * The mapping of the submission queue ring
+   */
+  void* sq;
+  
+  /**
+   * The size of `sq`
+   */
+  size_t sq_size;
+  
+  /**
+   * The mapping of the completion queue ring, it is `sq` if they share their mapping
+   */
+  void* cq;
+  
+  /**
+   * The size of `cq`
+   */
+  size_t cq_size;
+  
+  /**
+   * The submission queue entries
+   */
+  struct io_uring_sqe* sqes;
+  
+  /**
+   * The size of `sqes`
+   */
+  size_t sqes_size;
+  
+  /**
+   * The number of entries in the submission queue
+   */
+  unsigned entries;
+  
+  /**
+   * The first entry in the submission queue the kernel has not consumed
+   */
+  unsigned* sq_head;
+  
+  /**
+   * Where the next entry is put in the submission queue
+   */
+  unsigned* sq_tail;
+  
+  /**
+   * Mask that turns a position into an index in the submission queue
+   */
+  unsigned* sq_mask;
+  
+  /**
+   * The indices of the entries in the submission queue in `sqes`
+   */
+  unsigned* sq_array;
+  
+  /**
+   * The first completion that has not been reaped
+   */
+  unsigned* cq_head;
+  
+  /**
+   * Where the kernel puts the next completion
+   */
+  unsigned* cq_tail;
+  
+  /**
+   * Mask that turns a position into an index in the completion queue
+   */
+  unsigned* cq_mask;
+  
+  /**
+   * The completions
+   */
+  struct io_uring_cqe* cqes;
+} pram_io;
+
+
+
+/**
+ * Initialise a queue of reads and writes, setting up io_uring if it is used
+ * 
+ * @param  io  The queue
+ */
+void pram_io_init(pram_io* io);
+
+/**
+ * Queue a read or a write
+ * 
+ * @param   io     The queue
+ * @param   fd     The file descriptor
+ * @param   write  Whether to write rather than read
+ * @param   buf    The buffer to read into or write from, it must be kept until `pram_io_run` returns
+ * @param   len    The number of bytes to read or write
+ * @param   off    The offset in the file
+ * @return         Zero on success, -1 if `PRAM_IO_DEPTH` operations are already queued
+ */
+int pram_io_queue(pram_io* io, int fd, int write, void* buf, size_t len, off_t off);
+
+/**
+ * Make all queued reads and writes, and wait for them to finish, the results are
+ * left in `io->ops` until the queue is cleared with `pram_io_clear`, writes are
+ * made whole unless they fail, reads stop early only at the end of the file or if
+ * they fail, the operations are not made in any specific order
+ * 
+ * @param  io  The queue
+ */
+void pram_io_run(pram_io* io);
+
+/**
+ * Remove all operations from a queue
+ * 
+ * @param  io  The queue
+ */
+void pram_io_clear(pram_io* io);
+
+/**
+ * Free the resources of a queue
+ * 
+ * @param  io  The queue
+ */
+void pram_io_destroy(pram_io* io);
+
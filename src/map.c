@@ -22,6 +22,62 @@
 
 
 
+/**
+ * The current epoch, incremented each time an allocation is retired
+ */
+static unsigned long pram_map_epoch = 1;
+
+/**
+ * All threads' announcements of their read-side critical sections,
+ * announcements are never removed, but reused after threads exit
+ */
+static struct pram_map_reader* pram_map_readers = NULL;
+
+/**
+ * The calling thread's announcement
+ */
+static __thread struct pram_map_reader* pram_map_reader = NULL;
+
+/**
+ * Key used to release a thread's announcement when the thread exits
+ */
+static pthread_key_t pram_map_reader_key;
+
+/**
+ * Used to create `pram_map_reader_key` once
+ */
+static pthread_once_t pram_map_reader_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Retired allocations that have not yet been freed, newest first
+ */
+static struct pram_map_retired* pram_map_retired = NULL;
+
+/**
+ * The number of elements in `pram_map_retired`
+ */
+static long pram_map_retired_count = 0;
+
+/**
+ * Mutex for `pram_map_retired`
+ */
+static pthread_mutex_t pram_map_retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/**
+ * Free an allocation, or return it to its pool, once no thread is in a read-side
+ * critical section it may have found the allocation in, this may not be done in
+ * a read-side critical section
+ * 
+ * @param  pool  The pool the allocation was made from, `NULL` if it was made with `malloc`
+ * @param  ptr   The allocation, it must no longer be reachable for new readers
+ * @param  size  The size of the allocation, ignored if `pool` is `NULL`
+ */
+static void pram__map_defer(struct pram_map_pool* pool, void* ptr, size_t size);
+
+
+
 /**
  * Initialises a map
  * 
@@ -29,16 +85,210 @@
  */
 void pram_map_init(pram_map* map)
 {
-  long i;
-  void** level;
-  map->data = level = (void**)malloc((MAP_PER_LEVEL + 1) * sizeof(void*));
-  for (i = 0; i <= MAP_PER_LEVEL; i++)
-    *(level + i) = NULL;
+  map->root = NULL;
+  map->pool = (struct pram_map_pool*)calloc(1, sizeof(struct pram_map_pool));
+}
+
+
+/**
+ * Allocate memory from a map's pool, this may only be done by the thread modifying the map
+ * 
+ * @param   pool  The map's pool
+ * @param   size  The number of bytes to allocate
+ * @return        The allocation, `NULL` on error, it is allocated with `malloc`
+ *                if `size` is larger than `MAP_POOL_MAX`
+ */
+static void* pram__map_alloc(struct pram_map_pool* pool, size_t size)
+{
+  struct pram_map_block* block;
+  struct pram_map_block* next;
+  size_t c;
+  void** slab;
+  if (size > MAP_POOL_MAX)
+    return malloc(size);
+  c = (size - 1) / MAP_POOL_ALIGN;
+  if ((pool->free[c] == NULL) && __atomic_load_n(&(pool->returned), __ATOMIC_RELAXED))
+    for (block = __atomic_exchange_n(&(pool->returned), NULL, __ATOMIC_ACQUIRE); block; block = next)
+      {
+	next = block->next;
+	block->next = pool->free[block->size_class];
+	pool->free[block->size_class] = block;
+      }
+  if ((block = pool->free[c]))
+    {
+      pool->free[c] = block->next;
+      return block;
+    }
+  size = (c + 1) * MAP_POOL_ALIGN;
+  if (pool->unused_size < size)
+    {
+      if ((slab = (void**)malloc(MAP_SLAB_SIZE)) == NULL)
+	return NULL;
+      /* Keep the end of the old slab for smaller allocations */
+      if (pool->unused_size)
+	{
+	  block = (struct pram_map_block*)(pool->unused);
+	  c = pool->unused_size / MAP_POOL_ALIGN - 1;
+	  block->next = pool->free[c];
+	  pool->free[c] = block;
+	}
+      *slab = pool->slabs;
+      pool->slabs = slab;
+      pool->unused = (char*)slab + MAP_POOL_ALIGN;
+      pool->unused_size = MAP_SLAB_SIZE - MAP_POOL_ALIGN;
+    }
+  pool->unused += size;
+  pool->unused_size -= size;
+  return pool->unused - size;
+}
+
+
+/**
+ * Free an allocation, returning it to the pool it was allocated
+ * from, this may be done by any thread
+ * 
+ * @param  pool  The pool, `NULL` if the allocation was made with `malloc`
+ * @param  ptr   The allocation
+ * @param  size  The size of the allocation
+ */
+static void pram__map_dispose(struct pram_map_pool* pool, void* ptr, size_t size)
+{
+  struct pram_map_block* block = (struct pram_map_block*)ptr;
+  if (pool == NULL)
+    {
+      free(ptr);
+      return;
+    }
+  /* The thread modifying the map sorts the block into its size class when it needs it */
+  block->size_class = (size - 1) / MAP_POOL_ALIGN;
+  block->next = __atomic_load_n(&(pool->returned), __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&(pool->returned), &(block->next), block, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+
+/**
+ * Gets the size of the allocation of a node or a leaf
+ * 
+ * @param   at  The node or leaf
+ * @return      The size of the allocation
+ */
+static size_t pram__map_size(void* at)
+{
+  struct pram_map_node* node = (struct pram_map_node*)at;
+  if (MAP_IS_LEAF(at))
+    return sizeof(struct pram_map_leaf) + (strlen(MAP_LEAF(at)->key) + 1) * sizeof(char);
+  return MAP_NODE_SIZE(node->type) + node->prefix_len;
+}
+
+
+/**
+ * Free a node or a leaf once no reader can be using it
+ * 
+ * @param  pool  The pool of the map the node or leaf was in
+ * @param  at    The node or leaf, it must no longer be reachable for new readers
+ */
+static void pram__map_release(struct pram_map_pool* pool, void* at)
+{
+  size_t size = pram__map_size(at);
+  void* ptr = MAP_IS_LEAF(at) ? (void*)MAP_LEAF(at) : at;
+  __atomic_add_fetch(&(pool->version), 1, __ATOMIC_SEQ_CST);
+  pram__map_defer(size > MAP_POOL_MAX ? NULL : pool, ptr, size);
+}
+
+
+/**
+ * Gets the slot a node keeps its child for a key byte in, this may be done
+ * concurrently with changes to the map if it is done in a read-side critical section
+ * 
+ * @param   node  The node
+ * @param   byte  The key byte
+ * @return        The slot, `NULL` if the node has no slot for the byte
+ */
+static void** pram__map_slot(struct pram_map_node* node, unsigned char byte)
+{
+  size_t i;
+  switch (node->type)
+    {
+    case MAP_NODE4:
+      {
+	struct pram_map_node4* node4 = (struct pram_map_node4*)node;
+	for (i = 0; i < node->count; i++)
+	  if (*(node4->keys + i) == byte)
+	    return node4->children + i;
+	return NULL;
+      }
+    case MAP_NODE16:
+      {
+	struct pram_map_node16* node16 = (struct pram_map_node16*)node;
+	#ifdef __SSE2__
+	__m128i keys = _mm_loadu_si128((const __m128i*)(node16->keys));
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(keys, _mm_set1_epi8((char)byte)));
+	/* Unused key bytes are zero, and zero is a valid key byte */
+	mask &= (1 << node->count) - 1;
+	return mask ? node16->children + __builtin_ctz((unsigned)mask) : NULL;
+	#else
+	for (i = 0; i < node->count; i++)
+	  if (*(node16->keys + i) == byte)
+	    return node16->children + i;
+	return NULL;
+	#endif
+      }
+    case MAP_NODE48:
+      {
+	struct pram_map_node48* node48 = (struct pram_map_node48*)node;
+	/* The child is stored before its index, so it is there if the index is */
+	i = __atomic_load_n(node48->index + byte, __ATOMIC_ACQUIRE);
+	return i ? node48->children + i - 1 : NULL;
+      }
+    default:
+      return ((struct pram_map_node256*)node)->children + byte;
+    }
+}
+
+
+/**
+ * Gets the number of positions `pram__map_nth` accepts for a node
+ * 
+ * @param   node  The node
+ * @return        The number of positions
+ */
+static inline size_t pram__map_span(struct pram_map_node* node)
+{
+  return node->type < MAP_NODE48 ? node->count : 256;
+}
+
+
+/**
+ * Gets one of the children of a node, for iterating over them, this may be done
+ * concurrently with changes to the map if it is done in a read-side critical section
+ * 
+ * @param   node  The node
+ * @param   i     The position, less than `pram__map_span(node)`
+ * @param   byte  Output parameter for the key byte that selects the child
+ * @return        The child, `NULL` if there is none at the position
+ */
+static void* pram__map_nth(struct pram_map_node* node, size_t i, unsigned char* byte)
+{
+  switch (node->type)
+    {
+    case MAP_NODE4:
+      *byte = *(((struct pram_map_node4*)node)->keys + i);
+      return __atomic_load_n(((struct pram_map_node4*)node)->children + i, __ATOMIC_ACQUIRE);
+    case MAP_NODE16:
+      *byte = *(((struct pram_map_node16*)node)->keys + i);
+      return __atomic_load_n(((struct pram_map_node16*)node)->children + i, __ATOMIC_ACQUIRE);
+    default:
+      *byte = (unsigned char)i;
+      void** slot = pram__map_slot(node, (unsigned char)i);
+      return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+    }
 }
 
 
 /**
- * Gets the value for a key in a map
+ * Gets the value for a key in a map, this may be done concurrently with
+ * `pram_map_put` if it is done in a read-side critical section
  * 
  * @param   map  The address of the map
  * @param   key  The key
@@ -46,35 +296,411 @@ void pram_map_init(pram_map* map)
  */
 void* pram_map_get(pram_map* map, const char* key)
 {
-  void** at = map->data;
-  long lv;
-  while (*key)
+  void* at = __atomic_load_n(&(map->root), __ATOMIC_ACQUIRE);
+  struct pram_map_node* node;
+  void** slot;
+  size_t i;
+  while (at && !MAP_IS_LEAF(at))
+    {
+      node = (struct pram_map_node*)at;
+      /* Prefixes do not contain NUL bytes, so this stops at the end of the key */
+      for (i = 0; i < node->prefix_len; i++)
+	if (*(MAP_PREFIX(node) + i) != (unsigned char)*key++)
+	  return NULL;
+      if ((slot = pram__map_slot(node, (unsigned char)*key)) == NULL)
+	return NULL;
+      key += *key != 0;
+      at = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+  if ((at == NULL) || strcmp(MAP_LEAF(at)->key, key))
+    return NULL;
+  return __atomic_load_n(&(MAP_LEAF(at)->value), __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Gets the value for a key in a map, resuming the search where an earlier one
+ * left off if the key begins the same way, this may be done concurrently with
+ * `pram_map_put` if it is done in a read-side critical section
+ * 
+ * @param   map     The address of the map
+ * @param   key     The key
+ * @param   shared  The number of bytes at the beginning of the key that following
+ *                  keys are expected to begin with too, such as the directory of a file
+ * @param   finger  Where the search can be resumed, updated for following keys,
+ *                  it must be zeroed before its first use
+ * @return          The value, `NULL` if not found
+ */
+void* pram_map_get_near(pram_map* map, const char* key, size_t shared, pram_map_finger* finger)
+{
+  /* Nothing that was reachable when the version was read is freed before the read-side critical section ends */
+  unsigned long version = __atomic_load_n(&(map->pool->version), __ATOMIC_SEQ_CST);
+  const char* start = key;
+  struct pram_map_node* node;
+  void* found = NULL;
+  size_t depth = 0, found_depth = 0;
+  void** slot;
+  size_t i;
+  void* at;
+  char* new;
+  if (finger->node && (finger->pool == map->pool) && (finger->version == version) &&
+      (finger->depth <= shared) && (strncmp(key, finger->key, finger->depth) == 0))
+    {
+      at = finger->node;
+      key += depth = finger->depth;
+    }
+  else
+    at = __atomic_load_n(&(map->root), __ATOMIC_ACQUIRE);
+  while (at && !MAP_IS_LEAF(at))
+    {
+      node = (struct pram_map_node*)at;
+      if (depth <= shared)
+	{
+	  found = at;
+	  found_depth = depth;
+	}
+      /* Prefixes do not contain NUL bytes, so this stops at the end of the key */
+      for (i = 0; i < node->prefix_len; i++)
+	if (*(MAP_PREFIX(node) + i) != (unsigned char)*(key + i))
+	  break;
+      if ((i < node->prefix_len) || ((slot = pram__map_slot(node, (unsigned char)*(key + i))) == NULL))
+	{
+	  at = NULL;
+	  break;
+	}
+      key += i;
+      depth += i + (*key != 0);
+      key += *key != 0;
+      at = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+  if (found && ((found != finger->node) || (finger->version != version) || (finger->pool != map->pool)))
+    {
+      /* `key` is allocated even if it is empty, so that a finger with a node has one */
+      if (found_depth >= finger->size)
+	{
+	  if ((new = (char*)realloc(finger->key, (found_depth + 1) * 2 * sizeof(char))) == NULL)
+	    found = NULL;
+	  else
+	    {
+	      finger->key = new;
+	      finger->size = (found_depth + 1) * 2;
+	    }
+	}
+      /* The old finger is still right if its version is current, otherwise it is rejected by it */
+      if (found)
+	{
+	  memcpy(finger->key, start, found_depth * sizeof(char));
+	  finger->node = found;
+	  finger->pool = map->pool;
+	  finger->version = version;
+	  finger->depth = found_depth;
+	}
+    }
+  if ((at == NULL) || strcmp(MAP_LEAF(at)->key, key))
+    return NULL;
+  return __atomic_load_n(&(MAP_LEAF(at)->value), __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Creates a node
+ * 
+ * @param   map         The map
+ * @param   type        The node type
+ * @param   prefix      The node's prefix, `NULL` to leave it for the caller to fill in
+ * @param   prefix_len  The length of the node's prefix
+ * @return              The node
+ */
+static struct pram_map_node* pram__map_node(pram_map* map, int type, const unsigned char* prefix, size_t prefix_len)
+{
+  struct pram_map_node* node = (struct pram_map_node*)pram__map_alloc(map->pool, MAP_NODE_SIZE(type) + prefix_len);
+  memset(node, 0, MAP_NODE_SIZE(type));
+  node->type = (unsigned char)type;
+  node->prefix_len = prefix_len;
+  if (prefix && prefix_len)
+    memcpy(MAP_PREFIX(node), prefix, prefix_len);
+  return node;
+}
+
+
+/**
+ * Creates a leaf
+ * 
+ * @param   map    The map
+ * @param   key    The rest of the key
+ * @param   value  The value
+ * @return         The leaf, as a child
+ */
+static void* pram__map_leaf(pram_map* map, const char* key, void* value)
+{
+  size_t n = strlen(key) + 1;
+  struct pram_map_leaf* leaf = (struct pram_map_leaf*)pram__map_alloc(map->pool, sizeof(struct pram_map_leaf) + n * sizeof(char));
+  leaf->value = value;
+  memcpy(leaf->key, key, n * sizeof(char));
+  return MAP_CHILD(leaf);
+}
+
+
+/**
+ * Adds a child to a node that has room for it, the node must not be
+ * reachable by readers unless it is a `MAP_NODE48` or a `MAP_NODE256`
+ * 
+ * @param  node   The node
+ * @param  byte   The key byte that shall select the child
+ * @param  child  The child
+ */
+static void pram__map_put_child(struct pram_map_node* node, unsigned char byte, void* child)
+{
+  switch (node->type)
     {
-      #define __(L)											\
-	lv = (long)((*key >> ((MAP_LEVELS - L - 1) * MAP_BIT_PER_LEVEL)) & (MAP_PER_LEVEL - 1));	\
-	if (*(at + lv))											\
-	  at = (void**)*(at + lv);									\
-	else												\
-	  return NULL
-      __(0);
-      #if MAP_LB_LEVELS >= 1
-      __(1);
-      #endif
-      #if MAP_LB_LEVELS >= 2
-      __(2);  __(3);
-      #endif
-      #if MAP_LB_LEVELS >= 3
-      __(4);  __(5);  __(6);  __(7);
-      #endif
-      #undef __
-      key++;
+    case MAP_NODE4:
+      *(((struct pram_map_node4*)node)->keys + node->count) = byte;
+      *(((struct pram_map_node4*)node)->children + node->count) = child;
+      break;
+    case MAP_NODE16:
+      *(((struct pram_map_node16*)node)->keys + node->count) = byte;
+      *(((struct pram_map_node16*)node)->children + node->count) = child;
+      break;
+    case MAP_NODE48:
+      /* Readers find the child through the index, so the index is stored last */
+      __atomic_store_n(((struct pram_map_node48*)node)->children + node->count, child, __ATOMIC_RELAXED);
+      __atomic_store_n(((struct pram_map_node48*)node)->index + byte, (unsigned char)(node->count + 1), __ATOMIC_RELEASE);
+      break;
+    default:
+      __atomic_store_n(((struct pram_map_node256*)node)->children + byte, child, __ATOMIC_RELEASE);
+      break;
     }
-  return *(at + MAP_PER_LEVEL);
+  node->count++;
+}
+
+
+/**
+ * Creates a copy of a node with the same children
+ * 
+ * @param   map         The map
+ * @param   node        The node
+ * @param   type        The type of the copy, it must have room for the children
+ * @param   prefix      The prefix of the copy, `NULL` to leave it for the caller to fill in
+ * @param   prefix_len  The length of the prefix of the copy
+ * @param   skip        The key byte of a child that shall not be copied, -1 for none
+ * @return              The copy
+ */
+static struct pram_map_node* pram__map_copy(pram_map* map, struct pram_map_node* node, int type,
+					    const unsigned char* prefix, size_t prefix_len, int skip)
+{
+  struct pram_map_node* copy = pram__map_node(map, type, prefix, prefix_len);
+  size_t i, n = pram__map_span(node);
+  unsigned char byte;
+  void* child;
+  for (i = 0; i < n; i++)
+    if ((child = pram__map_nth(node, i, &byte)) && ((int)byte != skip))
+      pram__map_put_child(copy, byte, child);
+  return copy;
 }
 
 
 /**
- * Sets the value for a key in a map
+ * Replace a node that readers may be using
+ * 
+ * @param  map   The map
+ * @param  ref   The slot the node is stored in
+ * @param  node  The node
+ * @param  new   The replacement
+ */
+static void pram__map_replace(pram_map* map, void** ref, struct pram_map_node* node, void* new)
+{
+  __atomic_store_n(ref, new, __ATOMIC_RELEASE);
+  pram__map_release(map->pool, node);
+}
+
+
+/**
+ * Gets a node or a leaf with the beginning of its prefix, or of the rest of its
+ * key, replaced, so that it can be put at another depth, the node or leaf is
+ * not changed, and it is not released
+ * 
+ * @param   map     The map
+ * @param   at      The node or leaf
+ * @param   offset  The number of bytes to remove from the beginning
+ * @param   bytes   Bytes to add to the beginning, may be `NULL` if `n` is zero
+ * @param   n       The number of bytes in `bytes`
+ * @param   byte    Byte to add after `bytes`, -1 for none
+ * @return          `at` if nothing is changed, otherwise a new node or leaf
+ */
+static void* pram__map_rebase(pram_map* map, void* at, size_t offset, const void* bytes, size_t n, int byte)
+{
+  struct pram_map_node* node = (struct pram_map_node*)at;
+  struct pram_map_leaf* leaf;
+  size_t m = n + (byte >= 0);
+  const char* old;
+  char* new;
+  size_t old_len;
+  if ((offset == 0) && (m == 0))
+    return at;
+  if (MAP_IS_LEAF(at))
+    {
+      old = MAP_LEAF(at)->key + offset;
+      old_len = strlen(old) + 1;
+      leaf = (struct pram_map_leaf*)pram__map_alloc(map->pool, sizeof(struct pram_map_leaf) + (m + old_len) * sizeof(char));
+      leaf->value = MAP_LEAF(at)->value;
+      new = leaf->key;
+      at = MAP_CHILD(leaf);
+    }
+  else
+    {
+      old = (const char*)MAP_PREFIX(node) + offset;
+      old_len = node->prefix_len - offset;
+      at = pram__map_copy(map, node, node->type, NULL, m + old_len, -1);
+      new = (char*)MAP_PREFIX((struct pram_map_node*)at);
+    }
+  if (n)
+    memcpy(new, bytes, n);
+  if (byte >= 0)
+    *(new + n) = (char)byte;
+  memcpy(new + m, old, old_len);
+  return at;
+}
+
+
+/**
+ * Adds a child to a node, replacing the node if readers could see it change
+ * 
+ * @param  map    The map
+ * @param  ref    The slot the node is stored in
+ * @param  node   The node
+ * @param  byte   The key byte that shall select the child
+ * @param  child  The child
+ */
+static void pram__map_add(pram_map* map, void** ref, struct pram_map_node* node, unsigned char byte, void* child)
+{
+  struct pram_map_node* new;
+  int type = node->type;
+  if ((type >= MAP_NODE48) && (node->count < MAP_CAPACITY(type)))
+    {
+      pram__map_put_child(node, byte, child);
+      return;
+    }
+  /* Readers may be searching the node, so it is replaced rather than changed */
+  if (node->count == MAP_CAPACITY(type))
+    type++;
+  new = pram__map_copy(map, node, type, MAP_PREFIX(node), node->prefix_len, -1);
+  pram__map_put_child(new, byte, child);
+  pram__map_replace(map, ref, node, new);
+}
+
+
+/**
+ * Remove a child from a node, merging the node into its other child
+ * if it only has one left, or shrinking it if it becomes sparse,
+ * the child is not released
+ * 
+ * @param  map   The map
+ * @param  ref   The slot the node is stored in
+ * @param  node  The node
+ * @param  byte  The key byte that selects the child
+ */
+static void pram__map_remove(pram_map* map, void** ref, struct pram_map_node* node, unsigned char byte)
+{
+  size_t i, n = (size_t)(node->count - 1), span = pram__map_span(node);
+  unsigned char b = 0;
+  void* child = NULL;
+  void* merged;
+  if (n == 1)
+    {
+      for (i = 0; i < span; i++)
+	if ((child = pram__map_nth(node, i, &b)) && (b != byte))
+	  break;
+      /* The node's prefix and the child's key byte are put before the child's prefix,
+	 or before the rest of the child's key, unless the key byte ends the key */
+      merged = pram__map_rebase(map, child, 0, MAP_PREFIX(node), node->prefix_len, b ? b : -1);
+      pram__map_replace(map, ref, node, merged);
+      if (merged != child)
+	pram__map_release(map->pool, child);
+      return;
+    }
+  /* A `MAP_NODE256` is changed in place until it is sparse enough that it would not grow right back,
+     a `MAP_NODE48` is not, as readers that have found a child's index could find its slot reused */
+  if ((node->type == MAP_NODE256) && (n > 36))
+    {
+      __atomic_store_n(((struct pram_map_node256*)node)->children + byte, NULL, __ATOMIC_RELEASE);
+      node->count--;
+      return;
+    }
+  i = n <= 4 ? MAP_NODE4 : n <= 16 ? MAP_NODE16 : n <= 48 ? MAP_NODE48 : MAP_NODE256;
+  pram__map_replace(map, ref, node, pram__map_copy(map, node, (int)i, MAP_PREFIX(node), node->prefix_len, byte));
+}
+
+
+/**
+ * Finds the node or leaf under which all keys that begin with a prefix are, this may be
+ * done concurrently with changes to the map if it is done in a read-side critical section
+ * 
+ * @param   map     The map
+ * @param   prefix  The prefix
+ * @param   place   Output parameter for where the node or leaf is
+ * @return          The node or leaf, `NULL` if no key begins with the prefix
+ */
+static void* pram__map_find(pram_map* map, const char* prefix, struct pram_map_place* place)
+{
+  void** ref = &(map->root);
+  struct pram_map_node* node;
+  const char* key;
+  void* at;
+  size_t i;
+  place->parent_ref = NULL;
+  place->parent = NULL;
+  for (;;)
+    {
+      if ((at = __atomic_load_n(ref, __ATOMIC_ACQUIRE)) == NULL)
+	return NULL;
+      place->ref = ref;
+      if (MAP_IS_LEAF(at))
+	{
+	  key = MAP_LEAF(at)->key;
+	  for (i = 0; *(prefix + i); i++)
+	    if (*(key + i) != *(prefix + i))
+	      return NULL;
+	  place->offset = i;
+	  return at;
+	}
+      node = (struct pram_map_node*)at;
+      for (i = 0; (i < node->prefix_len) && *(prefix + i); i++)
+	if (*(MAP_PREFIX(node) + i) != (unsigned char)*(prefix + i))
+	  return NULL;
+      if (*(prefix + i) == 0)
+	{
+	  place->offset = i;
+	  return at;
+	}
+      prefix += i;
+      if ((ref = pram__map_slot(node, (unsigned char)*prefix)) == NULL)
+	return NULL;
+      place->parent_ref = place->ref;
+      place->parent = node;
+      place->byte = (unsigned char)*prefix++;
+    }
+}
+
+
+/**
+ * Unlink a node or a leaf from a map, it is not released
+ * 
+ * @param  map    The map
+ * @param  place  Where the node or leaf is
+ */
+static void pram__map_unlink(pram_map* map, struct pram_map_place* place)
+{
+  if (place->parent)
+    pram__map_remove(map, place->parent_ref, place->parent, place->byte);
+  else
+    __atomic_store_n(place->ref, NULL, __ATOMIC_RELEASE);
+  /* A finger into the node would otherwise find its keys under the old prefix */
+  __atomic_add_fetch(&(map->pool->version), 1, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Sets the value for a key in a map, calls for the same map must be serialised
  * 
  * @param  map    The address of the map
  * @param  key    The key
@@ -82,78 +708,619 @@ void* pram_map_get(pram_map* map, const char* key)
  */
 void pram_map_put(pram_map* map, const char* key, void* value)
 {
-  void** at = map->data;
-  long i, lv;
-  while (*key)
+  struct pram_map_place place;
+  void** ref = &(map->root);
+  const unsigned char* prefix;
+  struct pram_map_node* node;
+  struct pram_map_node* new;
+  const char* rest;
+  void** slot;
+  void* at;
+  void* moved;
+  size_t i;
+  place.parent_ref = NULL;
+  place.parent = NULL;
+  while ((at = *ref) && !MAP_IS_LEAF(at))
+    {
+      node = (struct pram_map_node*)at;
+      prefix = MAP_PREFIX(node);
+      for (i = 0; i < node->prefix_len; i++)
+	if (*(prefix + i) != (unsigned char)*(key + i))
+	  break;
+      if (i < node->prefix_len)
+	{
+	  if (value == NULL)
+	    return;
+	  /* Split the prefix where the key differs from it */
+	  new = pram__map_node(map, MAP_NODE4, prefix, i);
+	  pram__map_put_child(new, *(prefix + i), pram__map_rebase(map, node, i + 1, NULL, 0, -1));
+	  pram__map_put_child(new, (unsigned char)*(key + i), pram__map_leaf(map, key + i + (*(key + i) != 0), value));
+	  pram__map_replace(map, ref, node, new);
+	  return;
+	}
+      key += i;
+      if (((slot = pram__map_slot(node, (unsigned char)*key)) == NULL) || (*slot == NULL))
+	{
+	  if (value)
+	    pram__map_add(map, ref, node, (unsigned char)*key, pram__map_leaf(map, key + (*key != 0), value));
+	  return;
+	}
+      place.parent_ref = ref;
+      place.parent = node;
+      place.byte = (unsigned char)*key;
+      key += *key != 0;
+      ref = slot;
+    }
+  if (at == NULL)
+    {
+      if (value)
+	__atomic_store_n(ref, pram__map_leaf(map, key, value), __ATOMIC_RELEASE);
+      return;
+    }
+  rest = MAP_LEAF(at)->key;
+  if (strcmp(rest, key) == 0)
     {
-      #define __(L, END)										\
-	lv = (long)((*key >> ((MAP_LEVELS - L - 1) * MAP_BIT_PER_LEVEL)) & (MAP_PER_LEVEL - 1));	\
-        if (*(at + lv))											\
-	  at = (void**)*(at + lv);					       				\
-	else												\
-	  {												\
-	    at = (void**)(*(at + lv) = (void*)malloc((MAP_PER_LEVEL + (END)) * sizeof(void*)));		\
-	    for (i = 0; i < MAP_PER_LEVEL + (END); i++)							\
-	      *(at + i) = NULL;										\
-	  }
-      __(0, MAP_LB_LEVELS == 0);
-      #if MAP_LB_LEVELS >= 1
-      __(1, MAP_LB_LEVELS == 1);
-      #endif
-      #if MAP_LB_LEVELS >= 2
-      __(2, 0);  __(3, MAP_LB_LEVELS == 2);
-      #endif
-      #if MAP_LB_LEVELS >= 3
-      __(4, 0);  __(5, 0);  __(6, 0);  __(7, MAP_LB_LEVELS == 3);
-      #endif
-      #undef __
-      key++;
+      if (value)
+	__atomic_store_n(&(MAP_LEAF(at)->value), value, __ATOMIC_RELEASE);
+      else
+	{
+	  place.ref = ref;
+	  pram__map_unlink(map, &place);
+	  pram__map_release(map->pool, at);
+	}
+      return;
     }
-  *(at + MAP_PER_LEVEL) = value;
+  if (value == NULL)
+    return;
+  /* Put the leaf and the new key under a node with the part they share as its prefix */
+  for (i = 0; *(rest + i) == *(key + i); i++)
+    ;
+  new = pram__map_node(map, MAP_NODE4, (const unsigned char*)key, i);
+  moved = pram__map_rebase(map, at, i + (*(rest + i) != 0), NULL, 0, -1);
+  pram__map_put_child(new, (unsigned char)*(rest + i), moved);
+  pram__map_put_child(new, (unsigned char)*(key + i), pram__map_leaf(map, key + i + (*(key + i) != 0), value));
+  __atomic_store_n(ref, (void*)new, __ATOMIC_RELEASE);
+  if (moved != at)
+    pram__map_release(map->pool, at);
 }
 
 
 /**
- * Frees a level and all sublevels in a map
+ * Put a node or a leaf, with the keys under it, in a map under a prefix
  * 
- * @param  level        The level
- * @param  level_depth  The level measured in depth
+ * @param   map     The map
+ * @param   prefix  The prefix
+ * @param   at      The node or leaf
+ * @param   offset  The number of bytes to remove from the beginning of the
+ *                  prefix of the node, or of the rest of the key of the leaf
+ * @return          `at`, or the changed copy of `at`, that was put in the map,
+ *                  `NULL` if a key in the map already begins with the prefix
  */
-static void pram__map_free(void** level, long level_depth)
+static void* pram__map_attach(pram_map* map, const char* prefix, void* at, size_t offset)
 {
-  long i, next_level_depth = level_depth + 1;
-  void* value;
-  if (level == NULL)
+  void** ref = &(map->root);
+  const unsigned char* bytes;
+  struct pram_map_node* node;
+  struct pram_map_node* new;
+  const char* rest;
+  void** slot;
+  void* here;
+  void* moved;
+  void* copy;
+  size_t i;
+  for (;;)
+    {
+      if ((here = *ref) == NULL)
+	{
+	  moved = pram__map_rebase(map, at, offset, prefix, strlen(prefix), -1);
+	  __atomic_store_n(ref, moved, __ATOMIC_RELEASE);
+	  return moved;
+	}
+      if (*prefix == 0)
+	return NULL;
+      if (MAP_IS_LEAF(here))
+	{
+	  rest = MAP_LEAF(here)->key;
+	  for (i = 0; *(prefix + i) && (*(rest + i) == *(prefix + i)); i++)
+	    ;
+	  if (*(prefix + i) == 0)
+	    return NULL;
+	  new = pram__map_node(map, MAP_NODE4, (const unsigned char*)prefix, i);
+	  copy = pram__map_rebase(map, here, i + (*(rest + i) != 0), NULL, 0, -1);
+	  pram__map_put_child(new, (unsigned char)*(rest + i), copy);
+	  prefix += i;
+	  moved = pram__map_rebase(map, at, offset, prefix + 1, strlen(prefix + 1), -1);
+	  pram__map_put_child(new, (unsigned char)*prefix, moved);
+	  __atomic_store_n(ref, (void*)new, __ATOMIC_RELEASE);
+	  if (copy != here)
+	    pram__map_release(map->pool, here);
+	  return moved;
+	}
+      node = (struct pram_map_node*)here;
+      bytes = MAP_PREFIX(node);
+      for (i = 0; (i < node->prefix_len) && (*(bytes + i) == (unsigned char)*(prefix + i)); i++)
+	;
+      if (*(prefix + i) == 0)
+	return NULL;
+      if (i < node->prefix_len)
+	{
+	  new = pram__map_node(map, MAP_NODE4, bytes, i);
+	  pram__map_put_child(new, *(bytes + i), pram__map_rebase(map, node, i + 1, NULL, 0, -1));
+	  prefix += i;
+	  moved = pram__map_rebase(map, at, offset, prefix + 1, strlen(prefix + 1), -1);
+	  pram__map_put_child(new, (unsigned char)*prefix, moved);
+	  pram__map_replace(map, ref, node, new);
+	  return moved;
+	}
+      prefix += i;
+      if (((slot = pram__map_slot(node, (unsigned char)*prefix)) == NULL) || (*slot == NULL))
+	{
+	  moved = pram__map_rebase(map, at, offset, prefix + 1, strlen(prefix + 1), -1);
+	  pram__map_add(map, ref, node, (unsigned char)*prefix, moved);
+	  return moved;
+	}
+      ref = slot;
+      prefix++;
+    }
+}
+
+
+/**
+ * Remove all keys that begin with a prefix from a map, and put them,
+ * without the prefix, in another map, calls for the map must be serialised
+ * 
+ * @param  map      The address of the map
+ * @param  prefix   The prefix
+ * @param  subtree  Output parameter for the map with the removed keys, it shares its
+ *                  memory with `map`, and must be put back with
+ *                  `pram_map_attach` or freed with `pram_map_drop`
+ */
+void pram_map_detach(pram_map* map, const char* prefix, pram_map* subtree)
+{
+  struct pram_map_place place;
+  void* at = pram__map_find(map, prefix, &place);
+  subtree->root = NULL;
+  subtree->pool = map->pool;
+  if (at == NULL)
     return;
-  for (i = 0; i < MAP_PER_LEVEL; i++)
-    pram__map_free((void**)*(level + i), next_level_depth);
-  if ((level_depth & 1) == 0)
-    if ((value = *(level + MAP_PER_LEVEL)))
+  pram__map_unlink(map, &place);
+  subtree->root = pram__map_rebase(map, at, place.offset, NULL, 0, -1);
+  if (subtree->root != at)
+    pram__map_release(map->pool, at);
+}
+
+
+/**
+ * Put the keys of a map made by `pram_map_detach` back in the map they were
+ * removed from, with a prefix, calls for the map must be serialised
+ * 
+ * @param   map      The address of the map
+ * @param   prefix   The prefix
+ * @param   subtree  The map with the keys, it is empty afterwards unless -1 is returned
+ * @return           Zero on success, -1 if a key in `map` already begins with the prefix
+ */
+int pram_map_attach(pram_map* map, const char* prefix, pram_map* subtree)
+{
+  void* moved;
+  if (subtree->root == NULL)
+    return 0;
+  if ((moved = pram__map_attach(map, prefix, subtree->root, 0)) == NULL)
+    return -1;
+  if (moved != subtree->root)
+    pram__map_release(map->pool, subtree->root);
+  subtree->root = NULL;
+  return 0;
+}
+
+
+/**
+ * Replace the beginning of all keys that begin with a prefix in a map,
+ * readers find each key by either the old or the new name while this is
+ * done, calls for the map must be serialised
+ * 
+ * @param   map     The address of the map
+ * @param   source  The prefix the keys begin with
+ * @param   target  The prefix the keys shall begin with instead
+ * @return          Zero on success, -1 if a key in the map already begins with
+ *                  `target`, or if one of the prefixes begins with the other
+ */
+int pram_map_move(pram_map* map, const char* source, const char* target)
+{
+  struct pram_map_place place;
+  size_t n = strlen(source), m = strlen(target);
+  void* moved;
+  void* at;
+  if (strncmp(source, target, n < m ? n : m) == 0)
+    return -1;
+  if ((at = pram__map_find(map, source, &place)) == NULL)
+    return 0;
+  if ((moved = pram__map_attach(map, target, at, place.offset)) == NULL)
+    return -1;
+  /* The keys' old place may have been split, if the prefixes differ within the prefix
+     of the node, or the rest of the key of the leaf, that the keys were found under */
+  at = pram__map_find(map, source, &place);
+  pram__map_unlink(map, &place);
+  if (at != moved)
+    pram__map_release(map->pool, at);
+  return 0;
+}
+
+
+/**
+ * Call a function for each key under a node or a leaf
+ * 
+ * @param   at        The node or leaf
+ * @param   offset    The number of bytes to skip at the beginning of the
+ *                    prefix of the node, or of the rest of the key of the leaf
+ * @param   key       The key bytes that lead to the node or leaf, reallocated as needed
+ * @param   size      The allocation size of `*key`
+ * @param   len       The number of bytes in `*key`
+ * @param   callback  The function
+ * @param   data      Argument for `callback`
+ * @return            Zero on success, -1 on error
+ */
+static int pram__map_scan(void* at, size_t offset, char** key, size_t* size, size_t len,
+			  pram_map_callback* callback, void* data)
+{
+  struct pram_map_node* node = (struct pram_map_node*)at;
+  const char* bytes;
+  size_t i, n, span;
+  unsigned char byte;
+  void* child;
+  char* new;
+  if (MAP_IS_LEAF(at))
+    {
+      bytes = MAP_LEAF(at)->key + offset;
+      n = strlen(bytes) + 1;
+    }
+  else
+    {
+      bytes = (const char*)MAP_PREFIX(node) + offset;
+      n = node->prefix_len - offset;
+    }
+  /* One byte more for the key byte of a child */
+  if (len + n + 1 > *size)
+    {
+      if ((new = (char*)realloc(*key, (len + n + 1) * 2 * sizeof(char))) == NULL)
+	return -1;
+      *key = new;
+      *size = (len + n + 1) * 2;
+    }
+  memcpy(*key + len, bytes, n * sizeof(char));
+  len += n;
+  if (MAP_IS_LEAF(at))
+    {
+      callback(*key, __atomic_load_n(&(MAP_LEAF(at)->value), __ATOMIC_ACQUIRE), data);
+      return 0;
+    }
+  span = pram__map_span(node);
+  for (i = 0; i < span; i++)
+    if ((child = pram__map_nth(node, i, &byte)))
       {
-	if (pram_map_values_ptr == pram_map_values_size)
-	  pram_map_values = (void**)realloc(pram_map_values, (pram_map_values_size <<= 1) * sizeof(void*));
-	*(pram_map_values + pram_map_values_ptr++) = value;
+	/* A leaf under the NUL byte has an empty rest of the key, so the key ends here */
+	*(*key + len) = (char)byte;
+	if (pram__map_scan(child, 0, key, size, len + 1, callback, data) < 0)
+	  return -1;
       }
-  free(level);
+  return 0;
 }
 
 
 /**
- * Frees the resources of a map
+ * Call a function for each key in a map that begins with a prefix, this may be done
+ * concurrently with changes to the map if it is done in a read-side critical section
+ * 
+ * @param   map       The address of the map
+ * @param   prefix    The prefix, the empty string for all keys
+ * @param   callback  The function, it may not change the map
+ * @param   data      Argument for `callback`
+ * @return            Zero on success, -1 on error
+ */
+int pram_map_scan(pram_map* map, const char* prefix, pram_map_callback* callback, void* data)
+{
+  struct pram_map_place place;
+  size_t n = strlen(prefix), size = n + 64;
+  void* at = pram__map_find(map, prefix, &place);
+  char* key;
+  int r;
+  if (at == NULL)
+    return 0;
+  if ((key = (char*)malloc(size * sizeof(char))) == NULL)
+    return -1;
+  memcpy(key, prefix, n * sizeof(char));
+  r = pram__map_scan(at, place.offset, &key, &size, n, callback, data);
+  free(key);
+  return r;
+}
+
+
+/**
+ * Release a node or a leaf and everything under it
+ * 
+ * @param  pool  The pool of the map the node or leaf was in
+ * @param  at    The node or leaf
+ */
+static void pram__map_drop(struct pram_map_pool* pool, void* at)
+{
+  struct pram_map_node* node = (struct pram_map_node*)at;
+  size_t i, n;
+  unsigned char byte;
+  void* child;
+  if (!MAP_IS_LEAF(at))
+    for (i = 0, n = pram__map_span(node); i < n; i++)
+      if ((child = pram__map_nth(node, i, &byte)))
+	pram__map_drop(pool, child);
+  pram__map_release(pool, at);
+}
+
+
+/**
+ * Free a map made by `pram_map_detach`, its values are not freed, this
+ * may not be done in a read-side critical section, but readers that
+ * found its keys before they were detached may still be using them
+ * 
+ * @param  subtree  The map
+ */
+void pram_map_drop(pram_map* subtree)
+{
+  if (subtree->root)
+    pram__map_drop(subtree->pool, subtree->root);
+  subtree->root = NULL;
+}
+
+
+/**
+ * Frees the resources of a map, different maps may be freed concurrently
  * 
  * @param   map  The address of the map
  * @return       `NULL`-terminated array of values that you may want to free,
- *               but do free this returend array before running this function again
+ *               the array must be freed with `free`
  */
 void** pram_map_free(pram_map* map)
 {
-  pram_map_values_ptr = 0;
-  pram_map_values_size = 64;
-  pram_map_values = (void**)malloc(512 * sizeof(void*));
-  pram__map_free(map->data, 0);
-  if (pram_map_values_ptr == pram_map_values_size)
-    pram_map_values = (void**)realloc(pram_map_values, (pram_map_values_size + 1) * sizeof(void*));
-  *(pram_map_values + pram_map_values_ptr) = NULL;
-  return pram_map_values;
+  struct pram_map_retired** ref = &pram_map_retired;
+  struct pram_map_retired* retired;
+  size_t n = 0, values_size = 64, depth = 0, stack_size = 64, i, span;
+  void** values = (void**)malloc(values_size * sizeof(void*));
+  void** stack = (void**)malloc(stack_size * sizeof(void*));
+  struct pram_map_node* node;
+  unsigned char byte;
+  void* child;
+  void* value;
+  void* ptr;
+  void* at;
+  void** slab;
+  /* Retired parts of the map are freed with the slabs */
+  pthread_mutex_lock(&pram_map_retired_mutex);
+  while ((retired = *ref))
+    if (retired->pool == map->pool)
+      {
+	*ref = retired->next;
+	free(retired);
+	pram_map_retired_count--;
+      }
+    else
+      ref = &(retired->next);
+  pthread_mutex_unlock(&pram_map_retired_mutex);
+  /* The nodes are visited with an explicit stack, a map can be deeper than the thread's stack allows
+     for, only the values and the allocations that were not made from the pool need to be found */
+  if (map->root)
+    *(stack + depth++) = map->root;
+  while (depth)
+    {
+      at = *(stack + --depth);
+      if (pram__map_size(at) > MAP_POOL_MAX)
+	ptr = MAP_IS_LEAF(at) ? (void*)MAP_LEAF(at) : at;
+      else
+	ptr = NULL;
+      if (MAP_IS_LEAF(at))
+	{
+	  if ((value = MAP_LEAF(at)->value))
+	    {
+	      if (n + 1 == values_size)
+		values = (void**)realloc(values, (values_size <<= 1) * sizeof(void*));
+	      *(values + n++) = value;
+	    }
+	}
+      else
+	{
+	  node = (struct pram_map_node*)at;
+	  for (i = 0, span = pram__map_span(node); i < span; i++)
+	    if ((child = pram__map_nth(node, i, &byte)))
+	      {
+		if (depth == stack_size)
+		  stack = (void**)realloc(stack, (stack_size <<= 1) * sizeof(void*));
+		*(stack + depth++) = child;
+	      }
+	}
+      free(ptr);
+    }
+  free(stack);
+  *(values + n) = NULL;
+  while ((slab = map->pool->slabs))
+    {
+      map->pool->slabs = (void**)*slab;
+      free(slab);
+    }
+  free(map->pool);
+  return values;
+}
+
+
+/**
+ * Release a thread's announcement when the thread exits
+ * 
+ * @param  reader  The thread's announcement
+ */
+static void pram__map_reader_exit(void* reader)
+{
+  struct pram_map_reader* r = (struct pram_map_reader*)reader;
+  __atomic_store_n(&(r->epoch), 0, __ATOMIC_RELEASE);
+  r->nesting = 0;
+  __atomic_store_n(&(r->used), 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Create `pram_map_reader_key`
+ */
+static void pram__map_reader_key(void)
+{
+  pthread_key_create(&pram_map_reader_key, pram__map_reader_exit);
+}
+
+
+/**
+ * Gets the calling thread's announcement, creating it if the thread does not have one
+ * 
+ * @return  The thread's announcement
+ */
+static struct pram_map_reader* pram__map_reader(void)
+{
+  struct pram_map_reader* reader;
+  char unused;
+  if (pram_map_reader)
+    return pram_map_reader;
+  pthread_once(&pram_map_reader_once, pram__map_reader_key);
+  /* Reuse the announcement of a thread that has exited */
+  for (reader = __atomic_load_n(&pram_map_readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+    {
+      unused = 0;
+      if (__atomic_compare_exchange_n(&(reader->used), &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	break;
+    }
+  if (reader == NULL)
+    {
+      reader = (struct pram_map_reader*)malloc(sizeof(struct pram_map_reader));
+      reader->epoch = 0;
+      reader->nesting = 0;
+      reader->used = 1;
+      reader->next = __atomic_load_n(&pram_map_readers, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&pram_map_readers, &(reader->next), reader, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    }
+  pthread_setspecific(pram_map_reader_key, reader);
+  return pram_map_reader = reader;
+}
+
+
+/**
+ * Gets the oldest epoch any thread entered its current read-side critical section in
+ * 
+ * @return  The oldest epoch, `ULONG_MAX` if no thread is in a read-side critical section
+ */
+static unsigned long pram__map_oldest_reader(void)
+{
+  unsigned long oldest = ULONG_MAX, epoch;
+  struct pram_map_reader* reader;
+  for (reader = __atomic_load_n(&pram_map_readers, __ATOMIC_ACQUIRE); reader; reader = reader->next)
+    if ((epoch = __atomic_load_n(&(reader->epoch), __ATOMIC_SEQ_CST)) && (epoch < oldest))
+      oldest = epoch;
+  return oldest;
+}
+
+
+/**
+ * Free the retired allocations that no thread can be using, `pram_map_retired_mutex` must be held
+ * 
+ * @param  oldest  The oldest epoch a thread is in a read-side critical section in
+ */
+static void pram__map_reclaim(unsigned long oldest)
+{
+  struct pram_map_retired** at = &pram_map_retired;
+  struct pram_map_retired* retired;
+  while ((retired = *at))
+    if (retired->epoch <= oldest)
+      {
+	*at = retired->next;
+	pram__map_dispose(retired->pool, retired->ptr, retired->size);
+	free(retired);
+	pram_map_retired_count--;
+      }
+    else
+      at = &(retired->next);
+}
+
+
+/**
+ * Enter a read-side critical section, allocations retired with `pram_map_retire`
+ * are not freed until all threads have left the sections they were in when the
+ * allocations were retired, read-side critical sections may be nested
+ */
+void pram_map_read_lock(void)
+{
+  struct pram_map_reader* reader = pram__map_reader();
+  if (reader->nesting++)
+    return;
+  __atomic_store_n(&(reader->epoch), __atomic_load_n(&pram_map_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  /* The announcement must be visible before anything is read from the maps */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Leave a read-side critical section
+ */
+void pram_map_read_unlock(void)
+{
+  if (--(pram_map_reader->nesting) == 0)
+    __atomic_store_n(&(pram_map_reader->epoch), 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Free an allocation once no thread is in a read-side critical section it may
+ * have found the allocation in, this may not be done in a read-side critical section
+ * 
+ * @param  ptr  The allocation, it must no longer be reachable for new readers
+ */
+void pram_map_retire(void* ptr)
+{
+  pram__map_defer(NULL, ptr, 0);
+}
+
+
+/**
+ * Free an allocation, or return it to its pool, once no thread is in a read-side
+ * critical section it may have found the allocation in, this may not be done in
+ * a read-side critical section
+ * 
+ * @param  pool  The pool the allocation was made from, `NULL` if it was made with `malloc`
+ * @param  ptr   The allocation, it must no longer be reachable for new readers
+ * @param  size  The size of the allocation, ignored if `pool` is `NULL`
+ */
+static void pram__map_defer(struct pram_map_pool* pool, void* ptr, size_t size)
+{
+  struct pram_map_retired* retired = (struct pram_map_retired*)malloc(sizeof(struct pram_map_retired));
+  unsigned long epoch = __atomic_add_fetch(&pram_map_epoch, 1, __ATOMIC_SEQ_CST);
+  if (retired == NULL)
+    {
+      /* Wait for the readers rather than defer the free */
+      while (pram__map_oldest_reader() < epoch)
+	sched_yield();
+      pram__map_dispose(pool, ptr, size);
+      return;
+    }
+  retired->ptr = ptr;
+  retired->pool = pool;
+  retired->size = size;
+  retired->epoch = epoch;
+  pthread_mutex_lock(&pram_map_retired_mutex);
+  retired->next = pram_map_retired;
+  pram_map_retired = retired;
+  if (++pram_map_retired_count >= MAP_RETIRE_BATCH)
+    pram__map_reclaim(pram__map_oldest_reader());
+  pthread_mutex_unlock(&pram_map_retired_mutex);
+}
+
+
+/**
+ * Free all retired allocations, no thread may be in a read-side critical section
+ */
+void pram_map_reclaim(void)
+{
+  pthread_mutex_lock(&pram_map_retired_mutex);
+  pram__map_reclaim(ULONG_MAX);
+  pthread_mutex_unlock(&pram_map_retired_mutex);
 }
 
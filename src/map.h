@@ -19,61 +19,455 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+
+/**
+ * Node type with up to 4 children in the map data structure
+ */
+#define MAP_NODE4  0
+
+/**
+ * Node type with up to 16 children in the map data structure
+ */
+#define MAP_NODE16  1
+
+/**
+ * Node type with up to 48 children in the map data structure
+ */
+#define MAP_NODE48  2
+
+/**
+ * Node type with up to 256 children in the map data structure
+ */
+#define MAP_NODE256  3
+
+/**
+ * The number of children a node of a type can have
+ * 
+ * @param   TYPE:int  The node type
+ * @return  :size_t   The number of children
+ */
+#define MAP_CAPACITY(TYPE)  ((size_t)((const unsigned short[]){4, 16, 48, 256})[TYPE])
+
+/**
+ * The size of a node of a type, excluding its prefix
+ * 
+ * @param   TYPE:int  The node type
+ * @return  :size_t   The size of the node
+ */
+#define MAP_NODE_SIZE(TYPE)								\
+  ((TYPE) == MAP_NODE4  ? sizeof(struct pram_map_node4)  :				\
+   (TYPE) == MAP_NODE16 ? sizeof(struct pram_map_node16) :				\
+   (TYPE) == MAP_NODE48 ? sizeof(struct pram_map_node48) : sizeof(struct pram_map_node256))
+
+/**
+ * The prefix of a node, it is stored directly after the node
+ * 
+ * @param   NODE:struct pram_map_node*  The node
+ * @return  :unsigned char*             The prefix
+ */
+#define MAP_PREFIX(NODE)  ((unsigned char*)(NODE) + MAP_NODE_SIZE((NODE)->type))
+
+/**
+ * Whether a child in the map data structure is a leaf rather than a node
+ * 
+ * @param   CHILD:void*  The child
+ * @return  :int         Whether the child is a leaf
+ */
+#define MAP_IS_LEAF(CHILD)  ((uintptr_t)(CHILD) & 1)
 
+/**
+ * Get the leaf a child in the map data structure is
+ * 
+ * @param   CHILD:void*             The child, it must be a leaf
+ * @return  :struct pram_map_leaf*  The leaf
+ */
+#define MAP_LEAF(CHILD)  ((struct pram_map_leaf*)((uintptr_t)(CHILD) - 1))
 
+/**
+ * Get the child in the map data structure a leaf is stored as
+ * 
+ * @param   LEAF:struct pram_map_leaf*  The leaf
+ * @return  :void*                      The child
+ */
+#define MAP_CHILD(LEAF)  ((void*)((uintptr_t)(LEAF) + 1))
 
 /**
- * The binary logarithm of the number of levels per character in the map data structure
+ * The size of the slabs the nodes and leaves of a map are allocated from
  */
-#ifndef MAP_LB_LEVELS
-  #define MAP_LB_LEVELS  1
+#ifndef MAP_SLAB_SIZE
+  #define MAP_SLAB_SIZE  (64 << 10)
 #endif
 
 /**
- * The levels per character in the map data structure
+ * The largest allocation that is made from a slab, larger allocations are made with `malloc`
  */
-#define MAP_LEVELS  (1 << MAP_LB_LEVELS)
+#define MAP_POOL_MAX  4096
 
 /**
- * The number of bits per level in the map data structure
+ * The granularity of allocations made from slabs, allocations in
+ * a slab are aligned to it and are at least this large
  */
-#define MAP_BIT_PER_LEVEL  (8 >> MAP_LB_LEVELS)
+#define MAP_POOL_ALIGN  16
 
 /**
- * The number of combinations per level in the map data structure
+ * The number of retired allocations to collect before trying to free them
  */
-#define MAP_PER_LEVEL  (1 << MAP_BIT_PER_LEVEL)
+#ifndef MAP_RETIRE_BATCH
+  #define MAP_RETIRE_BATCH  64
+#endif
 
 
 
 /**
- * char* to void* map structure
+ * char* to void* map structure, an adaptive radix tree
  */
 typedef struct
 {
   /**
-   * Indefinite depth array with with some levels (depends on MAP_LB_LEVELS),
-   * including the firstk having a value at last position.
+   * The root node or leaf, `NULL` if the map is empty
    */
-  void** data;
+  void* root;
+  
+  /**
+   * The pool the nodes and leaves are allocated from
+   */
+  struct pram_map_pool* pool;
 } pram_map;
 
 
+/**
+ * The part that all node types in the map data structure start with
+ */
+struct pram_map_node
+{
+  /**
+   * The node type, `MAP_NODE4`, `MAP_NODE16`, `MAP_NODE48` or `MAP_NODE256`
+   */
+  unsigned char type;
+  
+  /**
+   * The number of children
+   */
+  unsigned short count;
+  
+  /**
+   * The number of key bytes, after the byte that selected the node, that all
+   * keys under the node share, these bytes are stored directly after the node
+   */
+  size_t prefix_len;
+};
+
+
+/**
+ * Node with up to 4 children, it is never modified once it
+ * is reachable, except that its children may be replaced
+ */
+struct pram_map_node4
+{
+  /**
+   * The part that all node types start with
+   */
+  struct pram_map_node node;
+  
+  /**
+   * The key bytes that select the children
+   */
+  unsigned char keys[4];
+  
+  /**
+   * The children, nodes or leaves
+   */
+  void* children[4];
+};
+
+
+/**
+ * Node with up to 16 children, it is never modified once it
+ * is reachable, except that its children may be replaced
+ */
+struct pram_map_node16
+{
+  /**
+   * The part that all node types start with
+   */
+  struct pram_map_node node;
+  
+  /**
+   * The key bytes that select the children, they are compared all at once
+   */
+  unsigned char keys[16];
+  
+  /**
+   * The children, nodes or leaves
+   */
+  void* children[16];
+};
+
+
+/**
+ * Node with up to 48 children
+ */
+struct pram_map_node48
+{
+  /**
+   * The part that all node types start with
+   */
+  struct pram_map_node node;
+  
+  /**
+   * For each key byte, one plus the index of its child, zero if it has none
+   */
+  unsigned char index[256];
+  
+  /**
+   * The children, nodes or leaves
+   */
+  void* children[48];
+};
+
+
+/**
+ * Node with up to 256 children
+ */
+struct pram_map_node256
+{
+  /**
+   * The part that all node types start with
+   */
+  struct pram_map_node node;
+  
+  /**
+   * The child for each key byte, `NULL` if it has none
+   */
+  void* children[256];
+};
+
+
+/**
+ * A key and its value in the map data structure
+ */
+struct pram_map_leaf
+{
+  /**
+   * The value
+   */
+  void* value;
+  
+  /**
+   * The rest of the key, after the bytes matched by the nodes above the leaf and the
+   * key byte that selects the leaf, empty if that byte is the terminating NUL byte,
+   * which keeps any key from being the beginning of another key, keys are not stored
+   * whole so that subtrees can be moved without changing them
+   */
+  char key[];
+};
+
+
+/**
+ * Where a node or a leaf is in the map data structure
+ */
+struct pram_map_place
+{
+  /**
+   * The slot the node or leaf is stored in
+   */
+  void** ref;
+  
+  /**
+   * The slot `parent` is stored in
+   */
+  void** parent_ref;
+  
+  /**
+   * The node that has `ref`, `NULL` if `ref` is the root of the map
+   */
+  struct pram_map_node* parent;
+  
+  /**
+   * The key byte that selects `ref` in `parent`
+   */
+  unsigned char byte;
+  
+  /**
+   * The number of bytes at the beginning of the prefix of the node,
+   * or of the rest of the key of the leaf, that a searched prefix ends with
+   */
+  size_t offset;
+};
+
+
+/**
+ * Function called for each key found by `pram_map_scan`
+ * 
+ * @param  key    The key
+ * @param  value  The key's value
+ * @param  data   The `data` argument given to `pram_map_scan`
+ */
+typedef void pram_map_callback(const char* key, void* value, void* data);
+
 
 /**
- * Used in `pram_map_free` and `pram__map_free` to store found values that can be freed
+ * Where a search with `pram_map_get_near` can be resumed, so that keys
+ * that begin like the last key do not have to be searched from the root
  */
-void** pram_map_values;
+typedef struct
+{
+  /**
+   * The node the search can be resumed at, `NULL` if none
+   */
+  void* node;
+  
+  /**
+   * The pool of the map that `node` is in
+   */
+  struct pram_map_pool* pool;
+  
+  /**
+   * The version of `pool` when `node` was found
+   */
+  unsigned long version;
+  
+  /**
+   * The beginning of the key `node` was found with, it must be freed with `free`
+   */
+  char* key;
+  
+  /**
+   * The number of bytes in `key` that lead to `node`
+   */
+  size_t depth;
+  
+  /**
+   * The allocation size of `key`
+   */
+  size_t size;
+} pram_map_finger;
+
+
 
 /**
- * The number of elements in `pram_map_values`
+ * A free allocation in a pool
  */
-long pram_map_values_ptr;
+struct pram_map_block
+{
+  /**
+   * The next free allocation
+   */
+  struct pram_map_block* next;
+  
+  /**
+   * The size class of the allocation, its size is `(size_class + 1) * MAP_POOL_ALIGN`
+   */
+  size_t size_class;
+};
+
 
 /**
- * The size of `pram_map_values`
+ * Slab allocator for the nodes and leaves of a map, so that they are near each
+ * other in memory, that freed ones are reused, and that they can be freed at once
  */
-long pram_map_values_size;
+struct pram_map_pool
+{
+  /**
+   * The free allocations of each size class, only used by the thread modifying the map
+   */
+  struct pram_map_block* free[MAP_POOL_MAX / MAP_POOL_ALIGN];
+  
+  /**
+   * Allocations that were freed, by any thread, after being retired, but not yet sorted into `free`
+   */
+  struct pram_map_block* returned;
+  
+  /**
+   * The newest slab, each slab begins with a pointer to the previous slab
+   */
+  void** slabs;
+  
+  /**
+   * The part of the newest slab that has not been allocated
+   */
+  char* unused;
+  
+  /**
+   * The size of `unused`
+   */
+  size_t unused_size;
+  
+  /**
+   * Incremented each time a node or a leaf is unlinked or released,
+   * so that fingers into maps using the pool can tell if they are stale
+   */
+  unsigned long version;
+};
+
+
+/**
+ * A thread's announcement of its read-side critical section
+ */
+struct pram_map_reader
+{
+  /**
+   * The epoch the thread entered its read-side critical section in, zero if it is not in one
+   */
+  unsigned long epoch;
+  
+  /**
+   * The number of nested read-side critical sections the thread is in
+   */
+  long nesting;
+  
+  /**
+   * Whether the announcement belongs to a running thread
+   */
+  char used;
+  
+  /**
+   * The next announcement
+   */
+  struct pram_map_reader* next;
+};
+
+
+/**
+ * Allocation that is waiting to be freed
+ */
+struct pram_map_retired
+{
+  /**
+   * The allocation
+   */
+  void* ptr;
+  
+  /**
+   * The pool the allocation was made from, `NULL` if it was made with `malloc`
+   */
+  struct pram_map_pool* pool;
+  
+  /**
+   * The size of the allocation, if it was made from a pool
+   */
+  size_t size;
+  
+  /**
+   * The epoch the allocation was retired in
+   */
+  unsigned long epoch;
+  
+  /**
+   * The next retired allocation
+   */
+  struct pram_map_retired* next;
+};
 
 
 
@@ -85,7 +479,8 @@ long pram_map_values_size;
 void pram_map_init(pram_map* map);
 
 /**
- * Gets the value for a key in a map
+ * Gets the value for a key in a map, this may be done concurrently with
+ * `pram_map_put` if it is done in a read-side critical section
  * 
  * @param   map  The address of the map
  * @param   key  The key
@@ -94,7 +489,22 @@ void pram_map_init(pram_map* map);
 void* pram_map_get(pram_map* map, const char* key);
 
 /**
- * Sets the value for a key in a map
+ * Gets the value for a key in a map, resuming the search where an earlier one
+ * left off if the key begins the same way, this may be done concurrently with
+ * `pram_map_put` if it is done in a read-side critical section
+ * 
+ * @param   map     The address of the map
+ * @param   key     The key
+ * @param   shared  The number of bytes at the beginning of the key that following
+ *                  keys are expected to begin with too, such as the directory of a file
+ * @param   finger  Where the search can be resumed, updated for following keys,
+ *                  it must be zeroed before its first use
+ * @return          The value, `NULL` if not found
+ */
+void* pram_map_get_near(pram_map* map, const char* key, size_t shared, pram_map_finger* finger);
+
+/**
+ * Sets the value for a key in a map, calls for the same map must be serialised
  * 
  * @param  map    The address of the map
  * @param  key    The key
@@ -103,11 +513,93 @@ void* pram_map_get(pram_map* map, const char* key);
 void pram_map_put(pram_map* map, const char* key, void* value);
 
 /**
- * Frees the resources of a map
+ * Call a function for each key in a map that begins with a prefix, this may be done
+ * concurrently with changes to the map if it is done in a read-side critical section
+ * 
+ * @param   map       The address of the map
+ * @param   prefix    The prefix, the empty string for all keys
+ * @param   callback  The function, it may not change the map
+ * @param   data      Argument for `callback`
+ * @return            Zero on success, -1 on error
+ */
+int pram_map_scan(pram_map* map, const char* prefix, pram_map_callback* callback, void* data);
+
+/**
+ * Remove all keys that begin with a prefix from a map, and put them,
+ * without the prefix, in another map, calls for the map must be serialised
+ * 
+ * @param  map      The address of the map
+ * @param  prefix   The prefix
+ * @param  subtree  Output parameter for the map with the removed keys, it shares its
+ *                  memory with `map`, and must be put back with
+ *                  `pram_map_attach` or freed with `pram_map_drop`
+ */
+void pram_map_detach(pram_map* map, const char* prefix, pram_map* subtree);
+
+/**
+ * Put the keys of a map made by `pram_map_detach` back in the map they were
+ * removed from, with a prefix, calls for the map must be serialised
+ * 
+ * @param   map      The address of the map
+ * @param   prefix   The prefix
+ * @param   subtree  The map with the keys, it is empty afterwards unless -1 is returned
+ * @return           Zero on success, -1 if a key in `map` already begins with the prefix
+ */
+int pram_map_attach(pram_map* map, const char* prefix, pram_map* subtree);
+
+/**
+ * Replace the beginning of all keys that begin with a prefix in a map,
+ * readers find each key by either the old or the new name while this is
+ * done, calls for the map must be serialised
+ * 
+ * @param   map     The address of the map
+ * @param   source  The prefix the keys begin with
+ * @param   target  The prefix the keys shall begin with instead
+ * @return          Zero on success, -1 if a key in the map already begins with
+ *                  `target`, or if one of the prefixes begins with the other
+ */
+int pram_map_move(pram_map* map, const char* source, const char* target);
+
+/**
+ * Free a map made by `pram_map_detach`, its values are not freed, this
+ * may not be done in a read-side critical section, but readers that
+ * found its keys before they were detached may still be using them
+ * 
+ * @param  subtree  The map
+ */
+void pram_map_drop(pram_map* subtree);
+
+/**
+ * Frees the resources of a map, different maps may be freed concurrently
  * 
  * @param   map  The address of the map
  * @return       `NULL`-terminated array of values that you may want to free,
- *               but do free this returend array before running this function again
+ *               the array must be freed with `free`
  */
 void** pram_map_free(pram_map* map);
 
+/**
+ * Enter a read-side critical section, allocations retired with `pram_map_retire`
+ * are not freed until all threads have left the sections they were in when the
+ * allocations were retired, read-side critical sections may be nested
+ */
+void pram_map_read_lock(void);
+
+/**
+ * Leave a read-side critical section
+ */
+void pram_map_read_unlock(void);
+
+/**
+ * Free an allocation once no thread is in a read-side critical section it may
+ * have found the allocation in, this may not be done in a read-side critical section
+ * 
+ * @param  ptr  The allocation, it must no longer be reachable for new readers
+ */
+void pram_map_retire(void* ptr);
+
+/**
+ * Free all retired allocations, no thread may be in a read-side critical section
+ */
+void pram_map_reclaim(void);
+
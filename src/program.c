@@ -31,9 +31,62 @@
  */
 static void* pram_init(struct fuse_conn_info* conn)
 {
-  (void) conn;
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
   pram_file_cache = (pram_map*)malloc(sizeof(pram_map));
   pram_map_init(pram_file_cache);
+  pram_names = (pthread_mutex_t*)malloc(PRAM_SHARDS * sizeof(pthread_mutex_t));
+  for (size_t i = 0; i < PRAM_SHARDS; i++)
+    pthread_mutex_init(pram_names + i, NULL);
+  pram_inode_cache = (pram_map*)malloc(sizeof(pram_map));
+  pram_map_init(pram_inode_cache);
+  pram_negative_cache = (pram_map*)malloc(sizeof(pram_map));
+  pram_map_init(pram_negative_cache);
+  if (pram_negative_ttl && pram_negative_max)
+    pram_negatives = (struct pram_negative*)calloc(pram_negative_max, sizeof(struct pram_negative));
+  pram_dir_fd_cache = (pram_map*)malloc(sizeof(pram_map));
+  pram_map_init(pram_dir_fd_cache);
+  if (pram_snapshot)
+    load_snapshot();
+  /* The thread is not started in `main` because FUSE forks when it daemonises */
+  pram_running = true;
+  if ((errno = pthread_create(&pram_background_thread, NULL, pram_background, NULL)))
+    {
+      perror("pthread_create");
+      pram_running = false;
+    }
+  if (pram_flush_threads && (pram_flusher_thread = (pthread_t*)malloc(pram_flush_threads * sizeof(pthread_t))))
+    {
+      pram_flushers_running = true;
+      for (; pram_flushers < pram_flush_threads; pram_flushers++)
+	if ((errno = pthread_create(pram_flusher_thread + pram_flushers, NULL, flush_stripes, NULL)))
+	  {
+	    perror("pthread_create");
+	    break;
+	  }
+      if (pram_flushers == 0)
+	pram_flushers_running = false;
+    }
+  if (pram_readahead)
+    {
+      pram_readahead_running = true;
+      for (; pram_readahead_threads < PRAM_READAHEAD_THREADS; pram_readahead_threads++)
+	if ((errno = pthread_create(pram_readahead_thread + pram_readahead_threads, NULL, read_ahead, NULL)))
+	  {
+	    perror("pthread_create");
+	    break;
+	  }
+      if (pram_readahead_threads == 0)
+	pram_readahead_running = false;
+    }
+  if (pram_prewarm)
+    {
+      pram_prewarming = true;
+      if ((errno = pthread_create(&pram_prewarm_thread, NULL, prewarm_tree, NULL)))
+	{
+	  perror("pthread_create");
+	  pram_prewarming = false;
+	}
+    }
   return NULL;
 }
 
@@ -45,20 +98,97 @@ static void* pram_init(struct fuse_conn_info* conn)
 static void pram_destroy(void* data)
 {
   (void) data;
+  if (pram_prewarming)
+    {
+      __atomic_store_n(&pram_prewarming, false, __ATOMIC_RELEASE);
+      pthread_join(pram_prewarm_thread, NULL);
+    }
+  if (pram_readahead_threads)
+    {
+      pthread_mutex_lock(&pram_readahead_mutex);
+      pram_readahead_running = false;
+      pthread_cond_broadcast(&pram_readahead_cond);
+      pthread_mutex_unlock(&pram_readahead_mutex);
+      while (pram_readahead_threads)
+	pthread_join(*(pram_readahead_thread + --pram_readahead_threads), NULL);
+      while (pram_readahead_queue)
+	{
+	  struct pram_readahead* readahead = pram_readahead_queue;
+	  pram_readahead_queue = readahead->next;
+	  free_readahead(readahead);
+	}
+      pram_readahead_last = NULL;
+    }
+  if (pram_running)
+    {
+      _lock;
+      pram_running = false;
+      pthread_cond_signal(&pram_flush_cond);
+      _unlock;
+      pthread_join(pram_background_thread, NULL);
+    }
+  _lock;
+  flush_dirty_files(true);
+  _unlock;
+  if (pram_flushers)
+    {
+      pthread_mutex_lock(&pram_flusher_mutex);
+      pram_flushers_running = false;
+      pthread_cond_broadcast(&pram_flusher_cond);
+      pthread_mutex_unlock(&pram_flusher_mutex);
+      while (pram_flushers)
+	pthread_join(*(pram_flusher_thread + --pram_flushers), NULL);
+    }
+  free(pram_flusher_thread);
+  pram_flusher_thread = NULL;
+  if (pram_snapshot)
+    save_snapshot();
+  if (pram_snapshot_index)
+    {
+      free(pram_map_free(pram_snapshot_index));
+      free(pram_snapshot_index);
+    }
+  if (pram_snapshot_map)
+    munmap(pram_snapshot_map, pram_snapshot_size);
+  pthread_setspecific(pram_pathbuf_key, NULL);
   free(pathbuf);
-  struct pram_file** file_caches = (struct pram_file**)pram_map_free(pram_file_cache);
-  struct pram_file** _file_caches = file_caches;
-  struct pram_file* file_cache;
-  while ((file_cache = *file_caches++))
+  pathbuf = NULL;
+  pathbufsize = 0;
+  pthread_setspecific(pram_finger_key, NULL);
+  free(pram_finger.key);
+  memset(&pram_finger, 0, sizeof(pram_map_finger));
+  if (pram_io_ready)
     {
-      free(file_cache->link);
-      free(file_cache->buffer);
-      free(file_cache);
+      pthread_setspecific(pram_io_key, NULL);
+      pram_io_destroy(&pram_io_thread);
+      pram_io_ready = false;
     }
-  free(_file_caches);
+  /* Files with multiple names are listed once in `pram_inode_cache` */
+  free(pram_map_free(pram_file_cache));
   free(pram_file_cache);
-  /* pthread_cancel(background_thread); */
-  /* pthread_join(background_thread, NULL); */
+  for (size_t i = 0; i < PRAM_SHARDS; i++)
+    pthread_mutex_destroy(pram_names + i);
+  free(pram_names);
+  struct pram_file** file_caches = (struct pram_file**)pram_map_free(pram_inode_cache);
+  free_all_file_caches(file_caches);
+  free(file_caches);
+  free(pram_inode_cache);
+  free(pram_map_free(pram_negative_cache));
+  free(pram_negative_cache);
+  if (pram_negatives)
+    for (size_t i = 0; i < pram_negative_max; i++)
+      free((pram_negatives + i)->path);
+  free(pram_negatives);
+  struct pram_dir_fd** dirs = (struct pram_dir_fd**)pram_map_free(pram_dir_fd_cache);
+  for (size_t i = 0; dirs && *(dirs + i); i++)
+    {
+      close((*(dirs + i))->fd);
+      free((*(dirs + i))->path);
+      free(*(dirs + i));
+    }
+  free(dirs);
+  free(pram_dir_fd_cache);
+  pram_map_reclaim();
   pthread_mutex_destroy(&pram_mutex);
 }
 
@@ -72,16 +202,23 @@ static void pram_destroy(void* data)
 static int pram_chmod(const char* path, mode_t mode)
 {
   struct pram_file* cache = NULL;
-  _lock;
   int error = get_file_cache(path, &cache);
-  if (!error)
-    if (cache->attr.st_mode != mode)
-      {
-	error = chmod(pathbuf, mode);
+  if (error)
+    return error;
+  _wrlock(cache);
+  if (cache->attr.st_mode != mode)
+    {
+      struct pram_dir_fd* dir;
+      const char* name;
+      int dirfd = get_dir_fd(path, &name, &dir);
+      error = r(fchmodat(dirfd, name, mode, 0));
+      put_dir_fd(dir);
+      if (!error)
 	cache->attr.st_mode = mode;
-	/* TODO update ctime */
-      }
-  _unlock;
+      /* TODO update ctime */
+    }
+  _rwunlock(cache);
+  put_file_cache(cache);
   return error;
 }
 
@@ -96,17 +233,26 @@ static int pram_chmod(const char* path, mode_t mode)
 static int pram_chown(const char* path, uid_t owner, gid_t group)
 {
   struct pram_file* cache = NULL;
-  _lock;
   int error = get_file_cache(path, &cache);
-  if (!error)
-    if ((cache->attr.st_uid != owner) || (cache->attr.st_gid != group))
-      {
-	error = lchown(pathbuf, owner, group);
-	cache->attr.st_uid = owner;
-	cache->attr.st_gid = group;
-	/* TODO update ctime */
-      }
-  _unlock;
+  if (error)
+    return error;
+  _wrlock(cache);
+  if ((cache->attr.st_uid != owner) || (cache->attr.st_gid != group))
+    {
+      struct pram_dir_fd* dir;
+      const char* name;
+      int dirfd = get_dir_fd(path, &name, &dir);
+      error = r(fchownat(dirfd, name, owner, group, AT_SYMLINK_NOFOLLOW));
+      put_dir_fd(dir);
+      if (!error)
+	{
+	  cache->attr.st_uid = owner;
+	  cache->attr.st_gid = group;
+	}
+      /* TODO update ctime */
+    }
+  _rwunlock(cache);
+  put_file_cache(cache);
   return error;
 }
 
@@ -120,12 +266,14 @@ static int pram_chown(const char* path, uid_t owner, gid_t group)
 static int pram_getattr(const char* path, struct stat* attr)
 {
   struct pram_file* cache = NULL;
-  _lock;
   int error = get_file_cache(path, &cache);
-  if (!error)
-    *attr = cache->attr;
-  _unlock;
-  return error;
+  if (error)
+    return error;
+  _rdlock(cache);
+  *attr = cache->attr;
+  _rwunlock(cache);
+  put_file_cache(cache);
+  return 0;
 }
 
 /**
@@ -139,9 +287,9 @@ static int pram_getattr(const char* path, struct stat* attr)
 static int pram_fgetattr(const char* path, struct stat* attr, struct fuse_file_info* fi)
 {
   (void) path;
-  _lock;
+  _rdlock(fcache(fi));
   *attr = fcache(fi)->attr;
-  _unlock;
+  _rwunlock(fcache(fi));
   return 0;
 }
 
@@ -156,7 +304,35 @@ static int pram_fgetattr(const char* path, struct stat* attr, struct fuse_file_i
  */
 static int pram_getxattr(const char* path, const char* name, char* value, size_t size)
 {
-  sync_return(lgetxattr(p(path), name, value, size));  /* TODO xattr is not cached */
+  struct pram_file* cache;
+  struct pram_xattr* xattr;
+  int error = get_file_cache(path, &cache);
+  if (error)
+    return error;
+  _rdlock(cache);
+  if ((xattr = find_xattr(cache, name)) == NULL)
+    {
+      /* Looking up the attribute modifies the cache */
+      _rwunlock(cache);
+      _wrlock(cache);
+      xattr = get_xattr(cache, path, name);
+    }
+  if (xattr == NULL)
+    error = -errno;
+  else if (xattr->error)
+    error = -(xattr->error);
+  else if (size == 0)
+    error = (int)(xattr->size);
+  else if (size < xattr->size)
+    error = -ERANGE;
+  else
+    {
+      memcpy(value, xattr->value, xattr->size);
+      error = (int)(xattr->size);
+    }
+  _rwunlock(cache);
+  put_file_cache(cache);
+  return error;
 }
 
 /**
@@ -168,8 +344,21 @@ static int pram_getxattr(const char* path, const char* name, char* value, size_t
  */
 static int pram_link(const char* target, const char* path)
 {
-  /* TODO hard linking is currently a problem for our cache */
-  sync_call_duo_return(link, target, path);
+  struct pram_dir_fd* target_dir;
+  struct pram_dir_fd* dir;
+  const char* target_name;
+  const char* name;
+  lock_names(path, NULL);
+  int target_dirfd = get_dir_fd(target, &target_name, &target_dir);
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = linkat(target_dirfd, target_name, dirfd, name, 0);
+  put_dir_fd(target_dir);
+  put_dir_fd(dir);
+  if (rc == 0)
+    cache_new_entry(path);
+  rc = r(rc);
+  unlock_names(path, NULL);
+  return rc;
 }
 
 /**
@@ -182,7 +371,57 @@ static int pram_link(const char* target, const char* path)
  */
 static int pram_listxattr(const char* path, char* list, size_t size)
 {
-  sync_return(llistxattr(p(path), list, size));  /* TODO xattr is not cached */
+  struct pram_file* cache;
+  int error = get_file_cache(path, &cache);
+  if (error)
+    return error;
+  _rdlock(cache);
+  if (cache->xattrs_listed == false)
+    {
+      /* Listing the attributes modifies the cache */
+      _rwunlock(cache);
+      _wrlock(cache);
+    }
+  while (cache->xattrs_listed == false)
+    {
+      ssize_t n = llistxattr(p(path), NULL, 0);
+      char* xattr_list = n > 0 ? (char*)malloc((size_t)n * sizeof(char)) : NULL;
+      if ((n > 0) && (xattr_list == NULL))
+	{
+	  errno = ENOMEM;
+	  n = -1;
+	}
+      else if (n > 0)
+	n = llistxattr(p(path), xattr_list, (size_t)n);
+      if (n >= 0)
+	{
+	  cache->xattr_list = xattr_list;
+	  cache->xattr_listn = (size_t)n;
+	  cache->xattrs_listed = true;
+	  break;
+	}
+      free(xattr_list);
+      /* Retry if the list grew between the calls */
+      if (errno != ERANGE)
+	{
+	  error = -errno;
+	  break;
+	}
+    }
+  if (error)
+    ;
+  else if (size == 0)
+    error = (int)(cache->xattr_listn);
+  else if (size < cache->xattr_listn)
+    error = -ERANGE;
+  else
+    {
+      memcpy(list, cache->xattr_list, cache->xattr_listn);
+      error = (int)(cache->xattr_listn);
+    }
+  _rwunlock(cache);
+  put_file_cache(cache);
+  return error;
 }
 
 /**
@@ -194,7 +433,40 @@ static int pram_listxattr(const char* path, char* list, size_t size)
  */
 static int pram_mkdir(const char* path, mode_t mode)
 {
-  sync_return(mkdir(p(path), mode));  /* TODO dir is not cached */
+  struct pram_dir_fd* dir;
+  const char* name;
+  lock_names(path, NULL);
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = mkdirat(dirfd, name, mode);
+  put_dir_fd(dir);
+  if (rc == 0)
+    {
+      cache_new_entry(path);
+      struct pram_file* cache = find_file_cache(path);
+      struct pram_file* parent = get_parent_cache(path, NULL);
+      ino_t parent_ino = 0;
+      if (parent)
+	{
+	  _rdlock(parent);
+	  parent_ino = parent->attr.st_ino;
+	  _rwunlock(parent);
+	  put_file_cache(parent);
+	}
+      /* A new directory is known to be empty, so its listing need not be read */
+      if (cache)
+	{
+	  _wrlock(cache);
+	  if ((cache->listed == false) &&
+	      (append_dirent(cache, ".", cache->attr.st_ino, S_IFDIR) == 0) &&
+	      (append_dirent(cache, "..", parent_ino, S_IFDIR) == 0))
+	    cache->listed = true;
+	  _rwunlock(cache);
+	  put_file_cache(cache);
+	}
+    }
+  rc = r(rc);
+  unlock_names(path, NULL);
+  return rc;
 }
 
 /**
@@ -207,7 +479,17 @@ static int pram_mkdir(const char* path, mode_t mode)
  */
 static int pram_mknod(const char* path, mode_t mode, dev_t rdev)
 {
-  sync_return(mknod(p(path), mode, rdev));  /* TODO dir is not cached */
+  struct pram_dir_fd* dir;
+  const char* name;
+  lock_names(path, NULL);
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = mknodat(dirfd, name, mode, rdev);
+  put_dir_fd(dir);
+  if (rc == 0)
+    cache_new_entry(path);
+  rc = r(rc);
+  unlock_names(path, NULL);
+  return rc;
 }
 
 /**
@@ -219,7 +501,18 @@ static int pram_mknod(const char* path, mode_t mode, dev_t rdev)
  */
 static int pram_removexattr(const char* path, const char* name)
 {
-  sync_return(lremovexattr(p(path), name));  /* TODO xattr is not cached */
+  struct pram_file* cache = find_file_cache(path);
+  if (cache)
+    _wrlock(cache);
+  int rc = r(lremovexattr(p(path), name));
+  if (cache)
+    {
+      if (rc == 0)
+	update_xattr(cache, name, NULL, 0);
+      _rwunlock(cache);
+      put_file_cache(cache);
+    }
+  return rc;
   /* TODO update ctime */
 }
 
@@ -232,19 +525,54 @@ static int pram_removexattr(const char* path, const char* name)
  */
 static int pram_rename(const char* source, const char* path)
 {
-  _lock;  /* TODO dir is not cached */
-  char* _source = p(source);
-  int error = rename(_source, q(_source, path));
+  struct pram_file* cache = NULL;
+  struct pram_file* replaced = NULL;
+  struct pram_dir_fd* source_dir;
+  struct pram_dir_fd* path_dir;
+  const char* source_name;
+  const char* path_name;
+  lock_names(source, path);
+  /* Look up both files so that we can tell if they are links to the same file */
+  load_file_cache(source, &cache);
+  load_file_cache(path, &replaced);
+  int source_dirfd = get_dir_fd(source, &source_name, &source_dir);
+  int path_dirfd = get_dir_fd(path, &path_name, &path_dir);
+  int error = renameat(source_dirfd, source_name, path_dirfd, path_name);
+  put_dir_fd(source_dir);
+  put_dir_fd(path_dir);
+  /* Cached file descriptors refer to the directories, not to their names */
   if (!error)
+    {
+      forget_dir_fds(source);
+      forget_dir_fds(path);
+    }
+  /* Nothing is done if both names are links to the same file */
+  if (!error && ((cache == NULL) || (cache != replaced)))
     if (!eq(source, path))
       {
-	pram_map_put(pram_file_cache, path, pram_map_get(pram_file_cache, source));
-	pram_map_put(pram_file_cache, source, NULL);
+	if (replaced)
+	  forget_path(path, replaced);
+	set_file_cache(source, NULL);
+	set_file_cache(path, cache);
+	if (cache)
+	  {
+	    _rdlock(cache);
+	    int dir = S_ISDIR(cache->attr.st_mode);
+	    _rwunlock(cache);
+	    if (dir)
+	      move_names(source, path);
+	  }
+	dir_cache_remove(source);
+	cache_new_entry(path);
 	/* TODO update ctime */
       }
-  _unlock;
-  free(_source);
-  return r(error);
+  error = r(error);
+  unlock_names(source, path);
+  if (cache)
+    put_file_cache(cache);
+  if (replaced)
+    put_file_cache(replaced);
+  return error;
 }
 
 /**
@@ -255,7 +583,27 @@ static int pram_rename(const char* source, const char* path)
  */
 static int pram_rmdir(const char* path)
 {
-  sync_return(rmdir(p(path)));  /* TODO dir is not cached */
+  lock_names(path, NULL);
+  struct pram_file* cache = find_file_cache(path);
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = unlinkat(dirfd, name, AT_REMOVEDIR);
+  put_dir_fd(dir);
+  if (rc == 0)
+    {
+      if (cache)
+	forget_path(path, cache);
+      /* Names in the directory may be cached from before it was emptied outside the file system */
+      forget_names(path, true);
+      forget_dir_fds(path);
+      dir_cache_remove(path);
+    }
+  rc = r(rc);
+  unlock_names(path, NULL);
+  if (cache)
+    put_file_cache(cache);
+  return rc;
 }
 
 /**
@@ -270,7 +618,18 @@ static int pram_rmdir(const char* path)
  */
 static int pram_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
 {
-  sync_return(lsetxattr(p(path), name, value, size, flags));  /* TODO xattr is not cached */
+  struct pram_file* cache = find_file_cache(path);
+  if (cache)
+    _wrlock(cache);
+  int rc = r(lsetxattr(p(path), name, value, size, flags));
+  if (cache)
+    {
+      if (rc == 0)
+	update_xattr(cache, name, value, size);
+      _rwunlock(cache);
+      put_file_cache(cache);
+    }
+  return rc;
   /* TODO update ctime */
 }
 
@@ -283,7 +642,7 @@ static int pram_setxattr(const char* path, const char* name, const char* value,
  */
 static int pram_statfs(const char* path, struct statvfs* value)
 {
-  sync_return(statvfs(p(path), value));  /* TODO statfs is not cached */
+  return r(statvfs(p(path), value));  /* TODO statfs is not cached */
 }
 
 /**
@@ -295,16 +654,24 @@ static int pram_statfs(const char* path, struct statvfs* value)
  */
 static int pram_symlink(const char* target, const char* path)
 {
-  _lock;
-  void* ret = pram_map_get(pram_file_cache, path);
-  if (ret)
+  lock_names(path, NULL);
+  struct pram_file* cache = find_file_cache(path);
+  if (cache)
     {
-      _unlock;
+      unlock_names(path, NULL);
+      put_file_cache(cache);
       throw EEXIST;
     }
-  int rc = symlink(target, p(path));  /* TODO dir is not cached */
-  _unlock;
-  return r(rc);
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = symlinkat(target, dirfd, name);
+  put_dir_fd(dir);
+  if (rc == 0)
+    cache_new_entry(path);
+  rc = r(rc);
+  unlock_names(path, NULL);
+  return rc;
 }
 
 /**
@@ -316,48 +683,23 @@ static int pram_symlink(const char* target, const char* path)
  */
 static int pram_truncate(const char* path, off_t length)
 {
-  _lock;
   struct pram_file* cache;
   int error = get_file_cache(path, &cache);
-  if (!error)
-    if (!(error = truncate(pathbuf, length)))
-      {
-	off_t size = cache->attr.st_size;
-	off_t addition = size >= length ? 0 : (length - size);
-	blkcnt_t blocks = cache->attr.st_blocks;
-	size += (!!(size & 511)) << 9;
-	blocks -= size >> 9;
-	size = length;
-	size += (!!(size & 511)) << 9;
-	blocks += size >> 9;
-	cache->attr.st_size = length;
-	cache->attr.st_blocks = blocks;
-	if (cache->allocated)
-	  {
-	    if (addition > 0)
-	      {
-		off_t off = length - addition;
-		off_t end = (unsigned long)length < cache->allocated ? (unsigned long)length : cache->allocated;
-		char* buf = cache->buffer;
-		for (; off < end; off++)
-		  *(buf + off) = 0;
-	      }
-	    else if (length == 0)
-	      {
-		cache->allocated = 0;
-		free(cache->buffer);
-	      }
-	    else if (cache->allocated >= (unsigned long)(length << 1))
-	      {
-		cache->allocated = length;
-		cache->buffer = (char*)realloc(cache->buffer, length * sizeof(char));
-	      }
-	  }
-	/* TODO update ctime */
-	/* TODO update mtime */
-      }
-  _unlock;
-  return r(error);
+  if (error)
+    return error;
+  /* An ongoing write-back could otherwise extend the file after it is truncated */
+  pthread_mutex_lock(&(cache->flush_lock));
+  _wrlock(cache);
+  if (!(error = r(truncate(p(path), length))))
+    {
+      resize_file_cache(cache, length);
+      /* TODO update ctime */
+      /* TODO update mtime */
+    }
+  _rwunlock(cache);
+  pthread_mutex_unlock(&(cache->flush_lock));
+  put_file_cache(cache);
+  return error;
 }
 
 /**
@@ -372,47 +714,20 @@ static int pram_ftruncate(const char* path, off_t length, struct fuse_file_info*
 {
   (void) path;
   struct pram_file_info* file = (struct pram_file_info*)(uintptr_t)(fi->fh);
+  pthread_mutex_lock(&(file->cache->flush_lock));
+  _wrlock(file->cache);
   int error = ftruncate(file->fd, length);
   if (!error)
     {
-      struct pram_file* cache = file->cache;
-      off_t size = cache->attr.st_size;
-      off_t addition = size >= length ? 0 : (length - size);
-      blkcnt_t blocks = cache->attr.st_blocks;
-      size += (!!(size & 511)) << 9;
-      blocks -= size >> 9;
-      size = length;
-      size += (!!(size & 511)) << 9;
-      blocks += size >> 9;
-      _lock;
-      cache->attr.st_size = length;
-      cache->attr.st_blocks = blocks;
-      if (cache->allocated)
-	{
-	  if (addition > 0)
-	    {
-	      off_t off = length - addition;
-	      off_t end = (unsigned long)length < cache->allocated ? (unsigned long)length : cache->allocated;
-	      char* buf = cache->buffer;
-	      for (; off < end; off++)
-		*(buf + off) = 0;
-	    }
-	  else if (length == 0)
-	    {
-	      cache->allocated = 0;
-	      free(cache->buffer);
-	    }
-	  else if (cache->allocated >= (unsigned long)(length << 1))
-	    {
-	      cache->allocated = length;
-	      cache->buffer = (char*)realloc(cache->buffer, length * sizeof(char));
-	    }
-	}
-      _unlock;
+      resize_file_cache(file->cache, length);
       /* TODO update ctime */
       /* TODO update mtime */
     }
-  return r(error);
+  else
+    error = -errno;
+  _rwunlock(file->cache);
+  pthread_mutex_unlock(&(file->cache->flush_lock));
+  return error;
 }
 
 /**
@@ -424,23 +739,24 @@ static int pram_ftruncate(const char* path, off_t length, struct fuse_file_info*
  */
 static int pram_unlink(const char* path)
 {
-  _lock;  /* TODO dir is not cached */
-  void* ret = pram_map_get(pram_file_cache, path);
-  if (ret != NULL)
+  lock_names(path, NULL);
+  struct pram_file* cache = find_file_cache(path);
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = unlinkat(dirfd, name, 0);
+  put_dir_fd(dir);
+  if (rc == 0)
     {
-      struct pram_file* cache = (struct pram_file*)ret;
-      cache->attr.st_nlink--;
-      if (cache->attr.st_nlink == 0)
-	{
-	  free(cache->buffer);
-	  free(cache->link);
-	  free(cache);
-	  pram_map_put(pram_file_cache, path, NULL);
-	}
+      dir_cache_remove(path);
+      if (cache)
+	forget_path(path, cache);
     }
-  int rc = unlink(p(path));
-  _unlock;
-  return r(rc);
+  rc = r(rc);
+  unlock_names(path, NULL);
+  if (cache)
+    put_file_cache(cache);
+  return rc;
 }
 
 /**
@@ -452,65 +768,65 @@ static int pram_unlink(const char* path)
  */
 static int pram_access(const char* path, int mode)
 {
-  _lock;
-  void* ret = pram_map_get(pram_file_cache, path);
-  if (ret == NULL)
+  struct pram_file* cache = find_file_cache(path);
+  if (cache == NULL)
     {
-      int rc = access(pathbuf, mode);
-      _unlock;
-      return r(rc);
+      struct pram_dir_fd* dir;
+      const char* name;
+      int dirfd = get_dir_fd(path, &name, &dir);
+      int rc = r(faccessat(dirfd, name, mode, 0));
+      put_dir_fd(dir);
+      return rc;
     }
-  else
+  _rdlock(cache);
+  mode_t mod = cache->attr.st_mode;
+  uid_t uid = cache->attr.st_uid;
+  gid_t gid = cache->attr.st_gid;
+  _rwunlock(cache);
+  put_file_cache(cache);
+  uid_t user;
+  gid_t group;
+  mode_t _umask;
+  pid_t _process;
+  gid_t* supplemental = (gid_t*)malloc(128 * sizeof(gid_t));
+  if (supplemental == NULL)
+    throw ENOMEM;
+  int n = get_user_info(&user, &group, &_umask, &_process, supplemental, 128);
+  if (n < 0)
+    n = 0;
+  else if (n > 128)
     {
-      _unlock;
-      struct pram_file* cache = (struct pram_file*)ret;
-      uid_t user;
-      gid_t group;
-      mode_t _umask;
-      pid_t _process;
-      gid_t* supplemental = (gid_t*)malloc(128 * sizeof(gid_t));
+      gid_t* _supplemental = supplemental;
+      supplemental = (gid_t*)realloc(supplemental, n * sizeof(gid_t));
       if (supplemental == NULL)
-	throw ENOMEM;
-      int n = get_user_info(&user, &group, &_umask, &_process, supplemental, 128);
-      if (n < 0)
-	n = 0;
-      else if (n > 128)
 	{
-	  gid_t* _supplemental = supplemental;
-	  supplemental = (gid_t*)realloc(supplemental, n * sizeof(gid_t));
-	  if (supplemental == NULL)
-	    {
-	      free(_supplemental);
-	      throw ENOMEM;
-	    }
-	  n = get_user_info(&user, &group, &_umask, &_process, supplemental, n);
-	  if (n < 0)
-	    n = 0;
+	  free(_supplemental);
+	  throw ENOMEM;
 	}
-	  mode_t mod = cache->attr.st_mode;
-	  uid_t uid = cache->attr.st_uid;
-	  gid_t gid = cache->attr.st_gid;
-	  mode_t test = 0;
-	  test |= (mode & R_OK) ? 0 : 4;
-	  test |= (mode & W_OK) ? 0 : 2;
-	  test |= (mode & X_OK) ? 0 : 1;
-	  test |= mod & 7;
-	  if (user == uid)
-	    test |= (mod & 0700) >> 6;
-	  if (group == gid)
+      n = get_user_info(&user, &group, &_umask, &_process, supplemental, n);
+      if (n < 0)
+	n = 0;
+    }
+  mode_t test = 0;
+  test |= (mode & R_OK) ? 0 : 4;
+  test |= (mode & W_OK) ? 0 : 2;
+  test |= (mode & X_OK) ? 0 : 1;
+  test |= mod & 7;
+  if (user == uid)
+    test |= (mod & 0700) >> 6;
+  if (group == gid)
+    test |= (mod & 070) >> 3;
+  if ((test & 7) != 7)
+    {
+      for (int i = 0; i != n; i++)
+	if ((test & 7) == 7)
+	  break;
+	else
+	  if (*(supplemental + i) == gid)
 	    test |= (mod & 070) >> 3;
-	  if ((test & 7) != 7)
-	    {
-	      for (int i = 0; i != n; i++)
-		if ((test & 7) == 7)
-		  break;
-		else
-		  if (*(supplemental + i) == gid)
-		    test |= (mod & 070) >> 3;
-	    }
-	  free(supplemental);
-	  return (test & 7) == 7 ? 0 : -EACCES;
     }
+  free(supplemental);
+  return (test & 7) == 7 ? 0 : -EACCES;
 }
 
 /**
@@ -526,50 +842,36 @@ static int pram_readlink(const char* path, char* target, size_t size)
   if (size <= 0)
     throw EINVAL;
   struct pram_file* cache = NULL;
-  _lock;
-  int error = r(get_file_cache(path, &cache));
-  _unlock;
-  if (!error)
+  int error = get_file_cache(path, &cache);
+  if (error)
+    return error;
+  _rdlock(cache);
+  int islink = S_ISLNK(cache->attr.st_mode);
+  _rwunlock(cache);
+  if (islink == false)
+    error = -EINVAL;
+  else if (!(error = pram_access(path, R_OK | X_OK)))
     {
-      if (S_ISLNK(cache->attr.st_mode) == false)
-	throw EINVAL;
-      else if (!(error = pram_access(path, R_OK | X_OK)))
+      _wrlock(cache);
+      if ((cache->linkn) == 0)
+	{
+	  struct pram_dir_fd* dir;
+	  const char* name;
+	  int dirfd = get_dir_fd(path, &name, &dir);
+	  error = cache_link(cache, dirfd, name);
+	  put_dir_fd(dir);
+	}
+      if (!error)
 	{
-	  _lock;
-	  if ((cache->linkn) == 0)
-	    {
-	      char* link = (char*)malloc(1024 * sizeof(char));
-	      long n = readlink(p(path), link, 1023);
-	      if (n < 0)
-		{
-		  _unlock;
-		  free(link);
-		  throw errno;
-		}
-	      else if (n > 1023)
-		{
-		  link = (char*)realloc(link, (n + 1) * sizeof(char));
-		  if ((n = readlink(pathbuf, link, 1023)) < 0)
-		    {
-		      _unlock;
-		      free(link);
-		      throw errno;
-		    }
-		}
-	      else if (n < 1023)
-		link = (char*)realloc(link, (n + 1) * sizeof(char));
-	      *(link + n) = 0;
-	      cache->link = link;
-	      cache->linkn = n + 1;
-	    }
 	  char* link = cache->link;
 	  for (size_t i = 0; i < size; i++)
 	    if ((*(target + i) = *(link + i)) == 0)
 	      break;
 	  *(target + size - 1) = 0;
-	  _unlock;
 	}
+      _rwunlock(cache);
     }
+  put_file_cache(cache);
   return error;
 }
 
@@ -598,7 +900,17 @@ static int pram_flock(const char* path, struct fuse_file_info* fi, int op)
 static int pram_fsyncdir(const char* path, int isdatasync, struct fuse_file_info* fi)
 {
   (void) path;
-  return r(isdatasync ? fdatasync(ffd(fi)) : fsync(ffd(fi)));  /* TODO dir is not cached */
+  struct pram_dir_info* di = (struct pram_dir_info*)(uintptr_t)(fi->fh);
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(di->path, &name, &dir);
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+  put_dir_fd(dir);
+  if (fd < 0)
+    throw errno;
+  int rc = r(isdatasync ? fdatasync(fd) : fsync(fd));
+  close(fd);
+  return rc;
 }
 
 /**
@@ -616,29 +928,15 @@ static int pram_fallocate(const char* path, int mode, off_t off, off_t len, stru
   (void) path;
   if (mode)
     throw EOPNOTSUPP;
-  throw posix_fallocate(ffd(fi), off, len);
-  _lock;
+  int error = posix_fallocate(ffd(fi), off, len);
+  if (error)
+    throw error;
   struct pram_file* cache = fcache(fi);
-  int error = 0;
-  if ((unsigned long)(off + len) > cache->allocated)
-    {
-      char* buffer = (char*)realloc(cache->buffer, (off + len) * sizeof(char));
-      if (buffer == NULL)
-	error = -errno;
-      else
-	{
-	  cache->buffer = buffer;
-	  cache->allocated = off + len;
-	}
-    }
-  else
-    {
-      cache->buffer = (char*)malloc((off + len) * sizeof(char));
-      if (cache->buffer == NULL)
-	error = -errno;
-    }
-  _unlock;
-  return error;
+  _wrlock(cache);
+  if (off + len > cache->attr.st_size)
+    resize_file_cache(cache, off + len);
+  _rwunlock(cache);
+  return 0;
 }
 
 /**
@@ -651,42 +949,9 @@ static int pram_fallocate(const char* path, int mode, off_t off, off_t len, stru
 static int pram_flush(const char* path, struct fuse_file_info* fi)
 {
   (void) path;
-  struct pram_file* cache = fcache(fi);
-  uint64_t fd = ffd(fi);
-  unsigned long n;
-  _lock;
-  if ((n = cache->allocated))
-    {
-      cache->allocated = 0;
-      char* buffer = cache->buffer;
-      cache->buffer = NULL;
-      _unlock;
-      unsigned long ptr = 0, wrote;
-      while (ptr < n)
-	{
-	  ptr += wrote = pwrite(fd, buffer + ptr, n - ptr, ptr);
-	  if (wrote == 0)
-	    errno = EIO;
-	  if (wrote <= 0)
-	    {
-	      _lock;
-	      if (cache->allocated)
-		free(buffer);
-	      else
-		{
-		  cache->allocated = n;
-		  cache->buffer = buffer;
-		}
-	      _unlock;
-	      throw wrote;
-	    }
-	}
-      free(buffer);
-    }
-  else
-    _unlock;
+  /* Modified extents are written by the background thread */
   /* FILE* is needed for fflush, and there is not flush, so we need to duplicate and close  */
-  return r(close(dup(fd)));
+  return r(close(dup(ffd(fi))));
 }
 
 /**
@@ -699,7 +964,16 @@ static int pram_flush(const char* path, struct fuse_file_info* fi)
  */
 static int pram_fsync(const char* path, int isdatasync, struct fuse_file_info* fi)
 {
-  int error = pram_flush(path, fi);
+  (void) path;
+  struct pram_file* cache = fcache(fi);
+  /* This also waits for an ongoing write-back by the background thread */
+  int error = write_back_file(cache, false);
+  _wrlock(cache);
+  /* Failures of earlier write-backs, such as of files that have been closed, are reported once */
+  if ((error == 0) && cache->error)
+    error = -(cache->error);
+  cache->error = 0;
+  _rwunlock(cache);
   if (error)
     return error;
   return r(isdatasync ? fdatasync(ffd(fi)) : fsync(ffd(fi)));
@@ -714,11 +988,24 @@ static int pram_fsync(const char* path, int isdatasync, struct fuse_file_info* f
  */
 static int pram_release(const char* path, struct fuse_file_info* fi)
 {
-  pram_flush(path, fi);
+  (void) path;
   struct pram_file_info* file = (struct pram_file_info*)(uintptr_t)(fi->fh);
-  int rc = close(file->fd);
+  int rc = r(close(file->fd));
+  _wrlock(file->cache);
+  /* The file is written back by the background thread, so that closing it does not wait for the HDD */
+  if (--(file->cache->opened) == 0)
+    {
+      _lock;
+      if (file->cache->dirtied)
+	release_dirty(file->cache);
+      _unlock;
+    }
+  close_write_back_fd(file->cache);
+  _rwunlock(file->cache);
+  put_file_cache(file->cache);
+  pthread_mutex_destroy(&(file->readahead_lock));
   free(file);
-  return r(rc);
+  return rc;
 }
 
 /**
@@ -732,40 +1019,96 @@ static int pram_release(const char* path, struct fuse_file_info* fi)
  * @return         Error code if negative, and number of written bytes if non-negative
  */
 static int pram_write(const char* path, const char* buf, size_t len, off_t off, struct fuse_file_info* fi)
+{
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(len);
+  bufv.buf[0].mem = (void*)buf;
+  return pram_write_buf(path, &bufv, off, fi);
+}
+
+/**
+ * Write a buffer vector to a position in a file
+ * 
+ * The data is copied straight from FUSE's buffers, which may be a pipe,
+ * into the cached extents, or spliced to the HDD if it cannot be cached
+ * 
+ * @param    path  The file
+ * @param    buf   The buffer vector to write
+ * @param    off   The offset in the file at which to start the write
+ * @param    fi    File information
+ * @return         Error code if negative, and number of written bytes if non-negative
+ */
+static int pram_write_buf(const char* path, struct fuse_bufvec* buf, off_t off, struct fuse_file_info* fi)
 {
   /* TODO what if this is not a regular file */
   (void) path;
+  size_t len = fuse_buf_size(buf);
   if (len == 0)
     return 0;
   struct pram_file* cache = fcache(fi);
-  if (cache->allocated)
+  int fd = (int)ffd(fi);
+  int readable = (fflags(fi) & O_ACCMODE) != O_WRONLY;
+  size_t n = 0;
+  /* In RAM the write is done at once, but not beyond what the HDD can keep up with */
+  throttle_writer(len);
+  _wrlock(cache);
+  /* Extents in the snapshot would be older than the written data once they are evicted */
+  cache->snapshot = NULL;
+  cache->changes++;
+  off_t size = cache->attr.st_size;
+  if (off + (off_t)len > size)
+    resize_file_cache(cache, off + len);
+  while (n < len)
     {
-      _lock;
-      char* wbuf;
-      if (off + len > (unsigned long)(cache->attr.st_size))
-	cache->attr.st_size = off + len;
-      if (off + len <= cache->allocated)
-	wbuf = cache->buffer;
-      else
+      size_t index = (size_t)((off + n) / PRAM_CHUNK_SIZE);
+      size_t start = (size_t)((off + n) % PRAM_CHUNK_SIZE);
+      size_t part = PRAM_CHUNK_SIZE - start;
+      if (part > len - n)
+	part = len - n;
+      struct pram_chunk* chunk = index < cache->chunkn ? *(cache->chunks + index) : NULL;
+      if ((chunk == NULL) && (cache->fd >= 0))
 	{
-	  wbuf = (char*)realloc(cache->buffer, (cache->allocated = off + len) * sizeof(char));
-	  if (wbuf)
-	    cache->buffer = wbuf;
-	  else
+	  off_t chunk_off = (off_t)index * PRAM_CHUNK_SIZE;
+	  if ((chunk_off >= size) || ((start == 0) && ((part == PRAM_CHUNK_SIZE) ||
+						       (chunk_off + (off_t)part >= cache->attr.st_size))))
+	    chunk = new_chunk(cache, index);
+	  else if (readable)
+	    chunk = get_chunk(cache, index, fd);
+	}
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(part);
+      ssize_t wrote;
+      if (chunk)
+	{
+	  dst.buf[0].mem = chunk->data + start;
+	  wrote = fuse_buf_copy(&dst, buf, 0);
+	  if ((wrote > 0) && (cache->fd < 0))
+	    /* Without a file descriptor for write-back, write through and keep the cache coherent */
+	    wrote = pwrite(fd, chunk->data + start, (size_t)wrote, off + n) < 0 ? -errno : wrote;
+	  else if (wrote > 0)
 	    {
-	      /* TODO free old cache to get more memory */
+	      _lock;
+	      mark_dirty(chunk, start, start + (size_t)wrote);
 	      _unlock;
-	      return r(pwrite(ffd(fi), buf, len, off));
+	      __atomic_store_n(&(chunk->referenced), true, __ATOMIC_RELAXED);
 	    }
 	}
-      _unlock;
-      wbuf += off;
-      for (size_t i = 0; i != len; i++)
-	*(wbuf + i) = *(buf + i);
-      return len;
-    }
-  else
-    return r(pwrite(ffd(fi), buf, len, off));
+      else
+	{
+	  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	  dst.buf[0].fd = fd;
+	  dst.buf[0].pos = off + n;
+	  wrote = fuse_buf_copy(&dst, buf, 0);
+	}
+      if (wrote <= 0)
+	{
+	  _rwunlock(cache);
+	  if (n)
+	    return n;
+	  return wrote < 0 ? (int)wrote : -EIO;
+	}
+      n += (size_t)wrote;
+    }
+  _rwunlock(cache);
+  return n;
 }
 
 /**
@@ -782,62 +1125,184 @@ static int pram_read(const char* path, char* buf, size_t len, off_t off, struct
 {
   /* TODO what if this is not a regular file */
   (void) path;
-  if (len == 0)
-    return 0;
   struct pram_file* cache = fcache(fi);
-  _lock;
-  unsigned long n = off + len;
-  if (n > (unsigned long)(cache->attr.st_size))
-    n = cache->attr.st_size;
-  if (cache->allocated == 0)
+  int fd = (int)ffd(fi);
+  size_t n = 0;
+  int exclusive = false;
+  detect_readahead((struct pram_file_info*)(uintptr_t)(fi->fh), off, len);
+  _rdlock(cache);
+  if (!chunks_cached(cache, off, len))
+    {
+      /* Reading extents from the HDD modifies the cache */
+      _rwunlock(cache);
+      _wrlock(cache);
+      exclusive = true;
+    }
+  if (off >= cache->attr.st_size)
+    len = 0;
+  else if ((off_t)len > cache->attr.st_size - off)
+    len = (size_t)(cache->attr.st_size - off);
+  if (exclusive)
+    fill_chunks(cache, off, len, fd);
+  while (n < len)
     {
-      char* buffer = (char*)malloc(n * sizeof(buf));
-      if (buf == NULL)
+      size_t index = (size_t)((off + n) / PRAM_CHUNK_SIZE);
+      size_t start = (size_t)((off + n) % PRAM_CHUNK_SIZE);
+      size_t part = PRAM_CHUNK_SIZE - start;
+      if (part > len - n)
+	part = len - n;
+      struct pram_chunk* chunk = get_chunk(cache, index, fd);
+      if (chunk == NULL)
 	{
-	  /* TODO free old cache to get more memory */
-	  _unlock;
-	  return r(pread(ffd(fi), buf, len, off));
+	  ssize_t got = pread(fd, buf + n, part, off + n);
+	  if (got <= 0)
+	    {
+	      int error = errno;
+	      _rwunlock(cache);
+	      if (n || (got == 0))
+		return n;
+	      throw error;
+	    }
+	  n += got;
+	  continue;
 	}
-      cache->allocated = n;
-      cache->buffer = buffer;
-      _unlock;
-      unsigned long ptr = 0;
-      uint64_t fd = ffd(fi);
-      while (ptr < n)
+      memcpy(buf + n, chunk->data + start, part);
+      n += part;
+    }
+  _rwunlock(cache);
+  return n;
+}
+
+/**
+ * Read a part of a file into a buffer vector
+ * 
+ * Cached ranges are copied once into buffers that FUSE frees after the
+ * reply, ranges that cannot be cached are spliced from the HDD
+ * 
+ * @param    path  The file
+ * @param    bufp  Output parameter for the buffer vector with the read bytes
+ * @param    len   The number of bytes to read
+ * @param    off   The offset in the file at which to start the read
+ * @param    fi    File information
+ * @return         Error code
+ */
+static int pram_read_buf(const char* path, struct fuse_bufvec** bufp, size_t len, off_t off, struct fuse_file_info* fi)
+{
+  /* TODO what if this is not a regular file */
+  (void) path;
+  struct pram_file* cache = fcache(fi);
+  int fd = (int)ffd(fi);
+  int exclusive = false;
+  size_t i, j, k, n, pieces = len / PRAM_CHUNK_SIZE + 2;
+  struct fuse_bufvec* vec = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec) + pieces * sizeof(struct fuse_buf));
+  struct pram_chunk** chunks = (struct pram_chunk**)malloc(pieces * sizeof(struct pram_chunk*));
+  char* splice = (char*)malloc(pieces * sizeof(char));
+  if ((vec == NULL) || (chunks == NULL) || (splice == NULL))
+    {
+      free(vec);
+      free(chunks);
+      free(splice);
+      throw ENOMEM;
+    }
+  *vec = FUSE_BUFVEC_INIT(0);
+  vec->count = 0;
+  detect_readahead((struct pram_file_info*)(uintptr_t)(fi->fh), off, len);
+  _rdlock(cache);
+  if (!chunks_cached(cache, off, len))
+    {
+      /* Reading extents from the HDD modifies the cache */
+      _rwunlock(cache);
+      _wrlock(cache);
+      exclusive = true;
+    }
+  if (off >= cache->attr.st_size)
+    len = 0;
+  else if ((off_t)len > cache->attr.st_size - off)
+    len = (size_t)(cache->attr.st_size - off);
+  if (exclusive)
+    fill_chunks(cache, off, len, fd);
+
+  /* Fetch the extents first, ranges that cannot be cached, but are on the HDD, are spliced */
+  off_t hdd_size = -1;
+  for (n = pieces = 0; n < len; pieces++)
+    {
+      size_t index = (size_t)((off + n) / PRAM_CHUNK_SIZE);
+      size_t part = PRAM_CHUNK_SIZE - (size_t)((off + n) % PRAM_CHUNK_SIZE);
+      if (part > len - n)
+	part = len - n;
+      /* Only extents fetched later in the same read can evict the extent */
+      if ((*(chunks + pieces) = get_chunk(cache, index, fd)) && exclusive)
+	(*(chunks + pieces))->busy = true;
+      else if ((*(chunks + pieces) == NULL) && (hdd_size < 0))
 	{
-	  ssize_t r = pread(fd, buffer + ptr, n - ptr, ptr);
-	  if (r < 0)
+	  struct stat attr;
+	  hdd_size = fstat(fd, &attr) ? 0 : attr.st_size;
+	}
+      n += part;
+      *(splice + pieces) = (*(chunks + pieces) == NULL) && (off + (off_t)n <= hdd_size);
+    }
+
+  /* Consecutive pieces of the same kind share a buffer */
+  for (n = i = 0; i < pieces; i = j)
+    {
+      for (j = i, k = n; (j < pieces) && (*(splice + j) == *(splice + i)); j++)
+	k += PRAM_CHUNK_SIZE - (size_t)((off + k) % PRAM_CHUNK_SIZE) < len - k ?
+	     PRAM_CHUNK_SIZE - (size_t)((off + k) % PRAM_CHUNK_SIZE) : len - k;
+      struct fuse_buf* b = vec->buf + vec->count++;
+      *b = (struct fuse_buf){ .size = k - n, .flags = (enum fuse_buf_flags)0, .mem = NULL, .fd = fd, .pos = off + n };
+      if (*(splice + i))
+	{
+	  b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	  n = k;
+	  continue;
+	}
+      if ((b->mem = malloc(b->size)) == NULL)
+	goto fail;
+      for (k = 0; i < j; i++)
+	{
+	  size_t start = (size_t)((off + n) % PRAM_CHUNK_SIZE);
+	  size_t part = PRAM_CHUNK_SIZE - start;
+	  if (part > len - n)
+	    part = len - n;
+	  if (*(chunks + i))
 	    {
-	      if ((cache->allocated = ptr) == 0)
-		{
-		  _lock;
-		  free(buffer);
-		  cache->buffer = NULL;
-		  _unlock;
-		  throw errno;
-		}
+	      memcpy((char*)(b->mem) + k, (*(chunks + i))->data + start, part);
+	      if (exclusive)
+		(*(chunks + i))->busy = false;
 	    }
-	  if (r == 0)
+	  else
 	    {
-	      n = ptr;
-	      _lock;
-	      cache->allocated = n;
-	      buffer = (char*)realloc(buffer, n * sizeof(char*));
-	      if (buffer)
-		cache->buffer = buffer;
-	      _unlock;
-	      break;
+	      /* Bytes the HDD does not have yet are zero */
+	      ssize_t got = pread(fd, (char*)(b->mem) + k, part, off + n);
+	      if (got < 0)
+		goto fail;
+	      memset((char*)(b->mem) + k + got, 0, part - (size_t)got);
 	    }
-	  ptr += r;
+	  k += part;
+	  n += part;
 	}
     }
-  n -= off;
-  if (n >> 31)
-    n = len & ((1L << 32) - 1L);
-  char* buffer = cache->buffer + off;
-  for (unsigned long i = 0; i != n; i++)
-    *(buf + i) = *(buffer + i);
-  return n;
+  _rwunlock(cache);
+  free(chunks);
+  free(splice);
+  if (vec->count == 0)
+    vec->count = 1;
+  *bufp = vec;
+  return 0;
+
+ fail:
+  n = (size_t)errno;
+  if (exclusive)
+    for (i = 0; i < pieces; i++)
+      if (*(chunks + i))
+	(*(chunks + i))->busy = false;
+  _rwunlock(cache);
+  for (i = 0; i < vec->count; i++)
+    free(vec->buf[i].mem);
+  free(vec);
+  free(chunks);
+  free(splice);
+  throw (int)n;
 }
 
 /**
@@ -849,12 +1314,16 @@ static int pram_read(const char* path, char* buf, size_t len, off_t off, struct
  */
 static int pram_releasedir(const char* path, struct fuse_file_info* fi)
 {
-  /* TODO dir is not cached */
   (void) path;
   struct pram_dir_info* di = (struct pram_dir_info*)(uintptr_t)(fi->fh);
-  int err = r(closedir(di->dp));
+  _wrlock(di->cache);
+  di->cache->opened--;
+  compact_dir_cache(di->cache);
+  _rwunlock(di->cache);
+  put_file_cache(di->cache);
+  free(di->path);
   free(di);
-  return err;
+  return 0;
 }
 
 /**
@@ -866,20 +1335,37 @@ static int pram_releasedir(const char* path, struct fuse_file_info* fi)
  */
 static int pram_opendir(const char* path, struct fuse_file_info* fi)
 {
-  /* TODO dir is not cached */
   struct pram_dir_info* di = (struct pram_dir_info*)malloc(sizeof(struct pram_dir_info));
   if (di == NULL)
     throw ENOMEM;
-  sync_call(di->dp = opendir(p(path)));
-  if (di->dp == NULL)
+  if ((di->path = strdup(path)) == NULL)
     {
-      int error = errno;
       free(di);
-      throw error;
+      throw ENOMEM;
+    }
+  int error = get_file_cache(path, &(di->cache));
+  if (error)
+    {
+      free(di->path);
+      free(di);
+      return error;
     }
-  di->entry = NULL;
-  di->offset = 0;
-  fi->fh = (long)di;
+  _wrlock(di->cache);
+  if (!S_ISDIR(di->cache->attr.st_mode))
+    error = -ENOTDIR;
+  else if (di->cache->listed == false)
+    error = load_dir_cache(di->cache, path);
+  if (!error)
+    di->cache->opened++;
+  _rwunlock(di->cache);
+  if (error)
+    {
+      put_file_cache(di->cache);
+      free(di->path);
+      free(di);
+      return error;
+    }
+  fi->fh = (uint64_t)(uintptr_t)di;
   return 0;
 }
 
@@ -895,31 +1381,24 @@ static int pram_opendir(const char* path, struct fuse_file_info* fi)
  */
 static int pram_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info* fi)
 {
-  /* TODO dir is not cached */
   (void) path;
   struct pram_dir_info* di = (struct pram_dir_info*)(uintptr_t)(fi->fh);
-  if (off != di->offset)
-    {
-      seekdir(di->dp, off);
-      di->entry = NULL;
-      di->offset = off;
-    }
-  for (;;)
+  struct pram_file* cache = di->cache;
+  struct stat st;
+  memset(&st, 0, sizeof(struct stat));
+  _rdlock(cache);
+  /* Removed entries are left as holes while the directory is open, so offsets stay valid */
+  for (size_t i = (size_t)off; i < cache->entryn; i++)
     {
-      struct stat st;
-      off_t next_offset;
-      if (di->entry == NULL)
-	  if ((di->entry = readdir(di->dp)) == NULL)
-	    break;
-      memset(&st, 0, sizeof(struct stat));
-      st.st_ino = di->entry->d_ino;
-      st.st_mode = di->entry->d_type << 12;
-      next_offset = telldir(di->dp);
-      if (filler(buf, di->entry->d_name, &st, next_offset))
+      struct pram_dirent* entry = cache->entries + i;
+      if (entry->name == NULL)
+	continue;
+      st.st_ino = entry->ino;
+      st.st_mode = entry->mode;
+      if (filler(buf, entry->name, &st, (off_t)(i + 1)))
 	break;
-      di->entry = NULL;
-      di->offset = next_offset;
     }
+  _rwunlock(cache);
   return 0;
 }
 
@@ -933,25 +1412,7 @@ static int pram_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off
  */
 static int pram_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
-  /* TODO dir is not cached*/
-  _lock;
-  int fd = open(p(path), fi->flags, mode);
-  if (fd < 0)
-    throw fd;
-  struct pram_file* cache = (struct pram_file*)malloc(sizeof(struct pram_file));
-  int error = get_file_cache(path, &cache);
-  _unlock;
-  if (error)
-    {
-      free(cache);
-      close(fd);
-      return error;
-    }
-  struct pram_file_info* file = (struct pram_file_info*)malloc(sizeof(struct pram_file_info));
-  file->fd = fd;
-  file->cache = cache;
-  fi->fh = (uint64_t)(void*)file;
-  return 0;
+  return open_file(path, fi, mode, true);
 }
 
 /**
@@ -963,24 +1424,7 @@ static int pram_create(const char* path, mode_t mode, struct fuse_file_info* fi)
  */
 static int pram_open(const char* path, struct fuse_file_info* fi)
 {
-  _lock;
-  int fd = open(p(path), fi->flags);
-  if (fd < 0)
-    throw fd;
-  struct pram_file* cache = (struct pram_file*)malloc(sizeof(struct pram_file));
-  int error = get_file_cache(path, &cache);
-  _unlock;
-  if (error)
-    {
-      free(cache);
-      close(fd);
-      return error;
-    }
-  struct pram_file_info* file = (struct pram_file_info*)malloc(sizeof(struct pram_file_info));
-  file->fd = fd;
-  file->cache = cache;
-  fi->fh = (uint64_t)(void*)file;
-  return 0;
+  return open_file(path, fi, 0, fi->flags & O_CREAT);
 }
 
 /**
@@ -992,39 +1436,45 @@ static int pram_open(const char* path, struct fuse_file_info* fi)
  */
 static int pram_utimens(const char* path, const struct timespec ts[2])
 {
-  _lock;
   struct pram_file* cache = NULL;
   int error = get_file_cache(path, &cache);
-  if (!error)
-    if (!(error = utimensat(0, pathbuf, ts, AT_SYMLINK_NOFOLLOW)))
-      {
-	if (ts == NULL)
-	  {
-	    struct stat attr;
-	    error = lstat(p(path), &attr);
-	    if (!error)
-	      cache->attr = attr;
-	  }
-	else
-	  {
-	    #if defined __USE_MISC || defined __USE_XOPEN2K8
-	      cache->attr.st_atim = ts[0];
-	      cache->attr.st_mtim = ts[1];
-	    #else
-	      cache->attr.st_atime = ts[0].tv_sec;
-	      cache->attr.st_mtime = ts[1].tv_sec;
-	      cache->attr.st_atimensec = ts[0].tv_nsec;
-	      cache->attr.st_mtimensec = ts[1].tv_nsec;
-	    #endif
-	    /* TODO update ctime? */
-	  }
-      }
-  _unlock;
-  return r(error);
+  if (error)
+    return error;
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  _wrlock(cache);
+  if (!(error = utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW)))
+    {
+      if (ts == NULL)
+	{
+	  struct stat attr;
+	  error = fstatat(dirfd, name, &attr, AT_SYMLINK_NOFOLLOW);
+	  if (!error)
+	    cache->attr = attr;
+	}
+      else
+	{
+	  #if defined __USE_MISC || defined __USE_XOPEN2K8
+	    cache->attr.st_atim = ts[0];
+	    cache->attr.st_mtim = ts[1];
+	  #else
+	    cache->attr.st_atime = ts[0].tv_sec;
+	    cache->attr.st_mtime = ts[1].tv_sec;
+	    cache->attr.st_atimensec = ts[0].tv_nsec;
+	    cache->attr.st_mtimensec = ts[1].tv_nsec;
+	  #endif
+	  /* TODO update ctime? */
+	}
+    }
+  put_dir_fd(dir);
+  error = r(error);
+  _rwunlock(cache);
+  put_file_cache(cache);
+  return error;
 }
 
 
-
 /**
  * The file system operations
  */
@@ -1054,6 +1504,8 @@ static struct fuse_operations pram_oper = {
   .flush = pram_flush,
   .write = pram_write,
   .read = pram_read,
+  .write_buf = pram_write_buf,
+  .read_buf = pram_read_buf,
   .releasedir = pram_releasedir,
   .opendir = pram_opendir,
   .readdir = pram_readdir,
@@ -1086,11 +1538,126 @@ static struct fuse_operations pram_oper = {
  * @param   data  Private use input data
  * @return        Private use output data
  */
-/*void* pram_background(void* data)
+static void* pram_background(void* data)
 {
   (void) data;
+  _lock;
+  while (pram_running)
+    {
+      struct timespec timeout;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_sec += 1;
+      pthread_cond_timedwait(&pram_flush_cond, &pram_mutex, &timeout);
+      flush_dirty_files(false);
+    }
+  _unlock;
   return NULL;
-}*/
+}
+
+/**
+ * Write modified files to the HDD, the mutex must be held
+ * and will be released during the writes
+ * 
+ * @param  all  Whether to write all modified files, rather than only those
+ *              that are old enough or needed to reduce memory pressure
+ */
+static void flush_dirty_files(int all)
+{
+  /* Files that fail are put back last in the list, so do not visit any file twice */
+  size_t n = pram_dirty_files;
+  while (pram_dirty && n--)
+    {
+      if (!all && !dirty_pressure() && !(pram_dirty->released) && (pram_dirty->dirtied + pram_flush_age > time(NULL)))
+	break;
+      struct pram_file* cache = pram_dirty;
+      if (pin_file_cache(cache) < 0)
+	{
+	  /* The file is unlinked and is being freed */
+	  unlist_dirty(cache);
+	  continue;
+	}
+      _unlock;
+      write_back_file(cache, !all);
+      put_file_cache(cache);
+      _lock;
+    }
+}
+
+/**
+ * Check whether so much content is modified, or writers are waiting for it, that
+ * it should be written to the HDD regardless of its age, the mutex must be held
+ * 
+ * @return  Whether modified content should be written to the HDD
+ */
+static inline int dirty_pressure(void)
+{
+  size_t limit = pram_cache_size;
+  if (pram_dirty_limit && ((limit == 0) || (pram_dirty_limit < limit)))
+    limit = pram_dirty_limit;
+  return pram_throttled || (limit && (pram_dirty_bytes > limit / 100 * pram_dirty_ratio));
+}
+
+/**
+ * Slow down or hold back a writer, so that the modified content, including
+ * that being written to the HDD, does not exceed `pram_dirty_limit`, no
+ * lock may be held
+ * 
+ * @param  len  The number of bytes about to be written
+ */
+static void throttle_writer(size_t len)
+{
+  if (pram_dirty_limit == 0)
+    return;
+  size_t start = pram_dirty_limit / 100 * pram_dirty_ratio;
+  _lock;
+  size_t used = pram_dirty_bytes + pram_flushing_bytes;
+  /* At the limit writers wait for content to be written, unless writing it fails */
+  while (pram_running && used && (used + len > pram_dirty_limit) && !pram_drain_failed)
+    {
+      pthread_cond_signal(&pram_flush_cond);
+      pram_throttled++;
+      pthread_cond_wait(&pram_throttle_cond, &pram_mutex);
+      pram_throttled--;
+      used = pram_dirty_bytes + pram_flushing_bytes;
+    }
+  size_t rate = pram_drain_rate ? pram_drain_rate : pram_drain_bandwidth;
+  _unlock;
+  if ((rate == 0) || (used <= start) || (used >= pram_dirty_limit))
+    return;
+  /* Writers are slowed down more the closer they are to the limit, so that
+     they write as fast as content is drained half way between `start` and it */
+  double scaled = (double)len * 1000000000. / (double)rate * (double)(used - start) / (double)(pram_dirty_limit - used);
+  /* Scaled in floating point, so that a large pause clamps rather than wraps around */
+  unsigned long long pause = scaled > (double)PRAM_THROTTLE_MAX ? PRAM_THROTTLE_MAX : (unsigned long long)scaled;
+  struct timespec delay;
+  delay.tv_sec = (time_t)(pause / 1000000000ULL);
+  delay.tv_nsec = (long)(pause % 1000000000ULL);
+  while (nanosleep(&delay, &delay) && (errno == EINTR))
+    ;
+}
+
+
+
+/**
+ * Mount options specific to pramfusehpc
+ */
+static struct fuse_opt pram_opts[] = {
+  FUSE_OPT_KEY("cache_size=", PRAM_OPT_CACHE_SIZE),
+  FUSE_OPT_KEY("flush_age=", PRAM_OPT_FLUSH_AGE),
+  FUSE_OPT_KEY("dirty_ratio=", PRAM_OPT_DIRTY_RATIO),
+  FUSE_OPT_KEY("negative_ttl=", PRAM_OPT_NEGATIVE_TTL),
+  FUSE_OPT_KEY("negative_max=", PRAM_OPT_NEGATIVE_MAX),
+  FUSE_OPT_KEY("dir_fds=", PRAM_OPT_DIR_FDS),
+  FUSE_OPT_KEY("prewarm=", PRAM_OPT_PREWARM),
+  FUSE_OPT_KEY("snapshot=", PRAM_OPT_SNAPSHOT),
+  FUSE_OPT_KEY("snapshot_data", PRAM_OPT_SNAPSHOT_DATA),
+  FUSE_OPT_KEY("readahead=", PRAM_OPT_READAHEAD),
+  FUSE_OPT_KEY("flush_threads=", PRAM_OPT_FLUSH_THREADS),
+  FUSE_OPT_KEY("stripe_size=", PRAM_OPT_STRIPE_SIZE),
+  FUSE_OPT_KEY("dirty_limit=", PRAM_OPT_DIRTY_LIMIT),
+  FUSE_OPT_KEY("drain_rate=", PRAM_OPT_DRAIN_RATE),
+  FUSE_OPT_END
+};
 
 
 
@@ -1125,26 +1692,29 @@ int main(int argc, char** argv)
       return 1;
     }
   
-  /* pthread_t background_thread; */
-  pthread_attr_t pth_attr;
-  
   if ((errno = pthread_mutex_init(&pram_mutex, NULL)))
     {
       perror("pthread_mutex_init");
       return 1;
     }
-  if ((errno = pthread_attr_init(&pth_attr)))
+  
+  if ((errno = pthread_key_create(&pram_pathbuf_key, free)))
     {
-      perror("pthread_attr_init");
+      perror("pthread_key_create");
       return 1;
     }
-  /*
-  if ((errno = pthread_create(&background_thread, &pth_attr, pram_background, NULL)))
+  
+  if ((errno = pthread_key_create(&pram_finger_key, free)))
     {
-      perror("pthread_create");
+      perror("pthread_key_create");
+      return 1;
+    }
+  
+  if ((errno = pthread_key_create(&pram_io_key, free_io)))
+    {
+      perror("pthread_key_create");
       return 1;
     }
-  */
   
   hdd = realpath(hdd, NULL);
   if (hdd == NULL)
@@ -1155,15 +1725,14 @@ int main(int argc, char** argv)
   hddlen = 0;
   for (long j = 0; (*(hdd + j)); j++)
     hddlen++;
-  long bufsize = hddlen | (hddlen >> 1);
-  for (long s = 1; s < 32; s <<= 1)
-    bufsize |= bufsize >> s;
-  bufsize += 1;
-  pathbuf = (char*)malloc(bufsize * sizeof(char));
-  for (long j = 0; j < hddlen; j++)
-    *(pathbuf + j) = *(hdd + j);
   if ((hddlen > 0) && (*(hdd + hddlen - 1) == '/'))
     hddlen--;
+  hddroot = hdd;
+  if ((hddfd = open(hdd, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+      perror("open");
+      return 1;
+    }
   
   i--;
   char** _argv = (char**)malloc(_argc * sizeof(char*));
@@ -1173,9 +1742,16 @@ int main(int argc, char** argv)
     else
       *(_argv + k++) = *(argv + j);
   
-  free(hdd);
-  int rc = fuse_main(_argc, _argv, &pram_oper, NULL);
+  struct fuse_args args = FUSE_ARGS_INIT(_argc, _argv);
+  if (fuse_opt_parse(&args, NULL, pram_opts, pram_opt_proc) < 0)
+    return 1;
+  int rc = fuse_main(args.argc, args.argv, &pram_oper, NULL);
+  fuse_opt_free_args(&args);
   free(_argv);
+  close(hddfd);
+  free(pram_prewarm);
+  free(pram_snapshot);
+  free(hdd);
   return rc;
 }
 
@@ -1197,7 +1773,9 @@ static inline long eq(const char* a, const char* b)
 }
 
 /**
- * Return a path as it is named on the HDD relative to the root mount path
+ * Return a path as it is named on the HDD relative to the root mount path,
+ * for functions that have no `*at` variant, the path is put in the
+ * calling thread's `pathbuf`
  * 
  * @param   path  The path in RAM
  * @return        The path on HDD
@@ -1209,8 +1787,13 @@ static char* p(const char* path)
     ;
   if (n + hddlen > pathbufsize)
     {
+      int first = pathbuf == NULL;
       pathbufsize = n + hddlen + 128;
       pathbuf = (char*)realloc(pathbuf, pathbufsize * sizeof(char));
+      if (first)
+	for (long i = 0; i < hddlen; i++)
+	  *(pathbuf + i) = *(hddroot + i);
+      pthread_setspecific(pram_pathbuf_key, pathbuf);
     }
   pathbuf += hddlen;
   for (long i = 0; i < n; i++)
@@ -1219,19 +1802,16 @@ static char* p(const char* path)
 }
 
 /**
- * Return a path as it is named on the HDD relative to the root mount path,
- * but use a new allocation for the path buffer.
+ * Return a path as it is named on the HDD relative to `hddfd`, for use with
+ * the `*at` functions, the path is not copied
  * 
- * @parma   hdd   The old path buffer
  * @param   path  The path in RAM
- * @return        The path on HDD
+ * @return        The path on HDD, relative to `hddfd`
  */
-static inline char* q(const char* hdd, const char* path)
+static inline const char* h(const char* path)
 {
-  pathbuf = (char*)malloc(pathbufsize * sizeof(char));
-  for (int i = 0; i < hddlen; i++)
-    *(pathbuf + i) = *(hdd + i);
-  return p(path);
+  /* The paths FUSE gives all begin with a slash */
+  return *(path + 1) ? path + 1 : ".";
 }
 
 /**
@@ -1245,6 +1825,247 @@ static inline int r(int rc)
   return rc < 0 ? -errno : rc;
 }
 
+/**
+ * Gets the calling thread's queue of reads and writes, initialising it on first use
+ * 
+ * @return  The queue, it is empty unless the thread left operations in it
+ */
+static pram_io* get_io(void)
+{
+  if (pram_io_ready == false)
+    {
+      pram_io_init(&pram_io_thread);
+      pram_io_ready = true;
+      pthread_setspecific(pram_io_key, &pram_io_thread);
+    }
+  return &pram_io_thread;
+}
+
+/**
+ * Free the resources of a thread's queue of reads and writes when the thread exits
+ * 
+ * @param  io  The queue
+ */
+static void free_io(void* io)
+{
+  pram_io_destroy((pram_io*)io);
+}
+
+/**
+ * Parse a size that may have a binary unit suffix, such as `K`, `M` or `G`
+ * 
+ * @param   str    The string to parse
+ * @param   value  Output parameter for the size
+ * @return         Zero on success, -1 if the string is not a valid size
+ */
+static int parse_size(const char* str, size_t* value)
+{
+  char* end;
+  if ((*str < '0') || (*str > '9'))
+    return -1;
+  errno = 0;
+  unsigned long long size = strtoull(str, &end, 10);
+  if (errno)
+    return -1;
+  int shift = 0;
+  switch (*end)
+    {
+    case 'k':  case 'K':  shift = 10;  end++;  break;
+    case 'm':  case 'M':  shift = 20;  end++;  break;
+    case 'g':  case 'G':  shift = 30;  end++;  break;
+    case 't':  case 'T':  shift = 40;  end++;  break;
+    }
+  if (*end || ((size << shift) >> shift != size))
+    return -1;
+  *value = (size_t)(size << shift);
+  return 0;
+}
+
+/**
+ * Parse a non-negative integer
+ * 
+ * @param   str    The string to parse
+ * @param   value  Output parameter for the integer
+ * @return         Zero on success, -1 if the string is not a valid integer
+ */
+static int parse_number(const char* str, size_t* value)
+{
+  char* end;
+  if ((*str < '0') || (*str > '9'))
+    return -1;
+  errno = 0;
+  unsigned long long number = strtoull(str, &end, 10);
+  if (errno || *end || ((size_t)number != number))
+    return -1;
+  *value = (size_t)number;
+  return 0;
+}
+
+/**
+ * Process a mount option that was not recognised by FUSE
+ * 
+ * @param   data     Private use input
+ * @param   arg      The option
+ * @param   key      The key for the option
+ * @param   outargs  The arguments that are passed on to FUSE
+ * @return           -1 on error, 0 to discard the option, 1 to keep it
+ */
+static int pram_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+  (void) data;
+  (void) outargs;
+  size_t number;
+  switch (key)
+    {
+    case PRAM_OPT_CACHE_SIZE:
+      if (parse_size(arg + strlen("cache_size="), &pram_cache_size) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_FLUSH_AGE:
+      if (parse_number(arg + strlen("flush_age="), &number) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      pram_flush_age = (time_t)number;
+      return 0;
+      
+    case PRAM_OPT_DIRTY_RATIO:
+      if ((parse_number(arg + strlen("dirty_ratio="), &pram_dirty_ratio) < 0) || (pram_dirty_ratio > 100))
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_NEGATIVE_TTL:
+      if (parse_number(arg + strlen("negative_ttl="), &number) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      pram_negative_ttl = (time_t)number;
+      return 0;
+      
+    case PRAM_OPT_NEGATIVE_MAX:
+      if (parse_number(arg + strlen("negative_max="), &pram_negative_max) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_DIR_FDS:
+      if (parse_number(arg + strlen("dir_fds="), &pram_dir_fd_max) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_PREWARM:
+      {
+	/* The directory is named as in RAM, without redundant slashes at the ends */
+	const char* dir = arg + strlen("prewarm=");
+	size_t n;
+	while (*dir == '/')
+	  dir++;
+	for (n = strlen(dir); n && (*(dir + n - 1) == '/'); n--)
+	  ;
+	free(pram_prewarm);
+	if ((pram_prewarm = (char*)malloc((n + 2) * sizeof(char))) == NULL)
+	  {
+	    perror("malloc");
+	    return -1;
+	  }
+	*pram_prewarm = '/';
+	memcpy(pram_prewarm + 1, dir, n * sizeof(char));
+	*(pram_prewarm + n + 1) = 0;
+	return 0;
+      }
+      
+    case PRAM_OPT_SNAPSHOT:
+      {
+	/* FUSE changes the working directory when it daemonises */
+	const char* file = arg + strlen("snapshot=");
+	char* cwd = *file == '/' ? NULL : get_current_dir_name();
+	size_t n = cwd ? strlen(cwd) + 1 : 0;
+	if ((*file == 0) || ((*file != '/') && (cwd == NULL)))
+	  {
+	    fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	    free(cwd);
+	    return -1;
+	  }
+	free(pram_snapshot);
+	if ((pram_snapshot = (char*)malloc((n + strlen(file) + 1) * sizeof(char))) == NULL)
+	  {
+	    perror("malloc");
+	    free(cwd);
+	    return -1;
+	  }
+	if (cwd)
+	  {
+	    memcpy(pram_snapshot, cwd, (n - 1) * sizeof(char));
+	    *(pram_snapshot + n - 1) = '/';
+	  }
+	strcpy(pram_snapshot + n, file);
+	free(cwd);
+	return 0;
+      }
+      
+    case PRAM_OPT_SNAPSHOT_DATA:
+      pram_snapshot_data = true;
+      return 0;
+      
+    case PRAM_OPT_READAHEAD:
+      if (parse_size(arg + strlen("readahead="), &pram_readahead) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_FLUSH_THREADS:
+      if (parse_number(arg + strlen("flush_threads="), &pram_flush_threads) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_STRIPE_SIZE:
+      if ((parse_size(arg + strlen("stripe_size="), &pram_stripe_size) < 0) || (pram_stripe_size == 0))
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_DIRTY_LIMIT:
+      if (parse_size(arg + strlen("dirty_limit="), &pram_dirty_limit) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    case PRAM_OPT_DRAIN_RATE:
+      if (parse_size(arg + strlen("drain_rate="), &pram_drain_rate) < 0)
+	{
+	  fprintf(stderr, "pramfusehpc: error: invalid %s\n", arg);
+	  return -1;
+	}
+      return 0;
+      
+    default:
+      return 1;
+    }
+}
+
 
 
 /**
@@ -1275,7 +2096,8 @@ int get_user_info(uid_t* user, gid_t* group, mode_t* umask, pid_t* process, gid_
 
 
 /**
- * Gets the file cache for a file by its name
+ * Gets the file cache for a file by its name, the cache
+ * must be released with `put_file_cache`
  * 
  * @param   path   The file
  * @param   cache  Area to put the cache in
@@ -1283,24 +2105,2735 @@ int get_user_info(uid_t* user, gid_t* group, mode_t* umask, pid_t* process, gid_
  */
 int get_file_cache(const char* path, struct pram_file** cache)
 {
-  void* ret = pram_map_get(pram_file_cache, path);
-  if (ret == NULL)
-    {
-      struct stat attr;
-      int error = lstat(p(path), &attr);
-      if (error)
-	throw errno;
-      struct pram_file* c = (struct pram_file*)malloc(sizeof(struct pram_file));
-      memset(c, 0, sizeof(struct pram_file));
-      (*cache = c)->attr = attr;
-      c->buffer = NULL;
-      c->allocated = 0;
-      c->link = NULL;
-      c->linkn = 0;
-      pram_map_put(pram_file_cache, path, c);
+  if ((*cache = find_file_cache(path)))
+    return 0;
+  lock_names(path, NULL);
+  int error = load_file_cache(path, cache);
+  unlock_names(path, NULL);
+  return error;
+}
+
+
+/**
+ * Free a file cache and all its cached extents
+ * 
+ * @param  cache  The file cache
+ */
+static void free_file_cache(struct pram_file* cache)
+{
+  _lock;
+  for (size_t i = 0; i < cache->chunkn; i++)
+    if (*(cache->chunks + i))
+      release_chunk(*(cache->chunks + i));
+  if (cache->dirtied)
+    unlist_dirty(cache);
+  _unlock;
+  free(cache->chunks);
+  if (cache->fd >= 0)
+    close(cache->fd);
+  for (size_t i = 0; i < cache->entryn; i++)
+    free((cache->entries + i)->name);
+  free(cache->entries);
+  free_xattrs(cache);
+  free(cache->link);
+  pthread_rwlock_destroy(&(cache->lock));
+  pthread_mutex_destroy(&(cache->flush_lock));
+  /* Lookups that found the cache before it was unlinked may still be inspecting it */
+  pram_map_retire(cache);
+}
+
+
+/**
+ * Free a file cache and all its cached extents on unmount, without removing the
+ * extents from the eviction clock or the file from the list of modified files,
+ * so that it can be done in parallel, no other thread may be using the cache
+ * 
+ * @param  cache  The file cache
+ */
+static void discard_file_cache(struct pram_file* cache)
+{
+  for (size_t i = 0; i < cache->chunkn; i++)
+    if (*(cache->chunks + i))
+      {
+	free((*(cache->chunks + i))->data);
+	free(*(cache->chunks + i));
+      }
+  free(cache->chunks);
+  if (cache->fd >= 0)
+    close(cache->fd);
+  for (size_t i = 0; i < cache->entryn; i++)
+    free((cache->entries + i)->name);
+  free(cache->entries);
+  free_xattrs(cache);
+  free(cache->link);
+  pthread_rwlock_destroy(&(cache->lock));
+  pthread_mutex_destroy(&(cache->flush_lock));
+  free(cache);
+}
+
+
+/**
+ * Free file caches that are being freed on unmount until none are left
+ * 
+ * @param   teardown  The file caches, as a `struct pram_teardown*`
+ * @return            `NULL`
+ */
+static void* teardown_file_caches(void* teardown)
+{
+  struct pram_teardown* t = (struct pram_teardown*)teardown;
+  size_t i, end;
+  /* Files differ a lot in size, so the caches are taken a few at a time rather than split evenly */
+  while ((i = __atomic_fetch_add(&(t->next), PRAM_TEARDOWN_BATCH, __ATOMIC_RELAXED)) < t->count)
+    for (end = i + PRAM_TEARDOWN_BATCH < t->count ? i + PRAM_TEARDOWN_BATCH : t->count; i < end; i++)
+      discard_file_cache(*(t->caches + i));
+  return NULL;
+}
+
+
+/**
+ * Free all file caches on unmount, on up to `PRAM_TEARDOWN_THREADS` threads
+ * 
+ * @param  caches  `NULL`-terminated array of the file caches, it is not freed
+ */
+static void free_all_file_caches(struct pram_file** caches)
+{
+  pthread_t threads[PRAM_TEARDOWN_THREADS];
+  struct pram_teardown teardown;
+  long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+  teardown.caches = caches;
+  teardown.next = 0;
+  for (teardown.count = 0; *(caches + teardown.count); teardown.count++)
+    ;
+  if (n > (long)(teardown.count / PRAM_TEARDOWN_BATCH))
+    n = (long)(teardown.count / PRAM_TEARDOWN_BATCH);
+  if (n > PRAM_TEARDOWN_THREADS)
+    n = PRAM_TEARDOWN_THREADS;
+  /* The calling thread frees caches too, so it is enough if no thread can be created */
+  for (i = 0; i + 1 < n; i++)
+    if (pthread_create(threads + i, NULL, teardown_file_caches, &teardown))
+      break;
+  teardown_file_caches(&teardown);
+  while (i--)
+    pthread_join(*(threads + i), NULL);
+  /* The extents and the modified files were not unlinked from these one by one */
+  _lock;
+  pram_clock = NULL;
+  pram_cache_used = 0;
+  pram_dirty = pram_dirty_last = NULL;
+  pram_dirty_files = 0;
+  pram_dirty_bytes = 0;
+  _unlock;
+}
+
+
+/**
+ * Change the size of a cached file, discarding extents after the end
+ * and zeroing new bytes in the cached extent at the old end, the file
+ * must be write locked
+ * 
+ * @param  cache   The file cache
+ * @param  length  The new size of the file
+ */
+static void resize_file_cache(struct pram_file* cache, off_t length)
+{
+  off_t size = cache->attr.st_size;
+  blkcnt_t blocks = cache->attr.st_blocks;
+  cache->snapshot = NULL;
+  cache->changes++;
+  size += (!!(size & 511)) << 9;
+  blocks -= size >> 9;
+  size = length;
+  size += (!!(size & 511)) << 9;
+  blocks += size >> 9;
+  cache->attr.st_size = length;
+  cache->attr.st_blocks = blocks;
+  
+  size_t i, n = (size_t)((length + PRAM_CHUNK_SIZE - 1) / PRAM_CHUNK_SIZE);
+  _lock;
+  for (i = n; i < cache->chunkn; i++)
+    if (*(cache->chunks + i))
+      release_chunk(*(cache->chunks + i));
+  if (cache->chunkn > n)
+    cache->chunkn = n;
+  
+  for (i = 0; i < cache->chunkn; i++)
+    {
+      struct pram_chunk* chunk = *(cache->chunks + i);
+      if (chunk == NULL)
+	continue;
+      off_t end = length - (off_t)i * PRAM_CHUNK_SIZE;
+      size_t chunk_length = end < PRAM_CHUNK_SIZE ? (size_t)end : PRAM_CHUNK_SIZE;
+      if (chunk->length < chunk_length)
+	memset(chunk->data + chunk->length, 0, chunk_length - chunk->length);
+      chunk->length = chunk_length;
+      if (chunk->dirty_end > chunk_length)
+	{
+	  size_t start = chunk->dirty_start;
+	  mark_clean(chunk);
+	  if (start < chunk_length)
+	    mark_dirty(chunk, start, chunk_length);
+	}
+    }
+  _unlock;
+}
+
+
+/**
+ * Account for a new extent, evicting unmodified extents that have not
+ * been used recently if the cache would otherwise exceed its size limit,
+ * the mutex must be held
+ * 
+ * @param   cache  The file cache the extent is for, it must be write locked
+ * @return         Zero on success, -1 if no memory could be made available
+ */
+static int reserve_chunk(struct pram_file* cache)
+{
+  if (pram_cache_size)
+    {
+      /* Two revolutions: the first may only clear reference bits */
+      size_t sweep = 2 * (pram_cache_used / PRAM_CHUNK_SIZE);
+      while (pram_cache_used + PRAM_CHUNK_SIZE > pram_cache_size)
+	{
+	  if ((pram_clock == NULL) || (sweep-- == 0))
+	    {
+	      if (pram_dirty_bytes)
+		pthread_cond_signal(&pram_flush_cond);
+	      errno = ENOMEM;
+	      return -1;
+	    }
+	  struct pram_chunk* chunk = pram_clock;
+	  struct pram_file* file = chunk->file;
+	  pram_clock = chunk->clock_next;
+	  if (__atomic_exchange_n(&(chunk->referenced), false, __ATOMIC_RELAXED))
+	    continue;
+	  /* Extents of files that are in use by other threads are skipped */
+	  if ((file != cache) && pthread_rwlock_trywrlock(&(file->lock)))
+	    continue;
+	  if ((chunk->dirty_end == 0) && !(chunk->busy) && (file->flushing == 0))
+	    release_chunk(chunk);
+	  if (file != cache)
+	    pthread_rwlock_unlock(&(file->lock));
+	}
+    }
+  pram_cache_used += PRAM_CHUNK_SIZE;
+  return 0;
+}
+
+
+/**
+ * Remove an extent from its file cache and free it, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ */
+static void release_chunk(struct pram_chunk* chunk)
+{
+  if (chunk->dirty_end)
+    mark_clean(chunk);
+  *(chunk->file->chunks + chunk->index) = NULL;
+  if (chunk->clock_next == chunk)
+    pram_clock = NULL;
+  else
+    {
+      if (pram_clock == chunk)
+	pram_clock = chunk->clock_next;
+      chunk->clock_prev->clock_next = chunk->clock_next;
+      chunk->clock_next->clock_prev = chunk->clock_prev;
+    }
+  pram_cache_used -= PRAM_CHUNK_SIZE;
+  free(chunk->data);
+  free(chunk);
+}
+
+
+/**
+ * Make room for an extent in a file cache's extent index
+ * 
+ * @param   cache  The file cache
+ * @param   index  The index of the extent
+ * @return         Zero on success, -1 on error
+ */
+static int grow_chunk_index(struct pram_file* cache, size_t index)
+{
+  if (index < cache->chunkn)
+    return 0;
+  size_t n = index | (index >> 1);
+  for (size_t s = 1; s < 8 * sizeof(size_t); s <<= 1)
+    n |= n >> s;
+  n += 1;
+  struct pram_chunk** chunks = (struct pram_chunk**)realloc(cache->chunks, n * sizeof(struct pram_chunk*));
+  if (chunks == NULL)
+    return -1;
+  for (size_t i = cache->chunkn; i < n; i++)
+    *(chunks + i) = NULL;
+  cache->chunks = chunks;
+  cache->chunkn = n;
+  return 0;
+}
+
+
+/**
+ * Create an extent in a file cache without reading it from the HDD
+ * 
+ * @param   cache  The file cache, it must be write locked
+ * @param   index  The index of the extent
+ * @return         The extent, with its content zeroed, `NULL` on error
+ */
+static struct pram_chunk* new_chunk(struct pram_file* cache, size_t index)
+{
+  off_t end = cache->attr.st_size - (off_t)index * PRAM_CHUNK_SIZE;
+  if (end <= 0)
+    return NULL;
+  if (grow_chunk_index(cache, index) < 0)
+    return NULL;
+  _lock;
+  int error = reserve_chunk(cache);
+  _unlock;
+  if (error < 0)
+    return NULL;
+  struct pram_chunk* chunk = (struct pram_chunk*)malloc(sizeof(struct pram_chunk));
+  if (chunk && ((chunk->data = (char*)malloc(PRAM_CHUNK_SIZE * sizeof(char))) == NULL))
+    {
+      free(chunk);
+      chunk = NULL;
+    }
+  if (chunk == NULL)
+    {
+      _lock;
+      pram_cache_used -= PRAM_CHUNK_SIZE;
+      _unlock;
+      return NULL;
+    }
+  chunk->length = end < PRAM_CHUNK_SIZE ? (size_t)end : PRAM_CHUNK_SIZE;
+  chunk->dirty_start = chunk->dirty_end = 0;
+  chunk->referenced = false;
+  chunk->busy = false;
+  chunk->file = cache;
+  chunk->index = index;
+  memset(chunk->data, 0, chunk->length);
+  /* New extents are placed just behind the clock hand, so they are inspected last */
+  _lock;
+  if (pram_clock == NULL)
+    pram_clock = chunk->clock_prev = chunk->clock_next = chunk;
+  else
+    {
+      chunk->clock_next = pram_clock;
+      chunk->clock_prev = pram_clock->clock_prev;
+      chunk->clock_prev->clock_next = chunk;
+      pram_clock->clock_prev = chunk;
+    }
+  *(cache->chunks + index) = chunk;
+  _unlock;
+  return chunk;
+}
+
+
+/**
+ * Gets a cached extent of a file, reading it from the HDD if it is not cached
+ * 
+ * @param   cache  The file cache, it must be write locked unless the extent is cached
+ * @param   index  The index of the extent
+ * @param   fd     The file descriptor to read the extent from
+ * @return         The extent, `NULL` on error
+ */
+static struct pram_chunk* get_chunk(struct pram_file* cache, size_t index, int fd)
+{
+  struct pram_chunk* chunk;
+  if ((index < cache->chunkn) && (chunk = *(cache->chunks + index)))
+    {
+      __atomic_store_n(&(chunk->referenced), true, __ATOMIC_RELAXED);
+      return chunk;
+    }
+  chunk = new_chunk(cache, index);
+  if (chunk == NULL)
+    return NULL;
+  /* Extents saved in the snapshot are not read from the HDD again */
+  const struct pram_snapshot_chunk* saved;
+  if (cache->snapshot && (saved = snapshot_chunk(cache->snapshot, index)))
+    {
+      size_t length = (size_t)(saved->length) < chunk->length ? (size_t)(saved->length) : chunk->length;
+      memcpy(chunk->data, (const char*)(cache->snapshot) + saved->offset, length);
+      return chunk;
+    }
+  /* Bytes the HDD does not have yet, because they have not been flushed, are left zeroed */
+  off_t off = (off_t)index * PRAM_CHUNK_SIZE;
+  size_t ptr = 0;
+  while (ptr < chunk->length)
+    {
+      ssize_t got = pread(fd, chunk->data + ptr, chunk->length - ptr, off + ptr);
+      if (got < 0)
+	{
+	  int error = errno;
+	  _lock;
+	  release_chunk(chunk);
+	  _unlock;
+	  errno = error;
+	  return NULL;
+	}
+      if (got == 0)
+	break;
+      ptr += (size_t)got;
+    }
+  return chunk;
+}
+
+
+/**
+ * Read the extents in a range of a file that are not cached from the HDD,
+ * with the reads made together rather than one at a time, extents that
+ * cannot be read are left for `get_chunk` to report
+ * 
+ * @param  cache  The file cache, it must be write locked
+ * @param  off    The offset of the range
+ * @param  len    The length of the range, it must be within the file
+ * @param  fd     The file descriptor to read the extents from
+ */
+static void fill_chunks(struct pram_file* cache, off_t off, size_t len, int fd)
+{
+  pram_io* io = get_io();
+  struct pram_chunk* chunks[PRAM_IO_DEPTH];
+  size_t i, j, m, end;
+  int full = false;
+  if (len == 0)
+    return;
+  i = (size_t)(off / PRAM_CHUNK_SIZE);
+  end = (size_t)((off + (off_t)len - 1) / PRAM_CHUNK_SIZE);
+  while (!full && (i <= end))
+    {
+      pram_io_clear(io);
+      for (m = 0; (m < PRAM_IO_DEPTH) && (i <= end); i++)
+	{
+	  if ((i < cache->chunkn) && *(cache->chunks + i))
+	    continue;
+	  /* Extents in the snapshot are copied by `get_chunk` rather than read */
+	  if (cache->snapshot && snapshot_chunk(cache->snapshot, i))
+	    continue;
+	  struct pram_chunk* chunk = new_chunk(cache, i);
+	  if ((full = chunk == NULL))
+	    break;
+	  /* Extents created later in the batch could otherwise evict it before it is read */
+	  chunk->busy = true;
+	  *(chunks + m++) = chunk;
+	  pram_io_queue(io, fd, false, chunk->data, chunk->length, (off_t)i * PRAM_CHUNK_SIZE);
+	}
+      if (m == 0)
+	continue;
+      /* Bytes the HDD does not have yet, because they have not been flushed, are left zeroed */
+      pram_io_run(io);
+      _lock;
+      for (j = 0; j < m; j++)
+	{
+	  (*(chunks + j))->busy = false;
+	  if ((io->ops + j)->error)
+	    release_chunk(*(chunks + j));
+	}
+      _unlock;
+    }
+  pram_io_clear(io);
+}
+
+
+/**
+ * Remove a file from the list of files with modified extents, the mutex must be held
+ * 
+ * @param  cache  The file cache
+ */
+static void unlist_dirty(struct pram_file* cache)
+{
+  if (cache->dirty_prev)
+    cache->dirty_prev->dirty_next = cache->dirty_next;
+  else
+    pram_dirty = cache->dirty_next;
+  if (cache->dirty_next)
+    cache->dirty_next->dirty_prev = cache->dirty_prev;
+  else
+    pram_dirty_last = cache->dirty_prev;
+  cache->dirty_prev = cache->dirty_next = NULL;
+  cache->dirtied = 0;
+  cache->released = false;
+  pram_dirty_files--;
+}
+
+
+/**
+ * Move a file that has been closed with modified extents to the beginning of the
+ * list of files with modified extents, and wake the background thread, so that
+ * the file is written back promptly rather than when it is old enough, the
+ * mutex must be held
+ * 
+ * @param  cache  The file cache
+ */
+static void release_dirty(struct pram_file* cache)
+{
+  time_t dirtied = cache->dirtied;
+  if (cache->released)
+    return;
+  unlist_dirty(cache);
+  cache->dirtied = dirtied;
+  cache->released = true;
+  /* Only released files are before files that are not old enough */
+  if ((cache->dirty_next = pram_dirty))
+    pram_dirty->dirty_prev = cache;
+  else
+    pram_dirty_last = cache;
+  pram_dirty = cache;
+  pram_dirty_files++;
+  pthread_cond_signal(&pram_flush_cond);
+}
+
+
+/**
+ * Mark a range of an extent as modified, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ * @param  start  The offset of the first modified byte in the extent
+ * @param  end    The offset after the last modified byte in the extent
+ */
+static void mark_dirty(struct pram_chunk* chunk, size_t start, size_t end)
+{
+  struct pram_file* cache = chunk->file;
+  size_t before = chunk->dirty_end - chunk->dirty_start;
+  if (chunk->dirty_end == 0)
+    {
+      chunk->dirty_start = start;
+      chunk->dirty_end = end;
+    }
+  else
+    {
+      if (chunk->dirty_start > start)
+	chunk->dirty_start = start;
+      if (chunk->dirty_end < end)
+	chunk->dirty_end = end;
+    }
+  pram_dirty_bytes += (chunk->dirty_end - chunk->dirty_start) - before;
+  if (cache->dirtied == 0)
+    {
+      cache->dirtied = time(NULL);
+      if ((cache->dirty_prev = pram_dirty_last))
+	pram_dirty_last->dirty_next = cache;
+      else
+	pram_dirty = cache;
+      pram_dirty_last = cache;
+      pram_dirty_files++;
+    }
+  if (dirty_pressure())
+    pthread_cond_signal(&pram_flush_cond);
+}
+
+
+/**
+ * Mark an extent as unmodified, without writing it to the HDD, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ */
+static void mark_clean(struct pram_chunk* chunk)
+{
+  pram_dirty_bytes -= chunk->dirty_end - chunk->dirty_start;
+  chunk->dirty_start = chunk->dirty_end = 0;
+  if (pram_throttled)
+    pthread_cond_broadcast(&pram_throttle_cond);
+}
+
+
+/**
+ * Write all modified ranges of a file to the HDD, the file must be referenced
+ * but not locked, it is unlocked during the writes so that it can be used,
+ * the stripes are written concurrently with the help of the flushing threads
+ * 
+ * @param   cache  The file cache
+ * @param   paced  Whether to write no faster than `pram_drain_rate`
+ * @return         Error code
+ */
+static int write_back_file(struct pram_file* cache, int paced)
+{
+  struct pram_flush flush;
+  struct timespec began, ended;
+  int error = 0, sync;
+  size_t i, bytes = 0;
+  /* Wait for any ongoing write-back, so that the file is on the HDD when this returns */
+  pthread_mutex_lock(&(cache->flush_lock));
+  _wrlock(cache);
+  _lock;
+  time_t dirtied = cache->dirtied;
+  _unlock;
+  if ((dirtied == 0) || (plan_flush(cache, &flush) < 0))
+    {
+      _rwunlock(cache);
+      pthread_mutex_unlock(&(cache->flush_lock));
+      if (dirtied)
+	throw ENOMEM;
+      return 0;
+    }
+  _lock;
+  /* Files that have been closed are made durable, since no one may call `fsync` */
+  sync = cache->released;
+  /* Writes made while the file is unlocked put the file back in the list */
+  unlist_dirty(cache);
+  for (i = 0; i < flush.piecen; i++)
+    {
+      mark_clean((flush.pieces + i)->chunk);
+      bytes += (flush.pieces + i)->end - (flush.pieces + i)->start;
+    }
+  /* Content being written still counts against the dirty limit until it is written */
+  pram_flushing_bytes += bytes;
+  _unlock;
+  /* The extents are not freed while the file is flushing, so they are written without
+     being copied, and changes made meanwhile are written by a later write-back */
+  cache->flushing++;
+  flush.fd = cache->fd;
+  flush.paced = (char)(paced && pram_drain_rate);
+  _rwunlock(cache);
+  clock_gettime(CLOCK_MONOTONIC, &began);
+  pthread_mutex_lock(&pram_flusher_mutex);
+  /* The flushing threads are only woken if there is more than one stripe */
+  if (pram_flushers_running && flush.piecen &&
+      (piece_stripe(flush.pieces) != piece_stripe(flush.pieces + flush.piecen - 1)))
+    {
+      flush.next = pram_flush_queue;
+      pram_flush_queue = &flush;
+      flush.queued = true;
+      pthread_cond_broadcast(&pram_flusher_cond);
+    }
+  write_stripes(&flush);
+  while (flush.writers)
+    pthread_cond_wait(&pram_flushed_cond, &pram_flusher_mutex);
+  pthread_mutex_unlock(&pram_flusher_mutex);
+  if (sync && fdatasync(flush.fd))
+    error = errno;
+  clock_gettime(CLOCK_MONOTONIC, &ended);
+  _wrlock(cache);
+  for (i = 0; i < flush.piecen; i++)
+    {
+      struct pram_flush_piece* piece = flush.pieces + i;
+      size_t end = piece->end < piece->chunk->length ? piece->end : piece->chunk->length;
+      if (piece->error == 0)
+	continue;
+      if (error == 0)
+	error = piece->error;
+      _lock;
+      if (piece->start < end)
+	mark_dirty(piece->chunk, piece->start, end);
+      /* Made durable when it is retried, but only once old enough */
+      if (sync && cache->dirtied)
+	cache->released = true;
+      _unlock;
+    }
+  /* The error is kept until it is reported, as the write-back may not have been made for `pram_fsync` */
+  if (error)
+    cache->error = error;
+  _lock;
+  pram_flushing_bytes -= bytes;
+  if (paced)
+    {
+      /* Writers are slowed down according to how fast the background thread writes */
+      unsigned long long ns = (unsigned long long)(ended.tv_sec - began.tv_sec) * 1000000000ULL;
+      ns = ns + (unsigned long long)(ended.tv_nsec) - (unsigned long long)(began.tv_nsec);
+      if ((error == 0) && ns)
+	{
+	  size_t rate = (size_t)((unsigned long long)bytes * 1000000000ULL / ns);
+	  pram_drain_bandwidth = pram_drain_bandwidth ? (3 * pram_drain_bandwidth + rate) / 4 : rate;
+	}
+      pram_drain_failed = error != 0;
+    }
+  if (pram_throttled)
+    pthread_cond_broadcast(&pram_throttle_cond);
+  _unlock;
+  cache->flushing--;
+  close_write_back_fd(cache);
+  _rwunlock(cache);
+  pthread_mutex_unlock(&(cache->flush_lock));
+  free(flush.pieces);
+  throw error;
+}
+
+
+/**
+ * List the modified ranges of a file, split at the stripe boundaries,
+ * the file must be write locked
+ * 
+ * @param   cache  The file cache
+ * @param   flush  The write-back to list the ranges in
+ * @return         Zero on success, -1 on error
+ */
+static int plan_flush(struct pram_file* cache, struct pram_flush* flush)
+{
+  size_t i, size = 0;
+  off_t stripe = (off_t)pram_stripe_size;
+  memset(flush, 0, sizeof(struct pram_flush));
+  for (i = 0; i < cache->chunkn; i++)
+    {
+      struct pram_chunk* chunk = *(cache->chunks + i);
+      if ((chunk == NULL) || (chunk->dirty_end == 0))
+	continue;
+      off_t base = (off_t)i * PRAM_CHUNK_SIZE;
+      size_t start, end;
+      for (start = chunk->dirty_start; start < chunk->dirty_end; start = end)
+	{
+	  off_t boundary = ((base + (off_t)start) / stripe + 1) * stripe;
+	  end = boundary - base < (off_t)(chunk->dirty_end) ? (size_t)(boundary - base) : chunk->dirty_end;
+	  if (flush->piecen == size)
+	    {
+	      struct pram_flush_piece* pieces = flush->pieces;
+	      size = size ? size << 1 : 64;
+	      if ((pieces = (struct pram_flush_piece*)realloc(pieces, size * sizeof(struct pram_flush_piece))) == NULL)
+		{
+		  free(flush->pieces);
+		  flush->pieces = NULL;
+		  return -1;
+		}
+	      flush->pieces = pieces;
+	    }
+	  *(flush->pieces + flush->piecen++) = (struct pram_flush_piece){ .chunk = chunk, .index = i,
+									  .start = start, .end = end, .error = 0 };
+	}
+    }
+  return 0;
+}
+
+
+/**
+ * Gets the stripe a modified range that is being written to the HDD is in
+ * 
+ * @param   piece  The range
+ * @return         The index of the stripe
+ */
+static inline off_t piece_stripe(const struct pram_flush_piece* piece)
+{
+  return ((off_t)(piece->index) * PRAM_CHUNK_SIZE + (off_t)(piece->start)) / (off_t)pram_stripe_size;
+}
+
+
+/**
+ * Take stripes of a write-back and write them until all stripes are taken,
+ * `pram_flusher_mutex` must be held, and is released during the writes
+ * 
+ * @param  flush  The write-back
+ */
+static void write_stripes(struct pram_flush* flush)
+{
+  pram_io* io = get_io();
+  struct timespec at;
+  while (flush->claimed < flush->piecen)
+    {
+      size_t i = flush->claimed, end = i + 1, j, bytes = 0;
+      struct pram_flush_piece* piece;
+      /* A stripe is written by one thread, so that threads do not contend for the same stripe */
+      off_t stripe = piece_stripe(flush->pieces + i);
+      while ((end < flush->piecen) && (piece_stripe(flush->pieces + end) == stripe))
+	end++;
+      flush->claimed = end;
+      if ((end == flush->piecen) && flush->queued)
+	{
+	  struct pram_flush** at = &pram_flush_queue;
+	  while (*at != flush)
+	    at = &((*at)->next);
+	  *at = flush->next;
+	  flush->queued = false;
+	}
+      if (flush->paced)
+	{
+	  for (j = i; j < end; j++)
+	    bytes += (flush->pieces + j)->end - (flush->pieces + j)->start;
+	  at = reserve_drain(bytes);
+	}
+      flush->writers++;
+      pthread_mutex_unlock(&pram_flusher_mutex);
+      if (flush->paced)
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+	  ;
+      while (i < end)
+	{
+	  pram_io_clear(io);
+	  for (j = i; (i < end) && (io->opn < PRAM_IO_DEPTH); i++)
+	    {
+	      piece = flush->pieces + i;
+	      pram_io_queue(io, flush->fd, true, piece->chunk->data + piece->start, piece->end - piece->start,
+			    (off_t)(piece->index) * PRAM_CHUNK_SIZE + (off_t)(piece->start));
+	    }
+	  pram_io_run(io);
+	  for (; j < i; j++)
+	    (flush->pieces + j)->error = (io->ops + j - (i - io->opn))->error;
+	}
+      pram_io_clear(io);
+      pthread_mutex_lock(&pram_flusher_mutex);
+      if ((--(flush->writers) == 0) && (flush->claimed == flush->piecen))
+	pthread_cond_broadcast(&pram_flushed_cond);
+    }
+}
+
+
+/**
+ * Reserve time for writing a stripe to the HDD at `pram_drain_rate`,
+ * `pram_flusher_mutex` must be held
+ * 
+ * @param   bytes  The number of bytes in the stripe
+ * @return         When the stripe may be written, on `CLOCK_MONOTONIC`
+ */
+static struct timespec reserve_drain(size_t bytes)
+{
+  struct timespec now, at;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* Time when nothing was written is not saved up for a later burst */
+  if ((pram_drain_clock.tv_sec < now.tv_sec) ||
+      ((pram_drain_clock.tv_sec == now.tv_sec) && (pram_drain_clock.tv_nsec < now.tv_nsec)))
+    pram_drain_clock = now;
+  at = pram_drain_clock;
+  unsigned long long ns = (unsigned long long)bytes * 1000000000ULL / pram_drain_rate;
+  ns += (unsigned long long)(pram_drain_clock.tv_nsec);
+  pram_drain_clock.tv_sec += (time_t)(ns / 1000000000ULL);
+  pram_drain_clock.tv_nsec = (long)(ns % 1000000000ULL);
+  return at;
+}
+
+
+/**
+ * Flushing thread, it helps write files to the HDD until the file system is unmounted
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* flush_stripes(void* data)
+{
+  (void) data;
+  pthread_mutex_lock(&pram_flusher_mutex);
+  for (;;)
+    {
+      while (pram_flushers_running && (pram_flush_queue == NULL))
+	pthread_cond_wait(&pram_flusher_cond, &pram_flusher_mutex);
+      if (pram_flush_queue == NULL)
+	break;
+      write_stripes(pram_flush_queue);
+    }
+  pthread_mutex_unlock(&pram_flusher_mutex);
+  return NULL;
+}
+
+
+/**
+ * Release a reference to a file cache, freeing
+ * it if it was the last and it has been unlinked
+ * 
+ * @param  cache  The file cache
+ */
+static void put_file_cache(struct pram_file* cache)
+{
+  if (__atomic_sub_fetch(&(cache->handles), 1, __ATOMIC_ACQ_REL))
+    return;
+  if (__atomic_load_n(&(cache->unlinked), __ATOMIC_ACQUIRE))
+    free_file_cache(cache);
+}
+
+
+/**
+ * Add an entry last in a directory's cached listing
+ * 
+ * @param   cache  The directory's file cache
+ * @param   name   The name of the entry
+ * @param   ino    The inode number of the entry
+ * @param   mode   The file type of the entry
+ * @return         Zero on success, -1 on error
+ */
+static int append_dirent(struct pram_file* cache, const char* name, ino_t ino, mode_t mode)
+{
+  if (cache->entryn == cache->entry_size)
+    {
+      size_t size = cache->entry_size ? (cache->entry_size << 1) : 16;
+      struct pram_dirent* entries = (struct pram_dirent*)realloc(cache->entries, size * sizeof(struct pram_dirent));
+      if (entries == NULL)
+	return -1;
+      cache->entries = entries;
+      cache->entry_size = size;
+    }
+  struct pram_dirent* entry = cache->entries + cache->entryn;
+  if ((entry->name = strdup(name)) == NULL)
+    return -1;
+  entry->ino = ino;
+  entry->mode = mode;
+  cache->entryn++;
+  return 0;
+}
+
+
+/**
+ * Read a directory's listing from the HDD into its file cache
+ * 
+ * @param   cache  The directory's file cache
+ * @param   path   The directory
+ * @return         Error code
+ */
+static int load_dir_cache(struct pram_file* cache, const char* path)
+{
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+  put_dir_fd(dir);
+  DIR* dp = fd < 0 ? NULL : fdopendir(fd);
+  struct dirent* entry;
+  if (dp == NULL)
+    {
+      int error = errno;
+      if (fd >= 0)
+	close(fd);
+      throw error;
+    }
+  errno = 0;
+  while ((entry = readdir(dp)))
+    if (append_dirent(cache, entry->d_name, entry->d_ino, (mode_t)(entry->d_type) << 12) < 0)
+      break;
+  int error = errno;
+  closedir(dp);
+  if (error)
+    {
+      for (size_t i = 0; i < cache->entryn; i++)
+	free((cache->entries + i)->name);
+      cache->entryn = cache->removed = 0;
+      throw error;
+    }
+  cache->listed = true;
+  return 0;
+}
+
+
+/**
+ * Remove holes left by removed entries from a directory's cached listing,
+ * if it is not open and a large part of it are holes, the directory must
+ * be write locked
+ * 
+ * @param  cache  The directory's file cache
+ */
+static void compact_dir_cache(struct pram_file* cache)
+{
+  if (cache->opened || (cache->removed * 2 <= cache->entryn))
+    return;
+  size_t i, j;
+  for (i = j = 0; i < cache->entryn; i++)
+    if ((cache->entries + i)->name)
+      *(cache->entries + j++) = *(cache->entries + i);
+  cache->entryn = j;
+  cache->removed = 0;
+}
+
+
+/**
+ * Gets the file cache for the parent directory of a file, if it is cached,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   path  The file
+ * @param   name  Output parameter for the file's name in the directory, ignored if `NULL`
+ * @return        The parent directory's file cache, `NULL` if it is not cached
+ */
+static struct pram_file* get_parent_cache(const char* path, const char** name)
+{
+  size_t i, n = 0;
+  for (i = 0; *(path + i); i++)
+    if (*(path + i) == '/')
+      n = i;
+  if (name)
+    *name = path + n + 1;
+  /* The parent of a file in the root is "/", not "" */
+  i = n ? n : 1;
+  char* parent = (char*)malloc((i + 1) * sizeof(char));
+  if (parent == NULL)
+    return NULL;
+  memcpy(parent, path, i * sizeof(char));
+  *(parent + i) = 0;
+  struct pram_file* cache = find_file_cache(parent);
+  free(parent);
+  return cache;
+}
+
+
+/**
+ * Add or update an entry in the cached listing of a file's parent directory
+ * 
+ * @param  path  The file
+ * @param  attr  The file's attributes
+ */
+static void dir_cache_add(const char* path, const struct stat* attr)
+{
+  const char* name;
+  struct pram_file* parent = get_parent_cache(path, &name);
+  if (parent == NULL)
+    return;
+  _wrlock(parent);
+  size_t i;
+  for (i = 0; parent->listed && (i < parent->entryn); i++)
+    if ((parent->entries + i)->name && eq((parent->entries + i)->name, name))
+      {
+	(parent->entries + i)->ino = attr->st_ino;
+	(parent->entries + i)->mode = attr->st_mode & S_IFMT;
+	break;
+      }
+  if (parent->listed && (i == parent->entryn) &&
+      (append_dirent(parent, name, attr->st_ino, attr->st_mode & S_IFMT) < 0))
+    /* The listing would be incomplete, so read it again when it is next opened */
+    parent->listed = false;
+  _rwunlock(parent);
+  put_file_cache(parent);
+}
+
+
+/**
+ * Remove an entry from the cached listing of a file's parent directory
+ * 
+ * @param  path  The file
+ */
+static void dir_cache_remove(const char* path)
+{
+  const char* name;
+  struct pram_file* parent = get_parent_cache(path, &name);
+  if (parent == NULL)
+    return;
+  _wrlock(parent);
+  for (size_t i = 0; parent->listed && (i < parent->entryn); i++)
+    if ((parent->entries + i)->name && eq((parent->entries + i)->name, name))
+      {
+	free((parent->entries + i)->name);
+	(parent->entries + i)->name = NULL;
+	parent->removed++;
+	compact_dir_cache(parent);
+	break;
+      }
+  _rwunlock(parent);
+  put_file_cache(parent);
+}
+
+
+/**
+ * Cache the attributes of a file that has just been created, and add it to
+ * the cached listing of its parent directory, the name must be locked
+ * 
+ * @param  path  The file
+ */
+static void cache_new_entry(const char* path)
+{
+  struct pram_file* cache;
+  struct stat attr;
+  remove_negative(path);
+  if (load_file_cache(path, &cache))
+    return;
+  _rdlock(cache);
+  attr = cache->attr;
+  _rwunlock(cache);
+  put_file_cache(cache);
+  dir_cache_add(path, &attr);
+}
+
+
+/**
+ * Check whether a file is remembered not to exist
+ * 
+ * @param   path  The file
+ * @return        Whether the file is remembered not to exist
+ */
+static int is_negative(const char* path)
+{
+  pthread_mutex_lock(&pram_negative_mutex);
+  struct pram_negative* negative = (struct pram_negative*)pram_map_get(pram_negative_cache, path);
+  if (negative && (negative->expires <= time(NULL)))
+    {
+      pram_map_put(pram_negative_cache, path, NULL);
+      free(negative->path);
+      negative->path = NULL;
+      negative = NULL;
+    }
+  pthread_mutex_unlock(&pram_negative_mutex);
+  return negative != NULL;
+}
+
+
+/**
+ * Remember that a file does not exist, forgetting the
+ * oldest remembered file if too many are remembered
+ * 
+ * @param  path  The file
+ */
+static void add_negative(const char* path)
+{
+  if (pram_negatives == NULL)
+    return;
+  char* key = strdup(path);
+  if (key == NULL)
+    return;
+  pthread_mutex_lock(&pram_negative_mutex);
+  struct pram_negative* negative = pram_negatives + pram_negative_next;
+  if (negative->path)
+    {
+      pram_map_put(pram_negative_cache, negative->path, NULL);
+      free(negative->path);
+    }
+  negative->path = key;
+  negative->expires = time(NULL) + pram_negative_ttl;
+  pram_map_put(pram_negative_cache, key, negative);
+  pram_negative_next = (pram_negative_next + 1) % pram_negative_max;
+  pthread_mutex_unlock(&pram_negative_mutex);
+}
+
+
+/**
+ * Forget that a file does not exist, this must be done
+ * before a file is created through the file system
+ * 
+ * @param  path  The file
+ */
+static void remove_negative(const char* path)
+{
+  pthread_mutex_lock(&pram_negative_mutex);
+  struct pram_negative* negative = (struct pram_negative*)pram_map_get(pram_negative_cache, path);
+  if (negative)
+    {
+      pram_map_put(pram_negative_cache, path, NULL);
+      free(negative->path);
+      negative->path = NULL;
+    }
+  pthread_mutex_unlock(&pram_negative_mutex);
+}
+
+
+/**
+ * Callback for `pram_map_scan` that frees the names of
+ * nonexistent files that have been detached from `pram_negative_cache`
+ * 
+ * @param  key    The file, without the directory
+ * @param  value  The file's element in `pram_negatives`
+ * @param  data   Not used
+ */
+static void free_detached_negative(const char* key, void* value, void* data)
+{
+  struct pram_negative* negative = (struct pram_negative*)value;
+  (void) key;
+  (void) data;
+  free(negative->path);
+  negative->path = NULL;
+}
+
+
+/**
+ * Forget that any file in a directory does not exist, this must
+ * be done when a directory is renamed through the file system
+ * 
+ * @param  path  The directory
+ */
+static void remove_negatives(const char* path)
+{
+  pram_map negatives;
+  char* prefix = dir_prefix(path);
+  if (prefix == NULL)
+    return;
+  pthread_mutex_lock(&pram_negative_mutex);
+  pram_map_detach(pram_negative_cache, prefix, &negatives);
+  pram_map_scan(&negatives, "", free_detached_negative, NULL);
+  pthread_mutex_unlock(&pram_negative_mutex);
+  pram_map_drop(&negatives);
+  free(prefix);
+}
+
+
+/**
+ * Gets a file descriptor for the parent directory of a file on the HDD, and the file's
+ * name relative to it, for use with the `*at` functions, the file descriptor must be
+ * released with `put_dir_fd`, `hddfd` is returned if the parent directory is not cached
+ * and cannot be opened
+ * 
+ * @param   path  The file
+ * @param   name  Output parameter for the file's name relative to the file descriptor
+ * @param   dir   Output parameter for the cached file descriptor, to release with `put_dir_fd`
+ * @return        The file descriptor
+ */
+static int get_dir_fd(const char* path, const char** name, struct pram_dir_fd** dir)
+{
+  const char* slash = strrchr(path, '/');
+  struct pram_dir_fd* d;
+  struct pram_dir_fd* evicted = NULL;
+  size_t generation;
+  *dir = NULL;
+  *name = h(path);
+  /* Files in the root are named relative to `hddfd` */
+  if ((slash == NULL) || (slash == path) || (pram_dir_fd_max == 0))
+    return hddfd;
+  size_t n = (size_t)(slash - path);
+  char* key = (char*)malloc((n + 1) * sizeof(char));
+  if (key == NULL)
+    return hddfd;
+  memcpy(key, path, n * sizeof(char));
+  *(key + n) = 0;
+  pthread_mutex_lock(&pram_dir_fd_mutex);
+  if ((d = (struct pram_dir_fd*)pram_map_get(pram_dir_fd_cache, key)))
+    d->refs++;
+  generation = pram_dir_fd_generation;
+  pthread_mutex_unlock(&pram_dir_fd_mutex);
+  if (d == NULL)
+    {
+      /* The directory is opened without the lock, other lookups need not wait for the HDD */
+      int fd = openat(hddfd, h(key), O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0)
+	{
+	  free(key);
+	  return hddfd;
+	}
+      if ((d = (struct pram_dir_fd*)malloc(sizeof(struct pram_dir_fd))) == NULL)
+	{
+	  close(fd);
+	  free(key);
+	  return hddfd;
+	}
+      d->path = key;
+      d->fd = fd;
+      d->refs = 1;
+      d->forgotten = false;
+      d->newer = d->older = NULL;
+      pthread_mutex_lock(&pram_dir_fd_mutex);
+      struct pram_dir_fd* cached = (struct pram_dir_fd*)pram_map_get(pram_dir_fd_cache, key);
+      if (cached)
+	{
+	  /* Another thread opened the directory at the same time */
+	  cached->refs++;
+	  d->older = evicted;
+	  evicted = d;
+	  d = cached;
+	  key = NULL;
+	}
+      else if (generation != pram_dir_fd_generation)
+	{
+	  /* The directory or one of its ancestors may have been renamed or removed
+	     while it was opened, so it is used for this call only, and then closed */
+	  d->forgotten = true;
+	  key = NULL;
+	}
+      else
+	{
+	  pram_map_put(pram_dir_fd_cache, key, d);
+	  pram_dir_fd_count++;
+	  key = NULL;
+	}
+    }
+  else
+    pthread_mutex_lock(&pram_dir_fd_mutex);
+  /* Move the directory to the front of the list, unless it was forgotten meanwhile */
+  if (!(d->forgotten))
+    {
+      if (d->newer || d->older || (pram_dir_fd_newest == d))
+	unlist_dir_fd(d);
+      d->older = pram_dir_fd_newest;
+      if (pram_dir_fd_newest)
+	pram_dir_fd_newest->newer = d;
+      else
+	pram_dir_fd_oldest = d;
+      pram_dir_fd_newest = d;
+    }
+  /* File descriptors that are in use are not evicted */
+  for (struct pram_dir_fd* e = pram_dir_fd_oldest; e && (pram_dir_fd_count > pram_dir_fd_max);)
+    {
+      struct pram_dir_fd* newer = e->newer;
+      if (e->refs == 0)
+	{
+	  pram_map_put(pram_dir_fd_cache, e->path, NULL);
+	  unlist_dir_fd(e);
+	  pram_dir_fd_count--;
+	  e->older = evicted;
+	  evicted = e;
+	}
+      e = newer;
+    }
+  pthread_mutex_unlock(&pram_dir_fd_mutex);
+  free(key);
+  while (evicted)
+    {
+      struct pram_dir_fd* e = evicted;
+      evicted = e->older;
+      close(e->fd);
+      free(e->path);
+      free(e);
+    }
+  *name = slash + 1;
+  *dir = d;
+  return d->fd;
+}
+
+
+/**
+ * Release a directory file descriptor gotten with `get_dir_fd`, `errno` is preserved
+ * 
+ * @param  dir  The cached file descriptor, may be `NULL`
+ */
+static void put_dir_fd(struct pram_dir_fd* dir)
+{
+  if (dir == NULL)
+    return;
+  int saved_errno = errno;
+  pthread_mutex_lock(&pram_dir_fd_mutex);
+  int unused = (--(dir->refs) == 0) && dir->forgotten;
+  pthread_mutex_unlock(&pram_dir_fd_mutex);
+  if (unused)
+    {
+      close(dir->fd);
+      free(dir->path);
+      free(dir);
+    }
+  errno = saved_errno;
+}
+
+
+/**
+ * Remove a cached directory file descriptor from the list
+ * of cached file descriptors, `pram_dir_fd_mutex` must be held
+ * 
+ * @param  dir  The cached file descriptor
+ */
+static void unlist_dir_fd(struct pram_dir_fd* dir)
+{
+  if (dir->newer)
+    dir->newer->older = dir->older;
+  else
+    pram_dir_fd_newest = dir->older;
+  if (dir->older)
+    dir->older->newer = dir->newer;
+  else
+    pram_dir_fd_oldest = dir->newer;
+  dir->newer = dir->older = NULL;
+}
+
+
+/**
+ * Callback for `pram_map_scan` that closes directory file descriptors that have
+ * been detached from `pram_dir_fd_cache`, or leaves them to their last users
+ * 
+ * @param  key    The directory, without the parent directory
+ * @param  value  The cached file descriptor
+ * @param  data   Not used
+ */
+static void forget_detached_dir_fd(const char* key, void* value, void* data)
+{
+  struct pram_dir_fd* dir = (struct pram_dir_fd*)value;
+  (void) key;
+  (void) data;
+  unlist_dir_fd(dir);
+  pram_dir_fd_count--;
+  if (dir->refs)
+    dir->forgotten = true;
+  else
+    {
+      close(dir->fd);
+      free(dir->path);
+      free(dir);
+    }
+}
+
+
+/**
+ * Forget the cached file descriptors for a directory and all directories in it,
+ * this must be done when a directory is renamed or removed through the file system
+ * 
+ * @param  path  The directory
+ */
+static void forget_dir_fds(const char* path)
+{
+  pram_map dirs;
+  char* prefix = dir_prefix(path);
+  if (prefix == NULL)
+    return;
+  pthread_mutex_lock(&pram_dir_fd_mutex);
+  pram_dir_fd_generation++;
+  struct pram_dir_fd* dir = (struct pram_dir_fd*)pram_map_get(pram_dir_fd_cache, path);
+  if (dir)
+    {
+      pram_map_put(pram_dir_fd_cache, path, NULL);
+      forget_detached_dir_fd(path, dir, NULL);
+    }
+  pram_map_detach(pram_dir_fd_cache, prefix, &dirs);
+  pram_map_scan(&dirs, "", forget_detached_dir_fd, NULL);
+  pthread_mutex_unlock(&pram_dir_fd_mutex);
+  pram_map_drop(&dirs);
+  free(prefix);
+}
+
+
+/**
+ * Gets the cached extended attribute of a file, looking it up on the HDD if it is not cached
+ * 
+ * @param   cache  The file's cache
+ * @param   path   The file
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` on error
+ */
+static struct pram_xattr* get_xattr(struct pram_file* cache, const char* path, const char* name)
+{
+  struct pram_xattr* xattr = find_xattr(cache, name);
+  char* value = NULL;
+  ssize_t n;
+  int error = 0;
+  if (xattr)
+    return xattr;
+  char* _path = p(path);
+  for (;;)
+    {
+      if ((n = lgetxattr(_path, name, NULL, 0)) < 0)
+	break;
+      free(value);
+      if ((value = (char*)malloc((n ? (size_t)n : 1) * sizeof(char))) == NULL)
+	return NULL;
+      if ((n = lgetxattr(_path, name, value, (size_t)n)) >= 0)
+	break;
+      /* Retry if the attribute grew between the calls */
+      if (errno != ERANGE)
+	break;
+    }
+  if (n < 0)
+    {
+      error = errno;
+      free(value);
+      value = NULL;
+      /* Other errors, such as `EACCES` or `EIO`, say nothing about the attribute, so they are not remembered */
+      if ((error != ENODATA) && (error != ENOTSUP))
+	{
+	  errno = error;
+	  return NULL;
+	}
+    }
+  if ((xattr = new_xattr(cache, name)) == NULL)
+    {
+      free(value);
+      return NULL;
+    }
+  /* A missing attribute is remembered as such */
+  xattr->value = value;
+  xattr->size = n < 0 ? 0 : (size_t)n;
+  xattr->error = error;
+  return xattr;
+}
+
+
+/**
+ * Find a cached extended attribute of a file
+ * 
+ * @param   cache  The file's cache
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` if it is not cached
+ */
+static struct pram_xattr* find_xattr(struct pram_file* cache, const char* name)
+{
+  for (size_t i = 0; i < cache->xattrn; i++)
+    if (eq((cache->xattrs + i)->name, name))
+      return cache->xattrs + i;
+  return NULL;
+}
+
+
+/**
+ * Add an extended attribute, that does not have any value yet, to a file's cache
+ * 
+ * @param   cache  The file's cache
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` on error
+ */
+static struct pram_xattr* new_xattr(struct pram_file* cache, const char* name)
+{
+  struct pram_xattr* xattrs = (struct pram_xattr*)realloc(cache->xattrs, (cache->xattrn + 1) * sizeof(struct pram_xattr));
+  if (xattrs == NULL)
+    return NULL;
+  struct pram_xattr* xattr = (cache->xattrs = xattrs) + cache->xattrn;
+  if ((xattr->name = strdup(name)) == NULL)
+    return NULL;
+  xattr->value = NULL;
+  xattr->size = 0;
+  xattr->error = ENODATA;
+  cache->xattrn++;
+  return xattr;
+}
+
+
+/**
+ * Update a file's cached extended attribute after it has been changed on the HDD
+ * 
+ * @param  cache  The file's cache
+ * @param  name   The attribute
+ * @param  value  The new value, `NULL` if the attribute was removed
+ * @param  size   The size of `value`
+ */
+static void update_xattr(struct pram_file* cache, const char* name, const char* value, size_t size)
+{
+  struct pram_xattr* xattr = find_xattr(cache, name);
+  char* copy = NULL;
+  free(cache->xattr_list);
+  cache->xattr_list = NULL;
+  cache->xattrs_listed = false;
+  if ((xattr == NULL) && ((xattr = new_xattr(cache, name)) == NULL))
+    return;
+  if (value && (copy = (char*)malloc((size ? size : 1) * sizeof(char))))
+    memcpy(copy, value, size);
+  free(xattr->value);
+  if (value && (copy == NULL))
+    {
+      /* Forget the attribute, it will be looked up again */
+      free(xattr->name);
+      *xattr = *(cache->xattrs + --(cache->xattrn));
+      return;
+    }
+  xattr->value = copy;
+  xattr->size = value ? size : 0;
+  xattr->error = value ? 0 : ENODATA;
+}
+
+
+/**
+ * Free a file's cached extended attributes
+ * 
+ * @param  cache  The file's cache
+ */
+static void free_xattrs(struct pram_file* cache)
+{
+  for (size_t i = 0; i < cache->xattrn; i++)
+    {
+      free((cache->xattrs + i)->name);
+      free((cache->xattrs + i)->value);
+    }
+  free(cache->xattrs);
+  free(cache->xattr_list);
+  cache->xattrs = NULL;
+  cache->xattr_list = NULL;
+  cache->xattrn = 0;
+  cache->xattrs_listed = false;
+}
+
+
+/**
+ * Get the key for a file in `pram_inode_cache`
+ * 
+ * @param  attr  The file's attributes
+ * @param  key   Output parameter for the key, must fit `PRAM_INODE_KEY_SIZE` characters
+ */
+static void inode_key(const struct stat* attr, char* key)
+{
+  snprintf(key, PRAM_INODE_KEY_SIZE, "%jx:%jx", (uintmax_t)(attr->st_dev), (uintmax_t)(attr->st_ino));
+}
+
+
+/**
+ * Remove a name of a file from the file cache map after the name has been
+ * unlinked or replaced on the HDD, and mark the file's cache as unlinked if
+ * it was the file's last name, the name must be locked and the cache must
+ * be referenced by the caller
+ * 
+ * @param  path   The name
+ * @param  cache  The file's cache
+ */
+static void forget_path(const char* path, struct pram_file* cache)
+{
+  set_file_cache(path, NULL);
+  drop_name(cache, true);
+}
+
+
+/**
+ * Release the hold a name that has been removed from the file cache map has
+ * on a file's cache, and mark the cache as unlinked if it was the file's last
+ * name, the cache must be referenced by the caller
+ * 
+ * @param  cache     The file's cache
+ * @param  unlinked  Whether the name was unlinked or replaced on the HDD, rather than just forgotten
+ */
+static void drop_name(struct pram_file* cache, int unlinked)
+{
+  char key[PRAM_INODE_KEY_SIZE];
+  _wrlock(cache);
+  if (unlinked && S_ISDIR(cache->attr.st_mode))
+    cache->attr.st_nlink = 0;
+  else if (unlinked && cache->attr.st_nlink)
+    cache->attr.st_nlink--;
+  nlink_t nlink = cache->attr.st_nlink;
+  inode_key(&(cache->attr), key);
+  _rwunlock(cache);
+  pthread_rwlock_wrlock(&pram_inode_lock);
+  /* A file with names that have not been looked up is kept in `pram_inode_cache` */
+  if ((--(cache->paths) == 0) && (nlink == 0))
+    {
+      pram_map_put(pram_inode_cache, key, NULL);
+      __atomic_store_n(&(cache->unlinked), true, __ATOMIC_RELEASE);
+    }
+  pthread_rwlock_unlock(&pram_inode_lock);
+}
+
+
+/**
+ * Callback for `pram_map_scan` that releases the holds names that have
+ * been detached from the file cache map have on the files' caches
+ * 
+ * @param  key    The name, without the directory
+ * @param  value  The file's cache
+ * @param  data   Pointer to an `int` that says whether the names were unlinked on the HDD
+ */
+static void drop_detached_name(const char* key, void* value, void* data)
+{
+  struct pram_file* cache = (struct pram_file*)value;
+  (void) key;
+  /* The name keeps the cache from being freed, but `drop_name` may free it when it is released */
+  if (pin_file_cache(cache) == 0)
+    {
+      drop_name(cache, *(int*)data);
+      put_file_cache(cache);
+    }
+}
+
+
+/**
+ * Gets the beginning that the names of the files in a directory share
+ * 
+ * @param   path  The directory
+ * @return        The directory's name with a slash at the end, `NULL` on error
+ */
+static char* dir_prefix(const char* path)
+{
+  size_t n = strlen(path);
+  char* prefix = (char*)malloc((n + 2) * sizeof(char));
+  if (prefix == NULL)
+    return NULL;
+  memcpy(prefix, path, n * sizeof(char));
+  /* The root is the only directory whose name ends with a slash */
+  if ((n == 0) || (*(prefix + n - 1) != '/'))
+    *(prefix + n++) = '/';
+  *(prefix + n) = 0;
+  return prefix;
+}
+
+
+/**
+ * Remove the names of all files in a directory from the file cache
+ * map, the directory's name must be locked
+ * 
+ * @param  path      The directory
+ * @param  unlinked  Whether the names were unlinked on the HDD, rather than just forgotten
+ */
+static void forget_names(const char* path, int unlinked)
+{
+  pram_map names;
+  char* prefix = dir_prefix(path);
+  if (prefix == NULL)
+    return;
+  /* The whole subtree is unlinked at once, the names are released outside the lock */
+  pthread_mutex_lock(&pram_file_cache_mutex);
+  pram_map_detach(pram_file_cache, prefix, &names);
+  pthread_mutex_unlock(&pram_file_cache_mutex);
+  free(prefix);
+  pram_map_scan(&names, "", drop_detached_name, &unlinked);
+  pram_map_drop(&names);
+}
+
+
+/**
+ * Move the names of all files in a directory that has been renamed on
+ * the HDD in the file cache map, both of the directory's names must be locked
+ * 
+ * @param  source  The directory's old name
+ * @param  path    The directory's new name
+ */
+static void move_names(const char* source, const char* path)
+{
+  char* from = dir_prefix(source);
+  char* to = dir_prefix(path);
+  int error = -1;
+  /* A replaced directory is empty, but names in it may be cached from before it was emptied */
+  forget_names(path, true);
+  remove_negatives(path);
+  if (from && to)
+    {
+      pthread_mutex_lock(&pram_file_cache_mutex);
+      error = pram_map_move(pram_file_cache, from, to);
+      pthread_mutex_unlock(&pram_file_cache_mutex);
+    }
+  /* The names are looked up again under the new name if they could not be moved */
+  if (error)
+    forget_names(source, false);
+  free(from);
+  free(to);
+}
+
+
+/**
+ * Gets the lock for a file name in `pram_names`
+ * 
+ * @param   path  The file
+ * @return        The lock
+ */
+static pthread_mutex_t* get_names_lock(const char* path)
+{
+  size_t hash = 5381;
+  while (*path)
+    hash = hash * 33 + (unsigned char)*path++;
+  return pram_names + hash % PRAM_SHARDS;
+}
+
+
+/**
+ * Gets the file cache for a file by its name, without looking it up on the HDD,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   path  The file
+ * @return        The file's cache, `NULL` if it is not cached
+ */
+static struct pram_file* find_file_cache(const char* path)
+{
+  const char* name = strrchr(path, '/');
+  char* key = pram_finger.key;
+  pram_map_read_lock();
+  /* Files in the same directory are often looked up one after another */
+  size_t shared = name ? (size_t)(name - path) + 1 : 0;
+  struct pram_file* cache = (struct pram_file*)pram_map_get_near(pram_file_cache, path, shared, &pram_finger);
+  if (cache && (pin_file_cache(cache) < 0))
+    cache = NULL;
+  pram_map_read_unlock();
+  if (pram_finger.key != key)
+    pthread_setspecific(pram_finger_key, pram_finger.key);
+  return cache;
+}
+
+
+/**
+ * Gets the file cache for a file by its name, looking it up on the HDD if it is
+ * not cached, the name must be locked, and the cache must be released with
+ * `put_file_cache`
+ * 
+ * @param   path   The file
+ * @param   cache  Area to put the cache in
+ * @return         Error code
+ */
+static int load_file_cache(const char* path, struct pram_file** cache)
+{
+  struct stat attr;
+  if ((*cache = find_file_cache(path)))
+    return 0;
+  if (is_negative(path))
+    throw ENOENT;
+  struct pram_dir_fd* dir;
+  const char* name;
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int rc = fstatat(dirfd, name, &attr, AT_SYMLINK_NOFOLLOW);
+  put_dir_fd(dir);
+  if (rc)
+    {
+      int error = errno;
+      if (error == ENOENT)
+	add_negative(path);
+      throw error;
+    }
+  return add_file_cache(path, &attr, cache);
+}
+
+
+/**
+ * Add the file cache for a file whose attributes have just been looked up on
+ * the HDD, the name must be locked and must not be cached, and the cache must
+ * be released with `put_file_cache`
+ * 
+ * @param   path   The file
+ * @param   attr   The file's attributes
+ * @param   cache  Area to put the cache in
+ * @return         Error code
+ */
+static int add_file_cache(const char* path, const struct stat* attr, struct pram_file** cache)
+{
+  char key[PRAM_INODE_KEY_SIZE];
+  struct pram_file* c = (struct pram_file*)malloc(sizeof(struct pram_file));
+  if (c == NULL)
+    throw ENOMEM;
+  memset(c, 0, sizeof(struct pram_file));
+  c->attr = *attr;
+  c->chunks = NULL;
+  c->chunkn = 0;
+  c->fd = -1;
+  c->link = NULL;
+  c->linkn = 0;
+  c->paths = 1;
+  c->handles = 1;
+  pthread_rwlock_init(&(c->lock), NULL);
+  pthread_mutex_init(&(c->flush_lock), NULL);
+  inode_key(attr, key);
+  pthread_rwlock_wrlock(&pram_inode_lock);
+  struct pram_file* shared = (struct pram_file*)pram_map_get(pram_inode_cache, key);
+  if (shared)
+    {
+      /* Another name for a file that is already cached */
+      shared->paths++;
+      __atomic_add_fetch(&(shared->handles), 1, __ATOMIC_ACQ_REL);
+    }
+  else
+    pram_map_put(pram_inode_cache, key, c);
+  pthread_rwlock_unlock(&pram_inode_lock);
+  if (shared)
+    {
+      pthread_rwlock_destroy(&(c->lock));
+      pthread_mutex_destroy(&(c->flush_lock));
+      free(c);
+      c = shared;
+      _wrlock(c);
+      c->attr.st_nlink = attr->st_nlink;
+      c->attr.st_ctim = attr->st_ctim;
+      _rwunlock(c);
+    }
+  set_file_cache(path, c);
+  /* A file that was already cached may have been modified since the snapshot */
+  if (shared == NULL)
+    restore_snapshot(path, c);
+  *cache = c;
+  return 0;
+}
+
+
+/**
+ * Read the target of a symbolic link into its file cache, the file must be write locked
+ * 
+ * @param   cache  The file cache
+ * @param   dirfd  File descriptor for the link's directory on the HDD
+ * @param   name   The link's name relative to `dirfd`
+ * @return         Error code
+ */
+static int cache_link(struct pram_file* cache, int dirfd, const char* name)
+{
+  char* link = (char*)malloc(1024 * sizeof(char));
+  if (link == NULL)
+    throw ENOMEM;
+  long n = readlinkat(dirfd, name, link, 1023);
+  if (n < 0)
+    {
+      int error = errno;
+      free(link);
+      throw error;
+    }
+  if (n < 1023)
+    link = (char*)realloc(link, (n + 1) * sizeof(char));
+  *(link + n) = 0;
+  cache->link = link;
+  cache->linkn = n + 1;
+  return 0;
+}
+
+
+/**
+ * Look up a file found while prewarming, unless it is already cached,
+ * and its target if it is a symbolic link
+ * 
+ * @param   dirfd  File descriptor for the file's directory on the HDD
+ * @param   name   The file's name in the directory
+ * @param   path   The file
+ * @return         Whether the file is a directory
+ */
+static int prewarm_file(int dirfd, const char* name, const char* path)
+{
+  struct pram_file* cache;
+  struct stat attr;
+  int dir = false;
+  lock_names(path, NULL);
+  if ((cache = find_file_cache(path)) == NULL)
+    if (!fstatat(dirfd, name, &attr, AT_SYMLINK_NOFOLLOW))
+      if (add_file_cache(path, &attr, &cache))
+	cache = NULL;
+  if (cache)
+    {
+      _wrlock(cache);
+      if (S_ISLNK(cache->attr.st_mode) && (cache->linkn == 0))
+	cache_link(cache, dirfd, name);
+      dir = S_ISDIR(cache->attr.st_mode);
+      _rwunlock(cache);
+    }
+  unlock_names(path, NULL);
+  if (cache)
+    put_file_cache(cache);
+  return dir;
+}
+
+
+/**
+ * Look up the files in a directory while prewarming, and queue its subdirectories
+ * 
+ * @param  prewarm  The prewarming state
+ * @param  path     The directory
+ * @param  buffer   Buffer of `PRAM_PREWARM_BUFFER` bytes for the directory entries
+ */
+static void prewarm_dir(struct pram_prewarm* prewarm, const char* path, char* buffer)
+{
+  size_t n = strlen(path);
+  ssize_t got;
+  int fd = openat(hddfd, h(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  /* The names in the root should not start with two slashes */
+  if (n == 1)
+    n = 0;
+  while (__atomic_load_n(&pram_prewarming, __ATOMIC_ACQUIRE) &&
+	 ((got = getdents64(fd, buffer, PRAM_PREWARM_BUFFER)) > 0))
+    for (ssize_t off = 0; off < got; off += ((struct dirent64*)(buffer + off))->d_reclen)
+      {
+	const char* name = ((struct dirent64*)(buffer + off))->d_name;
+	if ((*name == '.') && ((*(name + 1) == 0) || ((*(name + 1) == '.') && (*(name + 2) == 0))))
+	  continue;
+	size_t m = strlen(name);
+	char* child = (char*)malloc((n + m + 2) * sizeof(char));
+	if (child == NULL)
+	  continue;
+	memcpy(child, path, n * sizeof(char));
+	*(child + n) = '/';
+	memcpy(child + n + 1, name, (m + 1) * sizeof(char));
+	if (prewarm_file(fd, name, child) == false)
+	  {
+	    free(child);
+	    continue;
+	  }
+	pthread_mutex_lock(&(prewarm->mutex));
+	if (prewarm->dirn == prewarm->dirsize)
+	  {
+	    size_t size = prewarm->dirsize ? prewarm->dirsize << 1 : 64;
+	    char** dirs = (char**)realloc(prewarm->dirs, size * sizeof(char*));
+	    if (dirs)
+	      {
+		prewarm->dirs = dirs;
+		prewarm->dirsize = size;
+	      }
+	  }
+	/* The subdirectory is skipped if the queue cannot grow */
+	if (prewarm->dirn < prewarm->dirsize)
+	  {
+	    *(prewarm->dirs + prewarm->dirn++) = child;
+	    pthread_cond_signal(&(prewarm->cond));
+	  }
+	else
+	  free(child);
+	pthread_mutex_unlock(&(prewarm->mutex));
+      }
+  close(fd);
+}
+
+
+/**
+ * Worker that looks up queued directories while prewarming,
+ * until all directories have been looked up
+ * 
+ * @param   prewarm  The prewarming state
+ * @return           `NULL`
+ */
+static void* prewarm_dirs(void* prewarm)
+{
+  struct pram_prewarm* p = (struct pram_prewarm*)prewarm;
+  char* buffer = (char*)malloc(PRAM_PREWARM_BUFFER * sizeof(char));
+  char* path;
+  if (buffer == NULL)
+    return NULL;
+  pthread_mutex_lock(&(p->mutex));
+  for (;;)
+    {
+      /* Directories that are being looked up may have subdirectories that have not been queued yet */
+      while ((p->dirn == 0) && p->busy && __atomic_load_n(&pram_prewarming, __ATOMIC_ACQUIRE))
+	pthread_cond_wait(&(p->cond), &(p->mutex));
+      if ((p->dirn == 0) || !__atomic_load_n(&pram_prewarming, __ATOMIC_ACQUIRE))
+	break;
+      path = *(p->dirs + --(p->dirn));
+      p->busy++;
+      pthread_mutex_unlock(&(p->mutex));
+      prewarm_dir(p, path, buffer);
+      free(path);
+      pthread_mutex_lock(&(p->mutex));
+      p->busy--;
+    }
+  pthread_cond_broadcast(&(p->cond));
+  pthread_mutex_unlock(&(p->mutex));
+  free(buffer);
+  return NULL;
+}
+
+
+/**
+ * Look up all files in `pram_prewarm` on the HDD, on `PRAM_PREWARM_THREADS` threads,
+ * so that they are cached before they are used
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* prewarm_tree(void* data)
+{
+  pthread_t threads[PRAM_PREWARM_THREADS];
+  struct pram_prewarm prewarm;
+  struct pram_file* cache;
+  long i;
+  (void) data;
+  lock_names(pram_prewarm, NULL);
+  int error = load_file_cache(pram_prewarm, &cache);
+  unlock_names(pram_prewarm, NULL);
+  if (error)
+    return NULL;
+  _rdlock(cache);
+  int dir = S_ISDIR(cache->attr.st_mode);
+  _rwunlock(cache);
+  put_file_cache(cache);
+  if (dir == false)
+    return NULL;
+  memset(&prewarm, 0, sizeof(struct pram_prewarm));
+  if ((prewarm.dirs = (char**)malloc(64 * sizeof(char*))) == NULL)
+    return NULL;
+  if ((*(prewarm.dirs) = strdup(pram_prewarm)) == NULL)
+    {
+      free(prewarm.dirs);
+      return NULL;
+    }
+  prewarm.dirn = 1;
+  prewarm.dirsize = 64;
+  pthread_mutex_init(&(prewarm.mutex), NULL);
+  pthread_cond_init(&(prewarm.cond), NULL);
+  /* The lookups wait for the HDD rather than for the CPU, so the number of CPUs is not a limit */
+  for (i = 0; i + 1 < PRAM_PREWARM_THREADS; i++)
+    if (pthread_create(threads + i, NULL, prewarm_dirs, &prewarm))
+      break;
+  prewarm_dirs(&prewarm);
+  while (i--)
+    pthread_join(*(threads + i), NULL);
+  /* Directories are left in the queue if the file system is unmounted during the prewarming */
+  while (prewarm.dirn)
+    free(*(prewarm.dirs + --(prewarm.dirn)));
+  free(prewarm.dirs);
+  pthread_mutex_destroy(&(prewarm.mutex));
+  pthread_cond_destroy(&(prewarm.cond));
+  return NULL;
+}
+
+
+/**
+ * Load the snapshot saved when the file system was last unmounted, its
+ * entries are used when the files are looked up, if they are still valid
+ */
+static void load_snapshot(void)
+{
+  struct pram_snapshot_header* header;
+  struct stat attr;
+  size_t off, i;
+  int fd = open(pram_snapshot, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+	perror("open");
+      return;
+    }
+  if (fstat(fd, &attr) || ((size_t)(attr.st_size) < sizeof(struct pram_snapshot_header)))
+    {
+      close(fd);
+      return;
+    }
+  pram_snapshot_size = (size_t)(attr.st_size);
+  pram_snapshot_map = (char*)mmap(NULL, pram_snapshot_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (pram_snapshot_map == MAP_FAILED)
+    {
+      perror("mmap");
+      pram_snapshot_map = NULL;
+      return;
+    }
+  header = (struct pram_snapshot_header*)pram_snapshot_map;
+  /* The snapshot is not portable, it is only used by the program that saved it */
+  if (memcmp(header->magic, PRAM_SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      (header->version != PRAM_SNAPSHOT_VERSION) || (header->stat_size != sizeof(struct stat)) ||
+      (header->chunk_size != PRAM_CHUNK_SIZE))
+    {
+      munmap(pram_snapshot_map, pram_snapshot_size);
+      pram_snapshot_map = NULL;
+      return;
+    }
+  pram_snapshot_index = (pram_map*)malloc(sizeof(pram_map));
+  pram_map_init(pram_snapshot_index);
+  /* The rest of the snapshot is ignored from the first damaged entry, it may have been cut short */
+  off = sizeof(struct pram_snapshot_header);
+  for (i = 0; i < header->files; i++)
+    {
+      const struct pram_snapshot_file* file = (const struct pram_snapshot_file*)(pram_snapshot_map + off);
+      size_t size = pram_snapshot_size - off;
+      if ((size < sizeof(struct pram_snapshot_file)) || (file->size > size) ||
+	  (file->size < sizeof(struct pram_snapshot_file)) || (file->size & 7))
+	break;
+      size = (size_t)(file->size);
+      const char* path = (const char*)(file + 1);
+      size_t table = sizeof(struct pram_snapshot_file) + file->pathn + file->linkn;
+      if ((file->pathn < 2) || (file->pathn > size) || (file->linkn > size) || (table > size) ||
+	  (*path != '/') || *(path + file->pathn - 1) || (file->linkn && *(path + file->pathn + file->linkn - 1)))
+	break;
+      table = PRAM_SNAPSHOT_ALIGN(table);
+      if ((table > size) || (file->chunkn > (size - table) / sizeof(struct pram_snapshot_chunk)))
+	break;
+      const struct pram_snapshot_chunk* chunks = (const struct pram_snapshot_chunk*)((const char*)file + table);
+      size_t data = table + (size_t)(file->chunkn) * sizeof(struct pram_snapshot_chunk), j;
+      for (j = 0; j < file->chunkn; j++)
+	if (((chunks + j)->offset < data) || ((chunks + j)->offset > size) ||
+	    ((chunks + j)->length > size - (chunks + j)->offset) ||
+	    ((chunks + j)->length > PRAM_CHUNK_SIZE) || (j && ((chunks + j)->index <= (chunks + j - 1)->index)))
+	  break;
+      if (j < file->chunkn)
+	break;
+      pram_map_put(pram_snapshot_index, path, (void*)file);
+      off += size;
+    }
+}
+
+
+/**
+ * Use a file's entry in the snapshot, if it has one and the file has not
+ * changed on the HDD since the snapshot was saved, the name must be locked
+ * 
+ * @param  path   The file
+ * @param  cache  The file cache
+ */
+static void restore_snapshot(const char* path, struct pram_file* cache)
+{
+  if (pram_snapshot_index == NULL)
+    return;
+  /* Each entry is used once, later lookups of the name find the file cache */
+  pthread_mutex_lock(&pram_snapshot_mutex);
+  const struct pram_snapshot_file* file = (const struct pram_snapshot_file*)pram_map_get(pram_snapshot_index, path);
+  if (file)
+    pram_map_put(pram_snapshot_index, path, NULL);
+  pthread_mutex_unlock(&pram_snapshot_mutex);
+  if (file == NULL)
+    return;
+  _wrlock(cache);
+  if ((cache->attr.st_dev == file->attr.st_dev) && (cache->attr.st_ino == file->attr.st_ino) &&
+      (cache->attr.st_size == file->attr.st_size) &&
+      (cache->attr.st_mtim.tv_sec == file->attr.st_mtim.tv_sec) &&
+      (cache->attr.st_mtim.tv_nsec == file->attr.st_mtim.tv_nsec))
+    {
+      if (S_ISLNK(cache->attr.st_mode) && (cache->linkn == 0) && file->linkn &&
+	  (cache->link = (char*)malloc(file->linkn * sizeof(char))))
+	{
+	  memcpy(cache->link, (const char*)(file + 1) + file->pathn, file->linkn * sizeof(char));
+	  cache->linkn = file->linkn;
+	}
+      if (file->chunkn && (cache->snapshot == NULL))
+	cache->snapshot = file;
+    }
+  _rwunlock(cache);
+}
+
+
+/**
+ * Find an extent of a file in the snapshot
+ * 
+ * @param   file   The file's entry in the snapshot
+ * @param   index  The index of the extent
+ * @return         The extent, `NULL` if it is not in the snapshot
+ */
+static const struct pram_snapshot_chunk* snapshot_chunk(const struct pram_snapshot_file* file, size_t index)
+{
+  size_t table = PRAM_SNAPSHOT_ALIGN(sizeof(struct pram_snapshot_file) + file->pathn + file->linkn);
+  const struct pram_snapshot_chunk* chunks = (const struct pram_snapshot_chunk*)((const char*)file + table);
+  size_t low = 0, high = (size_t)(file->chunkn);
+  while (low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+      if ((chunks + mid)->index == index)
+	return chunks + mid;
+      if ((chunks + mid)->index < index)
+	low = mid + 1;
+      else
+	high = mid;
+    }
+  return NULL;
+}
+
+
+/**
+ * Gets the content of an extent of a file that shall be saved to the snapshot,
+ * the extent is saved if it is cached and unmodified, or if it has not been
+ * read since it was loaded from the last snapshot
+ * 
+ * @param   cache   The file cache
+ * @param   index   The index of the extent
+ * @param   length  Output parameter for the length of the extent
+ * @return          The content of the extent, `NULL` if it shall not be saved
+ */
+static const char* clean_extent(struct pram_file* cache, size_t index, size_t* length)
+{
+  struct pram_chunk* chunk = *(cache->chunks + index);
+  const struct pram_snapshot_chunk* saved;
+  if (chunk)
+    {
+      *length = chunk->length;
+      return chunk->dirty_end ? NULL : chunk->data;
+    }
+  if ((cache->snapshot == NULL) || ((saved = snapshot_chunk(cache->snapshot, index)) == NULL))
+    return NULL;
+  *length = (size_t)(saved->length);
+  return (const char*)(cache->snapshot) + saved->offset;
+}
+
+
+/**
+ * Write to the snapshot that is being saved
+ * 
+ * @param  save  The saving state
+ * @param  buf   The data to write
+ * @param  n     The number of bytes to write
+ */
+static void write_snapshot(struct pram_snapshot_save* save, const void* buf, size_t n)
+{
+  if (n && (fwrite(buf, 1, n, save->file) != n))
+    save->error = true;
+  save->off += n;
+}
+
+
+/**
+ * Pad the snapshot that is being saved to a multiple of eight bytes
+ * 
+ * @param  save  The saving state
+ */
+static void align_snapshot(struct pram_snapshot_save* save)
+{
+  static const char padding[8] = { 0 };
+  write_snapshot(save, padding, PRAM_SNAPSHOT_ALIGN(save->off) - save->off);
+}
+
+
+/**
+ * Callback for `pram_map_scan` that saves a name in the file cache map,
+ * and the file's unmodified extents, to the snapshot
+ * 
+ * @param  key    The file
+ * @param  value  The file's cache
+ * @param  data   The saving state
+ */
+static void save_snapshot_file(const char* key, void* value, void* data)
+{
+  struct pram_snapshot_save* save = (struct pram_snapshot_save*)data;
+  struct pram_file* cache = (struct pram_file*)value;
+  struct pram_snapshot_file file;
+  struct pram_snapshot_chunk chunk;
+  char inode[PRAM_INODE_KEY_SIZE];
+  const char* content;
+  size_t i, length;
+  if (save->error || cache->unlinked)
+    return;
+  memset(&file, 0, sizeof(struct pram_snapshot_file));
+  file.attr = cache->attr;
+  file.pathn = strlen(key) + 1;
+  file.linkn = cache->linkn;
+  /* The extents of a file with multiple names are only saved with one of the names */
+  inode_key(&(cache->attr), inode);
+  int extents = pram_snapshot_data && (pram_map_get(save->saved, inode) == NULL);
+  if (extents)
+    {
+      pram_map_put(save->saved, inode, cache);
+      for (i = 0; i < cache->chunkn; i++)
+	if (clean_extent(cache, i, &length))
+	  file.chunkn++;
+    }
+  /* The cached modification time is not the time the extents were written to the HDD */
+  if (file.chunkn && fstatat(hddfd, h(key), &(file.attr), AT_SYMLINK_NOFOLLOW))
+    return;
+  if (file.chunkn && (file.attr.st_size != cache->attr.st_size))
+    return;
+  size_t off = PRAM_SNAPSHOT_ALIGN(sizeof(struct pram_snapshot_file) + file.pathn + file.linkn);
+  off += (size_t)(file.chunkn) * sizeof(struct pram_snapshot_chunk);
+  file.size = off;
+  for (i = 0; file.chunkn && (i < cache->chunkn); i++)
+    if (clean_extent(cache, i, &length))
+      file.size += PRAM_SNAPSHOT_ALIGN(length);
+  write_snapshot(save, &file, sizeof(struct pram_snapshot_file));
+  write_snapshot(save, key, file.pathn);
+  write_snapshot(save, cache->link, file.linkn);
+  align_snapshot(save);
+  for (i = 0; file.chunkn && (i < cache->chunkn); i++)
+    if (clean_extent(cache, i, &length))
+      {
+	chunk.index = i;
+	chunk.offset = off;
+	chunk.length = length;
+	off += PRAM_SNAPSHOT_ALIGN(length);
+	write_snapshot(save, &chunk, sizeof(struct pram_snapshot_chunk));
+      }
+  for (i = 0; file.chunkn && (i < cache->chunkn); i++)
+    if ((content = clean_extent(cache, i, &length)))
+      {
+	write_snapshot(save, content, length);
+	align_snapshot(save);
+      }
+  save->files++;
+}
+
+
+/**
+ * Callback for `pram_map_scan` that saves an entry from the last snapshot
+ * that has not been used, unless its name is in the file cache map
+ * 
+ * @param  key    The file
+ * @param  value  The file's entry in the last snapshot
+ * @param  data   The saving state
+ */
+static void save_unused_snapshot_file(const char* key, void* value, void* data)
+{
+  struct pram_snapshot_save* save = (struct pram_snapshot_save*)data;
+  const struct pram_snapshot_file* file = (const struct pram_snapshot_file*)value;
+  if (save->error || pram_map_get(pram_file_cache, key))
+    return;
+  /* The entry is checked against the HDD when it is loaded again */
+  write_snapshot(save, file, (size_t)(file->size));
+  save->files++;
+}
+
+
+/**
+ * Save the file cache to the snapshot on unmount, the modified
+ * extents must have been written to the HDD before this is done
+ */
+static void save_snapshot(void)
+{
+  struct pram_snapshot_header header;
+  struct pram_snapshot_save save;
+  pram_map saved;
+  size_t n = strlen(pram_snapshot);
+  char* temp = (char*)malloc((n + sizeof(".tmp")) * sizeof(char));
+  if (temp == NULL)
+    return;
+  memcpy(temp, pram_snapshot, n * sizeof(char));
+  memcpy(temp + n, ".tmp", sizeof(".tmp"));
+  /* The last snapshot is replaced when the new one is complete, it is mapped until then */
+  int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if ((fd < 0) || ((save.file = fdopen(fd, "w")) == NULL))
+    {
+      perror("open");
+      if (fd >= 0)
+	close(fd);
+      free(temp);
+      return;
+    }
+  memset(&header, 0, sizeof(struct pram_snapshot_header));
+  memcpy(header.magic, PRAM_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = PRAM_SNAPSHOT_VERSION;
+  header.stat_size = sizeof(struct stat);
+  header.chunk_size = PRAM_CHUNK_SIZE;
+  pram_map_init(&saved);
+  save.saved = &saved;
+  save.files = 0;
+  save.off = 0;
+  save.error = false;
+  write_snapshot(&save, &header, sizeof(struct pram_snapshot_header));
+  /* Entries for names in the file cache map are saved last, so that they win if a name occurs twice */
+  if (pram_snapshot_index)
+    pram_map_scan(pram_snapshot_index, "", save_unused_snapshot_file, &save);
+  pram_map_scan(pram_file_cache, "", save_snapshot_file, &save);
+  header.files = save.files;
+  if (!save.error && (fseek(save.file, 0, SEEK_SET) ||
+		      (fwrite(&header, sizeof(struct pram_snapshot_header), 1, save.file) != 1)))
+    save.error = true;
+  if (fflush(save.file) || fsync(fd))
+    save.error = true;
+  if (fclose(save.file))
+    save.error = true;
+  if (save.error || rename(temp, pram_snapshot))
+    {
+      fprintf(stderr, "pramfusehpc: error: could not save snapshot to %s\n", pram_snapshot);
+      unlink(temp);
+    }
+  free(pram_map_free(&saved));
+  free(temp);
+}
+
+
+/**
+ * Detect whether a file is read sequentially or with a fixed stride, and
+ * if so, read ahead of the reader, reading more the longer the pattern holds
+ * 
+ * @param  file  The open file
+ * @param  off   The offset of the read
+ * @param  len   The length of the read
+ */
+static void detect_readahead(struct pram_file_info* file, off_t off, size_t len)
+{
+  off_t start = 0, stride;
+  size_t count = 0;
+  if ((pram_readahead == 0) || (len == 0) || ((file->flags & O_ACCMODE) == O_WRONLY))
+    return;
+  pthread_mutex_lock(&(file->readahead_lock));
+  if (file->stride && (off - file->last == file->stride))
+    {
+      size_t max = pram_readahead / len ? pram_readahead / len : 1;
+      int issue = true;
+      if (file->window == 0)
+	{
+	  file->window = PRAM_READAHEAD_START < max ? PRAM_READAHEAD_START : max;
+	  file->issued = off + file->stride;
+	}
+      /* More is read when the reader has used half of what was read ahead, twice as much each time */
+      else if (file->issued - off > file->stride * (off_t)(file->window / 2))
+	issue = false;
+      else
+	file->window = file->window * 2 < max ? file->window * 2 : max;
+      if (issue && (file->issued - off <= file->stride * (off_t)(file->window)))
+	{
+	  start = file->issued;
+	  count = (size_t)((off + file->stride * (off_t)(file->window) - start) / file->stride) + 1;
+	  file->issued += file->stride * (off_t)count;
+	}
     }
   else
-    *cache = (struct pram_file*)ret;
+    {
+      /* The pattern is only followed when the next read confirms it */
+      stride = off - file->last;
+      file->stride = (file->last >= 0) && (stride >= (off_t)len) && (stride <= (off_t)pram_readahead) ? stride : 0;
+      file->window = 0;
+    }
+  file->last = off;
+  stride = file->stride;
+  pthread_mutex_unlock(&(file->readahead_lock));
+  if (count)
+    queue_readahead(file->cache, (int)(file->fd), start, len, stride, count);
+}
+
+
+/**
+ * Queue reads of a file for the readahead threads
+ * 
+ * @param  cache   The file cache, it must be referenced by the caller
+ * @param  fd      File descriptor to read the file with, it is duplicated
+ * @param  off     The offset of the first read
+ * @param  len     The length of each read
+ * @param  stride  The distance between the offsets of the reads
+ * @param  count   The number of reads
+ */
+static void queue_readahead(struct pram_file* cache, int fd, off_t off, size_t len, off_t stride, size_t count)
+{
+  /* Readahead is only an optimisation, so it is skipped if the threads are behind */
+  if (__atomic_load_n(&pram_readahead_queued, __ATOMIC_RELAXED) >= PRAM_READAHEAD_QUEUE)
+    return;
+  struct pram_readahead* readahead = (struct pram_readahead*)malloc(sizeof(struct pram_readahead));
+  if (readahead == NULL)
+    return;
+  /* The file may be closed before the reads are made */
+  if ((readahead->fd = dup(fd)) < 0)
+    {
+      free(readahead);
+      return;
+    }
+  __atomic_add_fetch(&(cache->handles), 1, __ATOMIC_ACQ_REL);
+  readahead->next = NULL;
+  readahead->cache = cache;
+  readahead->off = off;
+  readahead->len = len;
+  readahead->stride = stride;
+  readahead->count = count;
+  pthread_mutex_lock(&pram_readahead_mutex);
+  if (pram_readahead_running)
+    {
+      if (pram_readahead_last)
+	pram_readahead_last->next = readahead;
+      else
+	pram_readahead_queue = readahead;
+      pram_readahead_last = readahead;
+      __atomic_add_fetch(&pram_readahead_queued, 1, __ATOMIC_RELAXED);
+      pthread_cond_signal(&pram_readahead_cond);
+      readahead = NULL;
+    }
+  pthread_mutex_unlock(&pram_readahead_mutex);
+  if (readahead)
+    free_readahead(readahead);
+}
+
+
+/**
+ * Release the file and the file descriptor of queued reads, and free them
+ * 
+ * @param  readahead  The queued reads
+ */
+static void free_readahead(struct pram_readahead* readahead)
+{
+  close(readahead->fd);
+  put_file_cache(readahead->cache);
+  free(readahead);
+}
+
+
+/**
+ * Read consecutive extents of a file into its cache ahead of the reader,
+ * the reads are made together without the file locked, and the extents
+ * are discarded if the file is modified meanwhile
+ * 
+ * @param   cache   The file cache
+ * @param   fd      File descriptor to read the file with
+ * @param   index   The index of the first extent
+ * @param   count   The number of extents, at most `PRAM_IO_DEPTH`
+ * @param   buffer  Buffer of `PRAM_IO_DEPTH * PRAM_CHUNK_SIZE` bytes
+ * @return          Zero on success, -1 if an extent is beyond the end
+ *                  of the file or if the cache is full
+ */
+static int read_ahead_chunks(struct pram_file* cache, int fd, size_t index, size_t count, char* buffer)
+{
+  pram_io* io = get_io();
+  char wanted[PRAM_IO_DEPTH], saved[PRAM_IO_DEPTH];
+  size_t i, reads = 0;
+  int beyond = false, error = 0;
+  pram_io_clear(io);
+  _rdlock(cache);
+  unsigned long changes = cache->changes;
+  off_t size = cache->attr.st_size;
+  for (i = 0; i < count; i++)
+    {
+      off_t off = (off_t)(index + i) * PRAM_CHUNK_SIZE;
+      if (off >= size)
+	{
+	  count = i;
+	  beyond = true;
+	  break;
+	}
+      size_t length = size - off < PRAM_CHUNK_SIZE ? (size_t)(size - off) : PRAM_CHUNK_SIZE;
+      *(wanted + i) = !((index + i < cache->chunkn) && *(cache->chunks + index + i));
+      *(saved + i) = cache->snapshot && snapshot_chunk(cache->snapshot, index + i);
+      /* Every extent gets an operation, so that they line up, but only those that are needed read anything */
+      if (*(wanted + i) && !*(saved + i))
+	reads++;
+      pram_io_queue(io, fd, false, buffer + i * PRAM_CHUNK_SIZE,
+		    *(wanted + i) && !*(saved + i) ? length : 0, off);
+    }
+  _rwunlock(cache);
+  if (reads)
+    pram_io_run(io);
+  _wrlock(cache);
+  for (i = 0; (i < count) && (error == 0) && (cache->changes == changes); i++)
+    {
+      struct pram_io_op* op = io->ops + i;
+      struct pram_chunk* chunk;
+      if (!*(wanted + i) || op->error || ((index + i < cache->chunkn) && *(cache->chunks + index + i)))
+	continue;
+      /* Extents in the snapshot are copied rather than read */
+      if (*(saved + i))
+	chunk = get_chunk(cache, index + i, fd);
+      else if ((chunk = new_chunk(cache, index + i)))
+	memcpy(chunk->data, op->buf, op->done < chunk->length ? op->done : chunk->length);
+      if (chunk == NULL)
+	error = -1;
+    }
+  _rwunlock(cache);
+  pram_io_clear(io);
+  return beyond ? -1 : error;
+}
+
+
+/**
+ * Readahead thread, it makes queued reads until the file system is unmounted
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* read_ahead(void* data)
+{
+  char* buffer = (char*)malloc(PRAM_IO_DEPTH * PRAM_CHUNK_SIZE * sizeof(char));
+  struct pram_readahead* readahead;
+  (void) data;
+  pthread_mutex_lock(&pram_readahead_mutex);
+  for (;;)
+    {
+      while (pram_readahead_running && (pram_readahead_queue == NULL))
+	pthread_cond_wait(&pram_readahead_cond, &pram_readahead_mutex);
+      if (pram_readahead_running == false)
+	break;
+      readahead = pram_readahead_queue;
+      if ((pram_readahead_queue = readahead->next) == NULL)
+	pram_readahead_last = NULL;
+      __atomic_sub_fetch(&pram_readahead_queued, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&pram_readahead_mutex);
+      for (size_t i = 0; buffer && (i < readahead->count); i++)
+	{
+	  off_t off = readahead->off + readahead->stride * (off_t)i;
+	  size_t index = (size_t)(off / PRAM_CHUNK_SIZE);
+	  size_t end = (size_t)((off + (off_t)(readahead->len) - 1) / PRAM_CHUNK_SIZE);
+	  for (; index <= end; index += PRAM_IO_DEPTH)
+	    if (read_ahead_chunks(readahead->cache, readahead->fd, index,
+				  end - index < PRAM_IO_DEPTH ? end - index + 1 : PRAM_IO_DEPTH, buffer) < 0)
+	      break;
+	  if (index <= end)
+	    break;
+	}
+      free_readahead(readahead);
+      pthread_mutex_lock(&pram_readahead_mutex);
+    }
+  pthread_mutex_unlock(&pram_readahead_mutex);
+  free(buffer);
+  return NULL;
+}
+
+
+/**
+ * Set the file cache for a name in the file cache map, the name must be locked
+ * 
+ * @param  path   The file
+ * @param  cache  The file's cache, `NULL` to remove the name
+ */
+static void set_file_cache(const char* path, struct pram_file* cache)
+{
+  pthread_mutex_lock(&pram_file_cache_mutex);
+  pram_map_put(pram_file_cache, path, cache);
+  pthread_mutex_unlock(&pram_file_cache_mutex);
+}
+
+
+/**
+ * Take a reference to a file cache that may be being freed,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   cache  The file cache
+ * @return         Zero on success, -1 if the file cache is being freed
+ */
+static int pin_file_cache(struct pram_file* cache)
+{
+  long handles = __atomic_load_n(&(cache->handles), __ATOMIC_ACQUIRE);
+  do
+    if ((handles == 0) && __atomic_load_n(&(cache->unlinked), __ATOMIC_ACQUIRE))
+      return -1;
+  while (!__atomic_compare_exchange_n(&(cache->handles), &handles, handles + 1, false,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
   return 0;
 }
 
+
+/**
+ * Lock one or two names, so that they are not looked up or changed on the HDD
+ * by another thread, names whose hashes are equal modulo `PRAM_SHARDS` share their lock
+ * 
+ * @param  a  The file
+ * @param  b  The other file, `NULL` if only `a` shall be locked
+ */
+static void lock_names(const char* a, const char* b)
+{
+  pthread_mutex_t* x = get_names_lock(a);
+  pthread_mutex_t* y = b ? get_names_lock(b) : x;
+  /* Always lock in the same order so that two renames cannot deadlock */
+  pthread_mutex_lock(x < y ? x : y);
+  if (x != y)
+    pthread_mutex_lock(x < y ? y : x);
+}
+
+
+/**
+ * Unlock names locked with `lock_names`
+ * 
+ * @param  a  The file
+ * @param  b  The other file, `NULL` if only `a` was locked
+ */
+static void unlock_names(const char* a, const char* b)
+{
+  pthread_mutex_t* x = get_names_lock(a);
+  pthread_mutex_t* y = b ? get_names_lock(b) : x;
+  if (x != y)
+    pthread_mutex_unlock(y);
+  pthread_mutex_unlock(x);
+}
+
+
+/**
+ * Close the file descriptor a file uses for write-back if the file is no
+ * longer open and has no modified extents, the file must be write locked
+ * 
+ * @param  cache  The file cache
+ */
+static void close_write_back_fd(struct pram_file* cache)
+{
+  if (cache->opened || cache->flushing || (cache->fd < 0))
+    return;
+  _lock;
+  time_t dirtied = cache->dirtied;
+  _unlock;
+  if (dirtied == 0)
+    {
+      close(cache->fd);
+      cache->fd = -1;
+    }
+}
+
+
+/**
+ * Check whether all extents in a range of a file are cached, the file must be locked
+ * 
+ * @param   cache  The file cache
+ * @param   off    The offset of the range
+ * @param   len    The length of the range
+ * @return         Whether all extents in the part of the range that is within the file are cached
+ */
+static int chunks_cached(struct pram_file* cache, off_t off, size_t len)
+{
+  if (off >= cache->attr.st_size)
+    return true;
+  if ((off_t)len > cache->attr.st_size - off)
+    len = (size_t)(cache->attr.st_size - off);
+  if (len == 0)
+    return true;
+  size_t i = (size_t)(off / PRAM_CHUNK_SIZE);
+  size_t end = (size_t)((off + (off_t)len - 1) / PRAM_CHUNK_SIZE);
+  for (; i <= end; i++)
+    if ((i >= cache->chunkn) || (*(cache->chunks + i) == NULL))
+      return false;
+  return true;
+}
+
+
+/**
+ * Open or create a file
+ * 
+ * @param   path    The file
+ * @param   fi      File information
+ * @param   mode    File mode, used if the file is created
+ * @param   create  Whether the file may be created
+ * @return          Error code
+ */
+static int open_file(const char* path, struct fuse_file_info* fi, mode_t mode, int create)
+{
+  struct pram_file* cache = NULL;
+  struct pram_file* truncated = NULL;
+  struct pram_dir_fd* dir;
+  struct stat attr;
+  const char* name;
+  int error = 0;
+  if (create)
+    lock_names(path, NULL);
+  /* An ongoing write-back could otherwise extend the file after it is truncated */
+  if ((fi->flags & O_TRUNC) && (truncated = cache = find_file_cache(path)))
+    pthread_mutex_lock(&(truncated->flush_lock));
+  if (create)
+    remove_negative(path);
+  int dirfd = get_dir_fd(path, &name, &dir);
+  int fd = openat(dirfd, name, fi->flags, mode);
+  if (fd < 0)
+    error = -errno;
+  else if (cache == NULL)
+    error = create ? load_file_cache(path, &cache) : get_file_cache(path, &cache);
+  if (!error && create)
+    {
+      _rdlock(cache);
+      attr = cache->attr;
+      _rwunlock(cache);
+      dir_cache_add(path, &attr);
+    }
+  if (!error)
+    {
+      _wrlock(cache);
+      if (fi->flags & O_TRUNC)
+	resize_file_cache(cache, 0);
+      if (((fi->flags & O_ACCMODE) != O_RDONLY) && (cache->fd < 0))
+	cache->fd = openat(dirfd, name, O_WRONLY);
+      cache->opened++;
+      _rwunlock(cache);
+    }
+  put_dir_fd(dir);
+  if (truncated)
+    pthread_mutex_unlock(&(truncated->flush_lock));
+  if (create)
+    unlock_names(path, NULL);
+  if (error)
+    {
+      if (fd >= 0)
+	close(fd);
+      if (cache)
+	put_file_cache(cache);
+      return error;
+    }
+  struct pram_file_info* file = (struct pram_file_info*)malloc(sizeof(struct pram_file_info));
+  file->fd = fd;
+  file->flags = fi->flags;
+  file->cache = cache;
+  pthread_mutex_init(&(file->readahead_lock), NULL);
+  file->last = -1;
+  file->stride = 0;
+  file->window = 0;
+  file->issued = 0;
+  fi->fh = (uint64_t)(void*)file;
+  return 0;
+}
@@ -35,9 +35,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdint.h>
 #include <attr/xattr.h>
 
 #include "map.h"
+#include "io.h"
 
 
 
@@ -49,228 +53,2204 @@
 
 
 /**
- * Buffer for converting a file name in this mountpoint to the one in on the HDD
+ * Buffer for converting a file name in this mountpoint to the one in on the HDD,
+ * each thread has its own buffer
  */
-static char* pathbuf = NULL;
+static __thread char* pathbuf = NULL;
+
+/**
+ * The HDD path
+ */
+static char* hddroot = NULL;
 
 /**
  * The length of the HDD path
  */
-static long hddlen = 0;
+static long hddlen = 0;
+
+/**
+ * `O_PATH` file descriptor for the HDD path, files on the HDD
+ * are named relative to it, as returned by `h`, when possible
+ */
+static int hddfd = -1;
+
+/**
+ * The size of `pathbuf`
+ */
+static __thread long pathbufsize = 0;
+
+/**
+ * Key used to free a thread's `pathbuf` when the thread exits
+ */
+static pthread_key_t pram_pathbuf_key;
+
+/**
+ * Where the thread's last search in `pram_file_cache` can be resumed,
+ * so that files in the same directory are found without searching
+ * for the directory again
+ */
+static __thread pram_map_finger pram_finger;
+
+/**
+ * Key used to free the key in a thread's `pram_finger` when the thread exits
+ */
+static pthread_key_t pram_finger_key;
+
+/**
+ * The thread's queue of reads and writes that are made together
+ */
+static __thread pram_io pram_io_thread;
+
+/**
+ * Whether the thread's `pram_io_thread` has been initialised
+ */
+static __thread int pram_io_ready = false;
+
+/**
+ * Key used to free the resources of a thread's `pram_io_thread` when the thread exits
+ */
+static pthread_key_t pram_io_key;
+
+/**
+ * The number of bytes in each cached extent of a file
+ */
+#ifndef PRAM_CHUNK_SIZE
+  #define PRAM_CHUNK_SIZE  (1L << 20)
+#endif
+
+/**
+ * The number of locks the file names are split between
+ */
+#ifndef PRAM_SHARDS
+  #define PRAM_SHARDS  64
+#endif
+
+/**
+ * The maximum number of threads that free the file caches on unmount
+ */
+#ifndef PRAM_TEARDOWN_THREADS
+  #define PRAM_TEARDOWN_THREADS  16
+#endif
+
+/**
+ * The number of file caches a thread takes at a time when freeing the file caches on unmount
+ */
+#define PRAM_TEARDOWN_BATCH  64
+
+/**
+ * The number of threads that look up files on the HDD when prewarming
+ */
+#ifndef PRAM_PREWARM_THREADS
+  #define PRAM_PREWARM_THREADS  16
+#endif
+
+/**
+ * The size of the buffer each prewarming thread reads directory entries into
+ */
+#define PRAM_PREWARM_BUFFER  (64 << 10)
+
+/**
+ * The first bytes of a snapshot
+ */
+#define PRAM_SNAPSHOT_MAGIC  "PRAMSNAP"
+
+/**
+ * The version of the snapshot format
+ */
+#define PRAM_SNAPSHOT_VERSION  1
+
+/**
+ * Round a size in a snapshot up to a multiple of eight bytes
+ */
+#define PRAM_SNAPSHOT_ALIGN(n)  (((n) + 7) & ~(size_t)7)
+
+/**
+ * The number of threads that read files ahead of their readers
+ */
+#ifndef PRAM_READAHEAD_THREADS
+  #define PRAM_READAHEAD_THREADS  4
+#endif
+
+/**
+ * The maximum number of queued readaheads
+ */
+#define PRAM_READAHEAD_QUEUE  256
+
+/**
+ * The number of reads that are first read ahead when a pattern is detected
+ */
+#define PRAM_READAHEAD_START  4
+
+/**
+ * The maximum number of nanoseconds a write is delayed by before the dirty limit is reached
+ */
+#define PRAM_THROTTLE_MAX  200000000ULL
+
+
+
+/**
+ * The maximum number of bytes to use for cached file content, zero for unlimited
+ */
+static size_t pram_cache_size = 0;
+
+/**
+ * The number of bytes used for cached file content
+ */
+static size_t pram_cache_used = 0;
+
+/**
+ * The clock hand for cache eviction, all cached extents are in a circular list
+ */
+static struct pram_chunk* pram_clock = NULL;
+
+/**
+ * The number of seconds modified file content may stay in RAM before it is written to the HDD
+ */
+static time_t pram_flush_age = 5;
+
+/**
+ * The percentage of `pram_cache_size` that may be modified content before
+ * it is written to the HDD regardless of its age
+ */
+static size_t pram_dirty_ratio = 20;
+
+/**
+ * The number of modified bytes in cached extents
+ */
+static size_t pram_dirty_bytes = 0;
+
+/**
+ * The number of files in the list of files with modified extents
+ */
+static size_t pram_dirty_files = 0;
+
+/**
+ * The file that has had modified extents the longest
+ */
+static struct pram_file* pram_dirty = NULL;
+
+/**
+ * The file that has had modified extents the shortest time
+ */
+static struct pram_file* pram_dirty_last = NULL;
+
+/**
+ * The maximum number of modified bytes, including those being written to the HDD,
+ * before writers must wait for them to be written, zero for no limit, writers are
+ * slowed down gradually once `pram_dirty_ratio` percent of it is modified
+ */
+static size_t pram_dirty_limit = 0;
+
+/**
+ * The number of bytes per second the background thread writes
+ * modified content to the HDD, zero for as fast as possible
+ */
+static size_t pram_drain_rate = 0;
+
+/**
+ * The number of modified bytes that are being written to the HDD
+ */
+static size_t pram_flushing_bytes = 0;
+
+/**
+ * The measured number of bytes per second the background thread writes to the HDD, zero if not measured
+ */
+static size_t pram_drain_bandwidth = 0;
+
+/**
+ * Whether the last write-back by the background thread failed, writers then do not wait for write-backs
+ */
+static char pram_drain_failed = false;
+
+/**
+ * The number of writers waiting for modified content to be written to the HDD
+ */
+static size_t pram_throttled = 0;
+
+/**
+ * When the background thread may start writing its next stripe, so that it
+ * keeps to `pram_drain_rate`, on `CLOCK_MONOTONIC`, protected by `pram_flusher_mutex`
+ */
+static struct timespec pram_drain_clock;
+
+/**
+ * The number of seconds a failed lookup is remembered, zero to not remember failed lookups
+ */
+static time_t pram_negative_ttl = 5;
+
+/**
+ * The maximum number of remembered failed lookups
+ */
+static size_t pram_negative_max = 8192;
+
+/**
+ * Ring of remembered failed lookups, the oldest is replaced when it is full
+ */
+static struct pram_negative* pram_negatives = NULL;
+
+/**
+ * The position in `pram_negatives` of the next failed lookup to remember
+ */
+static size_t pram_negative_next = 0;
+
+/**
+ * The maximum number of cached directory file descriptors, zero to not cache them
+ */
+static size_t pram_dir_fd_max = 64;
+
+/**
+ * The number of cached directory file descriptors
+ */
+static size_t pram_dir_fd_count = 0;
+
+/**
+ * Incremented each time cached directory file descriptors are forgotten, so that
+ * directories opened meanwhile, which may have been renamed or removed, are not cached
+ */
+static size_t pram_dir_fd_generation = 0;
+
+/**
+ * The most recently used cached directory file descriptor
+ */
+static struct pram_dir_fd* pram_dir_fd_newest = NULL;
+
+/**
+ * The least recently used cached directory file descriptor
+ */
+static struct pram_dir_fd* pram_dir_fd_oldest = NULL;
+
+/**
+ * The directory whose files are looked up on the HDD when the
+ * file system is mounted, `NULL` to not prewarm the file cache
+ */
+static char* pram_prewarm = NULL;
+
+/**
+ * Whether the prewarming thread is running, it stops when this is cleared
+ */
+static char pram_prewarming = false;
+
+/**
+ * The thread that prewarms the file cache
+ */
+static pthread_t pram_prewarm_thread;
+
+/**
+ * The file the file cache is saved to on unmount and loaded from
+ * on mount, `NULL` to not keep the file cache across mounts
+ */
+static char* pram_snapshot = NULL;
+
+/**
+ * Whether unmodified cached extents are saved to the snapshot
+ */
+static char pram_snapshot_data = false;
+
+/**
+ * The snapshot loaded on mount, mapped into memory, `NULL` if none
+ */
+static char* pram_snapshot_map = NULL;
+
+/**
+ * The size of `pram_snapshot_map`
+ */
+static size_t pram_snapshot_size = 0;
+
+/**
+ * The maximum number of bytes read ahead of a reader that reads
+ * sequentially or with a fixed stride, zero to not read ahead
+ */
+static size_t pram_readahead = 4 << 20;
+
+/**
+ * Whether the readahead threads should keep running
+ */
+static char pram_readahead_running = false;
+
+/**
+ * The readahead threads
+ */
+static pthread_t pram_readahead_thread[PRAM_READAHEAD_THREADS];
+
+/**
+ * The number of started readahead threads
+ */
+static size_t pram_readahead_threads = 0;
+
+/**
+ * The first queued readahead
+ */
+static struct pram_readahead* pram_readahead_queue = NULL;
+
+/**
+ * The last queued readahead
+ */
+static struct pram_readahead* pram_readahead_last = NULL;
+
+/**
+ * The number of queued readaheads, modified atomically
+ */
+static size_t pram_readahead_queued = 0;
+
+/**
+ * Condition used to wake the readahead threads
+ */
+static pthread_cond_t pram_readahead_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * The number of threads that help write files to the HDD, a stripe at a time
+ */
+static size_t pram_flush_threads = 4;
+
+/**
+ * The size and alignment of the stripes that files are written to the HDD in,
+ * such as the stripe size of a parallel file system, each stripe is written
+ * by one thread, but different stripes are written concurrently
+ */
+static size_t pram_stripe_size = 1 << 20;
+
+/**
+ * Whether the threads that help write files to the HDD should keep running
+ */
+static char pram_flushers_running = false;
+
+/**
+ * The threads that help write files to the HDD
+ */
+static pthread_t* pram_flusher_thread = NULL;
+
+/**
+ * The number of started threads that help write files to the HDD
+ */
+static size_t pram_flushers = 0;
+
+/**
+ * The first write-back with stripes that no thread has taken
+ */
+static struct pram_flush* pram_flush_queue = NULL;
+
+/**
+ * Condition used to wake the threads that help write files to the HDD
+ */
+static pthread_cond_t pram_flusher_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Condition used to wake threads waiting for the stripes of their write-back to be written
+ */
+static pthread_cond_t pram_flushed_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Whether the background thread should keep running
+ */
+static char pram_running = false;
+
+/**
+ * The background thread that writes modified extents to the HDD
+ */
+static pthread_t pram_background_thread;
+
+/**
+ * Condition used to wake the background thread
+ */
+static pthread_cond_t pram_flush_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Condition used to wake writers waiting for modified content to be written to the HDD
+ */
+static pthread_cond_t pram_throttle_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Mutex for the cache size accounting, the eviction clock
+ * and the list of files with modified extents
+ */
+static pthread_mutex_t pram_mutex;
+
+/**
+ * Lock for `pram_inode_cache` and the files' `paths`
+ */
+static pthread_rwlock_t pram_inode_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Mutex for `pram_negative_cache` and `pram_negatives`
+ */
+static pthread_mutex_t pram_negative_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Mutex for changes to `pram_file_cache`
+ */
+static pthread_mutex_t pram_file_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Mutex for `pram_dir_fd_cache` and the cached directory file descriptors' references
+ */
+static pthread_mutex_t pram_dir_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Mutex for `pram_snapshot_index`
+ */
+static pthread_mutex_t pram_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Mutex for the readahead queue
+ */
+static pthread_mutex_t pram_readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Mutex for `pram_flush_queue` and the progress of write-backs
+ */
+static pthread_mutex_t pram_flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * File cache map, a file with multiple names has an entry for each
+ * name that has been looked up, all referring to the same cache,
+ * it is read without locking in read-side critical sections
+ */
+pram_map* pram_file_cache;
+
+/**
+ * `PRAM_SHARDS` locks, chosen by the names' hashes, held while a name is
+ * looked up on or changed on the HDD, so that the HDD and `pram_file_cache` agree
+ */
+pthread_mutex_t* pram_names;
+
+/**
+ * Map from device and inode number, as made by `inode_key`, to file cache
+ */
+pram_map* pram_inode_cache;
+
+/**
+ * Map from nonexistent files to their elements in `pram_negatives`
+ */
+pram_map* pram_negative_cache;
+
+/**
+ * Map from directories to their cached file descriptors
+ */
+pram_map* pram_dir_fd_cache;
+
+/**
+ * Map from files to their entries in `pram_snapshot_map` that have not
+ * been used yet, `NULL` if no snapshot was loaded
+ */
+pram_map* pram_snapshot_index = NULL;
+
+
+
+/**
+ * Information for opened directories
+ */
+struct pram_dir_info
+{
+  /**
+   * The directory's file cache
+   */
+  struct pram_file* cache;
+  
+  /**
+   * The directory
+   */
+  char* path;
+};
+
+
+/**
+ * Cached extended attribute
+ */
+struct pram_xattr
+{
+  /**
+   * The name of the attribute
+   */
+  char* name;
+  
+  /**
+   * The value of the attribute
+   */
+  char* value;
+  
+  /**
+   * The size of `value`
+   */
+  size_t size;
+  
+  /**
+   * Zero if the attribute exists, otherwise the error
+   * returned when the attribute was looked up
+   */
+  int error;
+};
+
+
+/**
+ * Remembered failed lookup
+ */
+struct pram_negative
+{
+  /**
+   * The file that did not exist, `NULL` if the element is unused
+   */
+  char* path;
+  
+  /**
+   * The time the file should be looked up again
+   */
+  time_t expires;
+};
+
+
+/**
+ * Cached file descriptor for a directory on the HDD
+ */
+struct pram_dir_fd
+{
+  /**
+   * The directory, as named in RAM
+   */
+  char* path;
+  
+  /**
+   * The file descriptor, opened with `O_PATH`
+   */
+  int fd;
+  
+  /**
+   * The number of users of the file descriptor
+   */
+  long refs;
+  
+  /**
+   * Whether the directory has been removed from `pram_dir_fd_cache`,
+   * the file descriptor is closed by its last user if so
+   */
+  char forgotten;
+  
+  /**
+   * The more recently used cached directory file descriptor
+   */
+  struct pram_dir_fd* newer;
+  
+  /**
+   * The less recently used cached directory file descriptor
+   */
+  struct pram_dir_fd* older;
+};
+
+
+/**
+ * File caches that are being freed on unmount
+ */
+struct pram_teardown
+{
+  /**
+   * The file caches
+   */
+  struct pram_file** caches;
+  
+  /**
+   * The number of elements in `caches`
+   */
+  size_t count;
+  
+  /**
+   * The index of the first file cache that no thread has taken
+   */
+  size_t next;
+};
+
+
+/**
+ * Directories that are being looked up on the HDD when prewarming
+ */
+struct pram_prewarm
+{
+  /**
+   * Directories that have not been looked up yet
+   */
+  char** dirs;
+  
+  /**
+   * The number of elements in `dirs`
+   */
+  size_t dirn;
+  
+  /**
+   * The allocation size of `dirs`
+   */
+  size_t dirsize;
+  
+  /**
+   * The number of directories that are being looked up
+   */
+  size_t busy;
+  
+  /**
+   * Mutex for this structure
+   */
+  pthread_mutex_t mutex;
+  
+  /**
+   * Condition used to wake threads waiting for directories
+   */
+  pthread_cond_t cond;
+};
+
+
+/**
+ * The beginning of a snapshot, it is followed by the entries
+ */
+struct pram_snapshot_header
+{
+  /**
+   * `PRAM_SNAPSHOT_MAGIC`, without the terminating NUL
+   */
+  char magic[8];
+  
+  /**
+   * `PRAM_SNAPSHOT_VERSION`
+   */
+  uint32_t version;
+  
+  /**
+   * The size of `struct stat` in the program that saved the snapshot
+   */
+  uint32_t stat_size;
+  
+  /**
+   * `PRAM_CHUNK_SIZE` in the program that saved the snapshot
+   */
+  uint64_t chunk_size;
+  
+  /**
+   * The number of entries
+   */
+  uint64_t files;
+};
+
+
+/**
+ * Entry for a name in a snapshot, it is followed by the name and the target
+ * of the link, padded to a multiple of eight bytes, and then by `chunkn`
+ * extents and their content, each also padded to a multiple of eight bytes
+ */
+struct pram_snapshot_file
+{
+  /**
+   * The size of the entry, including everything that follows it
+   */
+  uint64_t size;
+  
+  /**
+   * The file's attributes when the snapshot was saved
+   */
+  struct stat attr;
+  
+  /**
+   * The size of the name, including the terminating NUL
+   */
+  uint64_t pathn;
+  
+  /**
+   * The size of the target of the link, including the terminating NUL, zero if none
+   */
+  uint64_t linkn;
+  
+  /**
+   * The number of saved extents, they are ordered by index
+   */
+  uint64_t chunkn;
+};
+
+
+/**
+ * Extent saved in a snapshot
+ */
+struct pram_snapshot_chunk
+{
+  /**
+   * The index of the extent in the file
+   */
+  uint64_t index;
+  
+  /**
+   * The position of the extent's content relative to the beginning of the file's entry
+   */
+  uint64_t offset;
+  
+  /**
+   * The length of the extent
+   */
+  uint64_t length;
+};
+
+
+/**
+ * A snapshot that is being saved
+ */
+struct pram_snapshot_save
+{
+  /**
+   * The file the snapshot is written to
+   */
+  FILE* file;
+  
+  /**
+   * The number of written bytes
+   */
+  size_t off;
+  
+  /**
+   * The number of written entries
+   */
+  uint64_t files;
+  
+  /**
+   * Map from device and inode number to file caches whose extents have been saved
+   */
+  pram_map* saved;
+  
+  /**
+   * Whether a write failed
+   */
+  char error;
+};
+
+
+/**
+ * Cached directory entry
+ */
+struct pram_dirent
+{
+  /**
+   * The name of the entry, `NULL` if it has been removed
+   */
+  char* name;
+  
+  /**
+   * The inode number of the entry
+   */
+  ino_t ino;
+  
+  /**
+   * The file type of the entry
+   */
+  mode_t mode;
+};
+
+
+/**
+ * Information for opened files
+ */
+struct pram_file_info
+{
+  /**
+   * Information cache
+   */
+  struct pram_file* cache;
+  
+  /**
+   * File description
+   */
+  uint64_t fd;
+  
+  /**
+   * The flags the file was opened with
+   */
+  int flags;
+  
+  /**
+   * Lock for the readahead state
+   */
+  pthread_mutex_t readahead_lock;
+  
+  /**
+   * The offset of the last read, -1 if none
+   */
+  off_t last;
+  
+  /**
+   * The distance between the offsets of the last two reads,
+   * zero if they do not seem to follow a pattern
+   */
+  off_t stride;
+  
+  /**
+   * The number of reads to read ahead, zero if the pattern has not been confirmed
+   */
+  size_t window;
+  
+  /**
+   * The offset of the first read ahead of the reader that has not been queued
+   */
+  off_t issued;
+};
+
+
+/**
+ * Reads of a file that are queued for the readahead threads
+ */
+struct pram_readahead
+{
+  /**
+   * The next queued readahead
+   */
+  struct pram_readahead* next;
+  
+  /**
+   * The file cache, it is referenced by the readahead
+   */
+  struct pram_file* cache;
+  
+  /**
+   * File descriptor to read the file with, owned by the readahead
+   */
+  int fd;
+  
+  /**
+   * The offset of the first read
+   */
+  off_t off;
+  
+  /**
+   * The length of each read
+   */
+  size_t len;
+  
+  /**
+   * The distance between the offsets of the reads
+   */
+  off_t stride;
+  
+  /**
+   * The number of reads
+   */
+  size_t count;
+};
+
+
+/**
+ * A modified range of an extent that is being written to the HDD,
+ * it does not cross the boundary of a stripe
+ */
+struct pram_flush_piece
+{
+  /**
+   * The extent
+   */
+  struct pram_chunk* chunk;
+  
+  /**
+   * The index of the extent
+   */
+  size_t index;
+  
+  /**
+   * The offset of the first byte of the range in the extent
+   */
+  size_t start;
+  
+  /**
+   * The offset after the last byte of the range in the extent
+   */
+  size_t end;
+  
+  /**
+   * The error the range could not be written because of, zero if none
+   */
+  int error;
+};
+
+
+/**
+ * The write-back of a file, split into stripes that are written concurrently
+ */
+struct pram_flush
+{
+  /**
+   * The next write-back in `pram_flush_queue`
+   */
+  struct pram_flush* next;
+  
+  /**
+   * The file descriptor to write with
+   */
+  int fd;
+  
+  /**
+   * The modified ranges, in order
+   */
+  struct pram_flush_piece* pieces;
+  
+  /**
+   * The number of elements in `pieces`
+   */
+  size_t piecen;
+  
+  /**
+   * The number of elements in `pieces` that threads have taken
+   */
+  size_t claimed;
+  
+  /**
+   * The number of threads writing stripes
+   */
+  size_t writers;
+  
+  /**
+   * Whether the write-back is in `pram_flush_queue`
+   */
+  char queued;
+  
+  /**
+   * Whether the stripes are written no faster than `pram_drain_rate`
+   */
+  char paced;
+};
+
+
+/**
+ * Cached extent of a file
+ */
+struct pram_chunk
+{
+  /**
+   * The content of the extent, `PRAM_CHUNK_SIZE` bytes are allocated
+   */
+  char* data;
+  
+  /**
+   * The number of bytes in `data` that are part of the file
+   */
+  size_t length;
+  
+  /**
+   * The start of the range of `data` that has been modified since
+   * it was last written to the HDD
+   */
+  size_t dirty_start;
+  
+  /**
+   * The end of the range of `data` that has been modified since
+   * it was last written to the HDD, zero if the extent is unmodified
+   */
+  size_t dirty_end;
+  
+  /**
+   * Whether the extent has been used since the clock hand last passed it
+   */
+  char referenced;
+  
+  /**
+   * Whether the extent is in use and may not be evicted
+   */
+  char busy;
+  
+  /**
+   * The file the extent belongs to
+   */
+  struct pram_file* file;
+  
+  /**
+   * The index of the extent in its file's extent index
+   */
+  size_t index;
+  
+  /**
+   * The previous extent in the eviction clock
+   */
+  struct pram_chunk* clock_prev;
+  
+  /**
+   * The next extent in the eviction clock
+   */
+  struct pram_chunk* clock_next;
+};
+
+
+/**
+ * Information for cached files
+ */
+struct pram_file
+{
+  /**
+   * Contains information such as for example proctection, inode number and ownership
+   */
+  struct stat attr;
+  
+  /**
+   * Cached extents of the file, indexed by offset divided by `PRAM_CHUNK_SIZE`,
+   * `NULL` for extents that are not cached
+   */
+  struct pram_chunk** chunks;
+  
+  /**
+   * The number of elements in `chunks`
+   */
+  size_t chunkn;
+  
+  /**
+   * The content of the file if it is a symbolic link
+   */
+  char* link;
+  
+  /**
+   * The size of `link`
+   */
+  unsigned long linkn;
+  
+  /**
+   * File descriptor used to write modified extents to the HDD, -1 if none
+   */
+  int fd;
+  
+  /**
+   * The number of entries in `pram_file_cache` for the file
+   */
+  size_t paths;
+  
+  /**
+   * The number of references to the cache, held by ongoing operations
+   * and open file and directory handles, modified atomically
+   */
+  long handles;
+  
+  /**
+   * The number of open file and directory handles of the file
+   */
+  long opened;
+  
+  /**
+   * The number of ongoing write-backs of the file
+   */
+  long flushing;
+  
+  /**
+   * Whether the file has been unlinked and shall be freed when
+   * it is no longer referenced, modified atomically
+   */
+  char unlinked;
+  
+  /**
+   * Lock for the cache, other than `handles` and `unlinked`
+   */
+  pthread_rwlock_t lock;
+  
+  /**
+   * Held while the file is written back to the HDD or truncated
+   */
+  pthread_mutex_t flush_lock;
+  
+  /**
+   * When the file was first modified since it was last written to the HDD, zero if unmodified
+   */
+  time_t dirtied;
+  
+  /**
+   * Whether the file has been closed with modified extents, so that the background
+   * thread shall write it back, and synchronise it to the HDD's storage device,
+   * without waiting for it to become old enough, protected by the mutex
+   */
+  char released;
+  
+  /**
+   * The error the last failed write-back of the file failed with,
+   * zero if none or if it has been reported by `pram_fsync`
+   */
+  int error;
+  
+  /**
+   * The directory's cached listing, if it is a directory
+   */
+  struct pram_dirent* entries;
+  
+  /**
+   * The number of elements in `entries`, including removed entries
+   */
+  size_t entryn;
+  
+  /**
+   * The allocation size of `entries`
+   */
+  size_t entry_size;
+  
+  /**
+   * The number of removed entries in `entries`
+   */
+  size_t removed;
+  
+  /**
+   * Whether `entries` is the directory's complete listing
+   */
+  char listed;
+  
+  /**
+   * The file's cached extended attributes, including attributes that do not exist
+   */
+  struct pram_xattr* xattrs;
+  
+  /**
+   * The number of elements in `xattrs`
+   */
+  size_t xattrn;
+  
+  /**
+   * The cached list of the file's extended attributes
+   */
+  char* xattr_list;
+  
+  /**
+   * The size of `xattr_list`
+   */
+  size_t xattr_listn;
+  
+  /**
+   * Whether `xattr_list` is cached
+   */
+  char xattrs_listed;
+  
+  /**
+   * The file's entry in the snapshot loaded on mount, its extents are used
+   * instead of reading them from the HDD, `NULL` if there are none to use
+   */
+  const struct pram_snapshot_file* snapshot;
+  
+  /**
+   * The number of writes and size changes, extents read without
+   * the lock are discarded if the file is changed meanwhile
+   */
+  unsigned long changes;
+  
+  /**
+   * The previous file in the list of files with modified extents
+   */
+  struct pram_file* dirty_prev;
+  
+  /**
+   * The next file in the list of files with modified extents
+   */
+  struct pram_file* dirty_next;
+};
+
+
+
+/**
+ * Lock mutex
+ */
+#define _lock  pthread_mutex_lock(&pram_mutex)
+
+/**
+ * Unlock mutex
+ */
+#define _unlock  pthread_mutex_unlock(&pram_mutex)
+
+/**
+ * Lock a file cache for reading
+ * 
+ * @param  C:struct pram_file*  The file cache
+ */
+#define _rdlock(C)  pthread_rwlock_rdlock(&((C)->lock))
+
+/**
+ * Lock a file cache for writing
+ * 
+ * @param  C:struct pram_file*  The file cache
+ */
+#define _wrlock(C)  pthread_rwlock_wrlock(&((C)->lock))
+
+/**
+ * Unlock a file cache
+ * 
+ * @param  C:struct pram_file*  The file cache
+ */
+#define _rwunlock(C)  pthread_rwlock_unlock(&((C)->lock))
+
+/**
+ * The maximum length of a key in `pram_inode_cache`, including the terminating NUL
+ */
+#define PRAM_INODE_KEY_SIZE  (4 * sizeof(uintmax_t) + 2)
+
+/**
+ * Key for the `cache_size` mount option
+ */
+#define PRAM_OPT_CACHE_SIZE  0
+
+/**
+ * Key for the `flush_age` mount option
+ */
+#define PRAM_OPT_FLUSH_AGE  1
+
+/**
+ * Key for the `dirty_ratio` mount option
+ */
+#define PRAM_OPT_DIRTY_RATIO  2
+
+/**
+ * Key for the `negative_ttl` mount option
+ */
+#define PRAM_OPT_NEGATIVE_TTL  3
+
+/**
+ * Key for the `negative_max` mount option
+ */
+#define PRAM_OPT_NEGATIVE_MAX  4
+
+/**
+ * Key for the `dir_fds` mount option
+ */
+#define PRAM_OPT_DIR_FDS  5
+
+/**
+ * Key for the `prewarm` mount option
+ */
+#define PRAM_OPT_PREWARM  6
+
+/**
+ * Key for the `snapshot` mount option
+ */
+#define PRAM_OPT_SNAPSHOT  7
+
+/**
+ * Key for the `snapshot_data` mount option
+ */
+#define PRAM_OPT_SNAPSHOT_DATA  8
+
+/**
+ * Key for the `readahead` mount option
+ */
+#define PRAM_OPT_READAHEAD  9
+
+/**
+ * Key for the `flush_threads` mount option
+ */
+#define PRAM_OPT_FLUSH_THREADS  10
+
+/**
+ * Key for the `stripe_size` mount option
+ */
+#define PRAM_OPT_STRIPE_SIZE  11
+
+/**
+ * Key for the `dirty_limit` mount option
+ */
+#define PRAM_OPT_DIRTY_LIMIT  12
+
+/**
+ * Key for the `drain_rate` mount option
+ */
+#define PRAM_OPT_DRAIN_RATE  13
+
+
+
+/**
+ * Write a buffer vector to a position in a file
+ * 
+ * @param    path  The file
+ * @param    buf   The buffer vector to write
+ * @param    off   The offset in the file at which to start the write
+ * @param    fi    File information
+ * @return         Error code if negative, and number of written bytes if non-negative
+ */
+static int pram_write_buf(const char* path, struct fuse_bufvec* buf, off_t off, struct fuse_file_info* fi);
+
+
+
+/**
+ * Compare two NUL-terminated strings against each other
+ * 
+ * @param   a  The first comparand
+ * @param   b  The second comparand
+ * @return     The comparands' equality
+ */
+static inline long eq(const char* a, const char* b);
+
+/**
+ * Return a path as it is named on the HDD relative to the root mount path,
+ * for functions that have no `*at` variant, the path is put in the
+ * calling thread's `pathbuf`
+ * 
+ * @param   path  The path in RAM
+ * @return        The path on HDD
+ */
+static char* p(const char* path);
+
+/**
+ * Return a path as it is named on the HDD relative to `hddfd`, for use with
+ * the `*at` functions, the path is not copied
+ * 
+ * @param   path  The path in RAM
+ * @return        The path on HDD, relative to `hddfd`
+ */
+static inline const char* h(const char* path);
+
+/**
+ * Parse a size that may have a binary unit suffix, such as `K`, `M` or `G`
+ * 
+ * @param   str    The string to parse
+ * @param   value  Output parameter for the size
+ * @return         Zero on success, -1 if the string is not a valid size
+ */
+static int parse_size(const char* str, size_t* value);
+
+/**
+ * Parse a non-negative integer
+ * 
+ * @param   str    The string to parse
+ * @param   value  Output parameter for the integer
+ * @return         Zero on success, -1 if the string is not a valid integer
+ */
+static int parse_number(const char* str, size_t* value);
+
+/**
+ * Process a mount option that was not recognised by FUSE
+ * 
+ * @param   data     Private use input
+ * @param   arg      The option
+ * @param   key      The key for the option
+ * @param   outargs  The arguments that are passed on to FUSE
+ * @return           -1 on error, 0 to discard the option, 1 to keep it
+ */
+static int pram_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs);
+
+/**
+ * Get the value to return for a FUSE operation
+ * 
+ * @param   rc  The returned value from the native operation
+ * @return      `rc`, or the thrown error negative.
+ */
+static inline int r(int rc);
+
+/**
+ * Gets the calling thread's queue of reads and writes, initialising it on first use
+ * 
+ * @return  The queue, it is empty unless the thread left operations in it
+ */
+static pram_io* get_io(void);
+
+/**
+ * Free the resources of a thread's queue of reads and writes when the thread exits
+ * 
+ * @param  io  The queue
+ */
+static void free_io(void* io);
+
+
+
+/**
+ * Pthread start routine for background thread
+ * 
+ * @param   data  Private use input data
+ * @return        Private use output data
+ */
+static void* pram_background(void* data);
+
+/**
+ * Write modified files to the HDD, the mutex must be held
+ * and will be released during the writes
+ * 
+ * @param  all  Whether to write all modified files, rather than only those
+ *              that are old enough or needed to reduce memory pressure
+ */
+static void flush_dirty_files(int all);
+
+/**
+ * Check whether so much content is modified, or writers are waiting for it, that
+ * it should be written to the HDD regardless of its age, the mutex must be held
+ * 
+ * @return  Whether modified content should be written to the HDD
+ */
+static inline int dirty_pressure(void);
+
+/**
+ * Slow down or hold back a writer, so that the modified content, including
+ * that being written to the HDD, does not exceed `pram_dirty_limit`, no
+ * lock may be held
+ * 
+ * @param  len  The number of bytes about to be written
+ */
+static void throttle_writer(size_t len);
+
+
+
+/**
+ * Get information about the use as well as the ID of the process accessing the file system
+ * 
+ * @param   user          Where to store the ID of the user accessing the file system
+ * @param   group         Where to store the group ID of the user accessing the file system
+ * @param   umask         Where to store the current umask
+ * @param   process       Where to store the ID of the process accessing the file system
+ * @param   supplemental  List to fill with supplemental groups of the user accessing the file system, ignored if `NULL`
+ * @param   n             The size of `supplemental`
+ * @return                Error code or the total (can exceed `supplemental`) number of supplemental groups
+ */
+int get_user_info(uid_t* user, gid_t* group, mode_t* umask, pid_t* process, gid_t* supplemental, int n);
+
+
+
+/**
+ * Gets the file cache for a file by its name, the cache
+ * must be released with `put_file_cache`
+ * 
+ * @param   path   The file
+ * @param   cache  Area to put the cache in
+ * @return         Error code
+ */
+int get_file_cache(const char* path, struct pram_file** cache);
+
+/**
+ * Gets the file cache for a file by its file information provided by FUSE
+ * 
+ * @param   FI:struct fuse_file_info*  The file information
+ * @return  :struct pram_file*         The file's cache
+ */
+#define fcache(FI)  (((struct pram_file_info*)(void*)((FI)->fh))->cache)
+
+/**
+ * Gets the file descriptor for a file by its file information provided by FUSE
+ * 
+ * @param   FI:struct fuse_file_info*  The file information
+ * @return  :uint64_t                  The file's descriptor
+ */
+#define ffd(FI)  (((struct pram_file_info*)(void*)((FI)->fh))->fd)
+
+/**
+ * Gets the flags a file was opened with by its file information provided by FUSE
+ * 
+ * @param   FI:struct fuse_file_info*  The file information
+ * @return  :int                       The file's open flags
+ */
+#define fflags(FI)  (((struct pram_file_info*)(void*)((FI)->fh))->flags)
+
+
+
+/**
+ * Free a file cache and all its cached extents
+ * 
+ * @param  cache  The file cache
+ */
+static void free_file_cache(struct pram_file* cache);
+
+/**
+ * Free a file cache and all its cached extents on unmount, without removing the
+ * extents from the eviction clock or the file from the list of modified files,
+ * so that it can be done in parallel, no other thread may be using the cache
+ * 
+ * @param  cache  The file cache
+ */
+static void discard_file_cache(struct pram_file* cache);
+
+/**
+ * Free file caches that are being freed on unmount until none are left
+ * 
+ * @param   teardown  The file caches, as a `struct pram_teardown*`
+ * @return            `NULL`
+ */
+static void* teardown_file_caches(void* teardown);
+
+/**
+ * Free all file caches on unmount, on up to `PRAM_TEARDOWN_THREADS` threads
+ * 
+ * @param  caches  `NULL`-terminated array of the file caches, it is not freed
+ */
+static void free_all_file_caches(struct pram_file** caches);
+
+/**
+ * Change the size of a cached file, discarding extents after the end
+ * and zeroing new bytes in the cached extent at the old end, the file
+ * must be write locked
+ * 
+ * @param  cache   The file cache
+ * @param  length  The new size of the file
+ */
+static void resize_file_cache(struct pram_file* cache, off_t length);
+
+/**
+ * Account for a new extent, evicting unmodified extents that have not
+ * been used recently if the cache would otherwise exceed its size limit,
+ * the mutex must be held
+ * 
+ * @param   cache  The file cache the extent is for, it must be write locked
+ * @return         Zero on success, -1 if no memory could be made available
+ */
+static int reserve_chunk(struct pram_file* cache);
+
+/**
+ * Remove an extent from its file cache and free it, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ */
+static void release_chunk(struct pram_chunk* chunk);
+
+/**
+ * Make room for an extent in a file cache's extent index
+ * 
+ * @param   cache  The file cache
+ * @param   index  The index of the extent
+ * @return         Zero on success, -1 on error
+ */
+static int grow_chunk_index(struct pram_file* cache, size_t index);
+
+/**
+ * Gets a cached extent of a file, reading it from the HDD if it is not cached
+ * 
+ * @param   cache  The file cache, it must be write locked unless the extent is cached
+ * @param   index  The index of the extent
+ * @param   fd     The file descriptor to read the extent from
+ * @return         The extent, `NULL` on error
+ */
+static struct pram_chunk* get_chunk(struct pram_file* cache, size_t index, int fd);
+
+/**
+ * Read the extents in a range of a file that are not cached from the HDD,
+ * with the reads made together rather than one at a time, extents that
+ * cannot be read are left for `get_chunk` to report
+ * 
+ * @param  cache  The file cache, it must be write locked
+ * @param  off    The offset of the range
+ * @param  len    The length of the range, it must be within the file
+ * @param  fd     The file descriptor to read the extents from
+ */
+static void fill_chunks(struct pram_file* cache, off_t off, size_t len, int fd);
+
+/**
+ * Create an extent in a file cache without reading it from the HDD
+ * 
+ * @param   cache  The file cache, it must be write locked
+ * @param   index  The index of the extent
+ * @return         The extent, with its content zeroed, `NULL` on error
+ */
+static struct pram_chunk* new_chunk(struct pram_file* cache, size_t index);
+
+/**
+ * Remove a file from the list of files with modified extents, the mutex must be held
+ * 
+ * @param  cache  The file cache
+ */
+static void unlist_dirty(struct pram_file* cache);
+
+/**
+ * Move a file that has been closed with modified extents to the beginning of the
+ * list of files with modified extents, and wake the background thread, so that
+ * the file is written back promptly rather than when it is old enough, the
+ * mutex must be held
+ * 
+ * @param  cache  The file cache
+ */
+static void release_dirty(struct pram_file* cache);
+
+/**
+ * Mark a range of an extent as modified, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ * @param  start  The offset of the first modified byte in the extent
+ * @param  end    The offset after the last modified byte in the extent
+ */
+static void mark_dirty(struct pram_chunk* chunk, size_t start, size_t end);
+
+/**
+ * Mark an extent as unmodified, without writing it to the HDD, the mutex must be held
+ * 
+ * @param  chunk  The extent
+ */
+static void mark_clean(struct pram_chunk* chunk);
+
+/**
+ * Write all modified ranges of a file to the HDD, the file must be referenced
+ * but not locked, it is unlocked during the writes so that it can be used,
+ * the stripes are written concurrently with the help of the flushing threads
+ * 
+ * @param   cache  The file cache
+ * @param   paced  Whether to write no faster than `pram_drain_rate`
+ * @return         Error code
+ */
+static int write_back_file(struct pram_file* cache, int paced);
+
+/**
+ * List the modified ranges of a file, split at the stripe boundaries,
+ * the file must be write locked
+ * 
+ * @param   cache  The file cache
+ * @param   flush  The write-back to list the ranges in
+ * @return         Zero on success, -1 on error
+ */
+static int plan_flush(struct pram_file* cache, struct pram_flush* flush);
+
+/**
+ * Gets the stripe a modified range that is being written to the HDD is in
+ * 
+ * @param   piece  The range
+ * @return         The index of the stripe
+ */
+static inline off_t piece_stripe(const struct pram_flush_piece* piece);
+
+/**
+ * Take stripes of a write-back and write them until all stripes are taken,
+ * `pram_flusher_mutex` must be held, and is released during the writes
+ * 
+ * @param  flush  The write-back
+ */
+static void write_stripes(struct pram_flush* flush);
+
+/**
+ * Reserve time for writing a stripe to the HDD at `pram_drain_rate`,
+ * `pram_flusher_mutex` must be held
+ * 
+ * @param   bytes  The number of bytes in the stripe
+ * @return         When the stripe may be written, on `CLOCK_MONOTONIC`
+ */
+static struct timespec reserve_drain(size_t bytes);
+
+/**
+ * Flushing thread, it helps write files to the HDD until the file system is unmounted
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* flush_stripes(void* data);
 
 /**
- * The size of `pathbuf`
+ * Release a reference to a file cache, freeing
+ * it if it was the last and it has been unlinked
+ * 
+ * @param  cache  The file cache
  */
-static long pathbufsize = 0;
+static void put_file_cache(struct pram_file* cache);
 
 /**
- * Thread mutex
+ * Add an entry last in a directory's cached listing
+ * 
+ * @param   cache  The directory's file cache
+ * @param   name   The name of the entry
+ * @param   ino    The inode number of the entry
+ * @param   mode   The file type of the entry
+ * @return         Zero on success, -1 on error
  */
-static pthread_mutex_t pram_mutex;
+static int append_dirent(struct pram_file* cache, const char* name, ino_t ino, mode_t mode);
 
 /**
- * File cache map
+ * Read a directory's listing from the HDD into its file cache
+ * 
+ * @param   cache  The directory's file cache
+ * @param   path   The directory
+ * @return         Error code
  */
-pram_map* pram_file_cache;
+static int load_dir_cache(struct pram_file* cache, const char* path);
 
+/**
+ * Remove holes left by removed entries from a directory's cached listing,
+ * if it is not open and a large part of it are holes, the directory must
+ * be write locked
+ * 
+ * @param  cache  The directory's file cache
+ */
+static void compact_dir_cache(struct pram_file* cache);
 
+/**
+ * Gets the file cache for the parent directory of a file, if it is cached,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   path  The file
+ * @param   name  Output parameter for the file's name in the directory, ignored if `NULL`
+ * @return        The parent directory's file cache, `NULL` if it is not cached
+ */
+static struct pram_file* get_parent_cache(const char* path, const char** name);
 
 /**
- * Information for opened directories
+ * Add or update an entry in the cached listing of a file's parent directory
+ * 
+ * @param  path  The file
+ * @param  attr  The file's attributes
  */
-struct pram_dir_info
-{
-  /**
-   * DIR object create when opening the directory
-   */
-  DIR* dp;
-  
-  /**
-   * Read directory information
-   */
-  struct dirent* entry;
-  
-  /**
-   * Offset
-   */
-  off_t offset;
-};
+static void dir_cache_add(const char* path, const struct stat* attr);
 
+/**
+ * Remove an entry from the cached listing of a file's parent directory
+ * 
+ * @param  path  The file
+ */
+static void dir_cache_remove(const char* path);
 
 /**
- * Information for opened files
+ * Cache the attributes of a file that has just been created, and add it to
+ * the cached listing of its parent directory, the name must be locked
+ * 
+ * @param  path  The file
  */
-struct pram_file_info
-{
-  /**
-   * Information cache
-   */
-  struct pram_file* cache;
-  
-  /**
-   * File description
-   */
-  uint64_t fd;
-};
+static void cache_new_entry(const char* path);
 
+/**
+ * Check whether a file is remembered not to exist
+ * 
+ * @param   path  The file
+ * @return        Whether the file is remembered not to exist
+ */
+static int is_negative(const char* path);
 
 /**
- * Information for cached files
+ * Remember that a file does not exist, forgetting the
+ * oldest remembered file if too many are remembered
+ * 
+ * @param  path  The file
  */
-struct pram_file
-{
-  /**
-   * Contains information such as for example proctection, inode number and ownership
-   */
-  struct stat attr;
-  
-  /**
-   * Allocated space for the buffer, 0 for unallocated
-   */
-  unsigned long allocated;
-  
-  /**
-   * The buffer
-   */
-  char* buffer;
-  
-  /**
-   * The content of the file if it is a symbolic link
-   */
-  char* link;
-  
-  /**
-   * The size of `link`
-   */
-  unsigned long linkn;
-  
-};
+static void add_negative(const char* path);
 
+/**
+ * Forget that a file does not exist, this must be done
+ * before a file is created through the file system
+ * 
+ * @param  path  The file
+ */
+static void remove_negative(const char* path);
 
+/**
+ * Callback for `pram_map_scan` that frees the names of
+ * nonexistent files that have been detached from `pram_negative_cache`
+ * 
+ * @param  key    The file, without the directory
+ * @param  value  The file's element in `pram_negatives`
+ * @param  data   Not used
+ */
+static void free_detached_negative(const char* key, void* value, void* data);
 
 /**
- * Lock mutex
+ * Forget that any file in a directory does not exist, this must
+ * be done when a directory is renamed through the file system
+ * 
+ * @param  path  The directory
  */
-#define _lock  pthread_mutex_lock(&pram_mutex)
+static void remove_negatives(const char* path);
 
 /**
- * Unlock mutex
+ * Gets a file descriptor for the parent directory of a file on the HDD, and the file's
+ * name relative to it, for use with the `*at` functions, the file descriptor must be
+ * released with `put_dir_fd`, `hddfd` is returned if the parent directory is not cached
+ * and cannot be opened
+ * 
+ * @param   path  The file
+ * @param   name  Output parameter for the file's name relative to the file descriptor
+ * @param   dir   Output parameter for the cached file descriptor, to release with `put_dir_fd`
+ * @return        The file descriptor
  */
-#define _unlock  pthread_mutex_unlock(&pram_mutex)
+static int get_dir_fd(const char* path, const char** name, struct pram_dir_fd** dir);
 
 /**
- * Perform a synchronised call and return its return value
+ * Release a directory file descriptor gotten with `get_dir_fd`, `errno` is preserved
  * 
- * @param   INSTRUCTION:→int  The instruction
- * @reutrn                    `r(INSTRUCTION)`
+ * @param  dir  The cached file descriptor, may be `NULL`
  */
-#define sync_return(INSTRUCTION)  	\
-  _lock;				\
-  int rc = INSTRUCTION;			\
-  _unlock;				\
-  return r(rc);
+static void put_dir_fd(struct pram_dir_fd* dir);
 
 /**
- * Perform a synchronised call
+ * Remove a cached directory file descriptor from the list
+ * of cached file descriptors, `pram_dir_fd_mutex` must be held
  * 
- * @param  INSTRUCTION:→void  The instruction
+ * @param  dir  The cached file descriptor
  */
-#define sync_call(INSTRUCTION)  	\
-  _lock;				\
-  INSTRUCTION;				\
-  _unlock;
+static void unlist_dir_fd(struct pram_dir_fd* dir);
 
 /**
- * Perform a synchronised call with two paths as sole arguments
+ * Callback for `pram_map_scan` that closes directory file descriptors that have
+ * been detached from `pram_dir_fd_cache`, or leaves them to their last users
  * 
- * @param  METHOD:→int    The method
- * @param  A:const char*  The first argument
- * @param  B:const char*  The other argument
+ * @param  key    The directory, without the parent directory
+ * @param  value  The cached file descriptor
+ * @param  data   Not used
  */
-#define sync_call_duo_return(METHOD, A, B)	\
-  _lock;					\
-  char* a = p(A);				\
-  int rc = METHOD(a, q(a, B));			\
-  _unlock;					\
-  free(a);					\
-  return r(rc);
+static void forget_detached_dir_fd(const char* key, void* value, void* data);
 
+/**
+ * Forget the cached file descriptors for a directory and all directories in it,
+ * this must be done when a directory is renamed or removed through the file system
+ * 
+ * @param  path  The directory
+ */
+static void forget_dir_fds(const char* path);
 
+/**
+ * Gets the cached extended attribute of a file, looking it up on the HDD if it is not cached
+ * 
+ * @param   cache  The file's cache
+ * @param   path   The file
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` on error
+ */
+static struct pram_xattr* get_xattr(struct pram_file* cache, const char* path, const char* name);
 
 /**
- * Compare two NUL-terminated strings against each other
+ * Find a cached extended attribute of a file
  * 
- * @param   a  The first comparand
- * @param   b  The second comparand
- * @return     The comparands' equality
+ * @param   cache  The file's cache
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` if it is not cached
  */
-static inline long eq(const char* a, const char* b);
+static struct pram_xattr* find_xattr(struct pram_file* cache, const char* name);
 
 /**
- * Return a path as it is named on the HDD relative to the root mount path
+ * Add an extended attribute, that does not have any value yet, to a file's cache
  * 
- * @param   path  The path in RAM
- * @return        The path on HDD
+ * @param   cache  The file's cache
+ * @param   name   The attribute
+ * @return         The cached attribute, `NULL` on error
  */
-static char* p(const char* path);
+static struct pram_xattr* new_xattr(struct pram_file* cache, const char* name);
 
 /**
- * Return a path as it is named on the HDD relative to the root mount path,
- * but use a new allocation for the path buffer.
+ * Update a file's cached extended attribute after it has been changed on the HDD
  * 
- * @parma   hdd   The old path buffer
- * @param   path  The path in RAM
- * @return        The path on HDD
+ * @param  cache  The file's cache
+ * @param  name   The attribute
+ * @param  value  The new value, `NULL` if the attribute was removed
+ * @param  size   The size of `value`
  */
-static inline char* q(const char* hdd, const char* path);
+static void update_xattr(struct pram_file* cache, const char* name, const char* value, size_t size);
 
 /**
- * Get the value to return for a FUSE operation
+ * Free a file's cached extended attributes
  * 
- * @param   rc  The returned value from the native operation
- * @return      `rc`, or the thrown error negative.
+ * @param  cache  The file's cache
  */
-static inline int r(int rc);
+static void free_xattrs(struct pram_file* cache);
+
+/**
+ * Get the key for a file in `pram_inode_cache`
+ * 
+ * @param  attr  The file's attributes
+ * @param  key   Output parameter for the key, must fit `PRAM_INODE_KEY_SIZE` characters
+ */
+static void inode_key(const struct stat* attr, char* key);
 
+/**
+ * Remove a name of a file from the file cache map after the name has been
+ * unlinked or replaced on the HDD, and mark the file's cache as unlinked if
+ * it was the file's last name, the name must be locked and the cache must
+ * be referenced by the caller
+ * 
+ * @param  path   The name
+ * @param  cache  The file's cache
+ */
+static void forget_path(const char* path, struct pram_file* cache);
 
+/**
+ * Release the hold a name that has been removed from the file cache map has
+ * on a file's cache, and mark the cache as unlinked if it was the file's last
+ * name, the cache must be referenced by the caller
+ * 
+ * @param  cache     The file's cache
+ * @param  unlinked  Whether the name was unlinked or replaced on the HDD, rather than just forgotten
+ */
+static void drop_name(struct pram_file* cache, int unlinked);
 
 /**
- * Get information about the use as well as the ID of the process accessing the file system
+ * Callback for `pram_map_scan` that releases the holds names that have
+ * been detached from the file cache map have on the files' caches
  * 
- * @param   user          Where to store the ID of the user accessing the file system
- * @param   group         Where to store the group ID of the user accessing the file system
- * @param   umask         Where to store the current umask
- * @param   process       Where to store the ID of the process accessing the file system
- * @param   supplemental  List to fill with supplemental groups of the user accessing the file system, ignored if `NULL`
- * @param   n             The size of `supplemental`
- * @return                Error code or the total (can exceed `supplemental`) number of supplemental groups
+ * @param  key    The name, without the directory
+ * @param  value  The file's cache
+ * @param  data   Pointer to an `int` that says whether the names were unlinked on the HDD
  */
-int get_user_info(uid_t* user, gid_t* group, mode_t* umask, pid_t* process, gid_t* supplemental, int n);
+static void drop_detached_name(const char* key, void* value, void* data);
+
+/**
+ * Gets the beginning that the names of the files in a directory share
+ * 
+ * @param   path  The directory
+ * @return        The directory's name with a slash at the end, `NULL` on error
+ */
+static char* dir_prefix(const char* path);
+
+/**
+ * Remove the names of all files in a directory from the file cache
+ * map, the directory's name must be locked
+ * 
+ * @param  path      The directory
+ * @param  unlinked  Whether the names were unlinked on the HDD, rather than just forgotten
+ */
+static void forget_names(const char* path, int unlinked);
+
+/**
+ * Move the names of all files in a directory that has been renamed on
+ * the HDD in the file cache map, both of the directory's names must be locked
+ * 
+ * @param  source  The directory's old name
+ * @param  path    The directory's new name
+ */
+static void move_names(const char* source, const char* path);
 
+/**
+ * Gets the lock for a file name in `pram_names`
+ * 
+ * @param   path  The file
+ * @return        The lock
+ */
+static pthread_mutex_t* get_names_lock(const char* path);
 
+/**
+ * Gets the file cache for a file by its name, without looking it up on the HDD,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   path  The file
+ * @return        The file's cache, `NULL` if it is not cached
+ */
+static struct pram_file* find_file_cache(const char* path);
 
 /**
- * Gets the file cache for a file by its name
+ * Gets the file cache for a file by its name, looking it up on the HDD if it is
+ * not cached, the name must be locked, and the cache must be released with
+ * `put_file_cache`
  * 
  * @param   path   The file
  * @param   cache  Area to put the cache in
  * @return         Error code
  */
-int get_file_cache(const char* path, struct pram_file** cache);
+static int load_file_cache(const char* path, struct pram_file** cache);
 
 /**
- * Gets the file cache for a file by its file information provided by FUSE
+ * Add the file cache for a file whose attributes have just been looked up on
+ * the HDD, the name must be locked and must not be cached, and the cache must
+ * be released with `put_file_cache`
  * 
- * @param   FI:struct fuse_file_info*  The file information
- * @return  :struct pram_file*         The file's cache
+ * @param   path   The file
+ * @param   attr   The file's attributes
+ * @param   cache  Area to put the cache in
+ * @return         Error code
  */
-#define fcache(FI)  (((struct pram_file_info*)(void*)((FI)->fh))->cache)
+static int add_file_cache(const char* path, const struct stat* attr, struct pram_file** cache);
 
 /**
- * Gets the file descriptor for a file by its file information provided by FUSE
+ * Read the target of a symbolic link into its file cache, the file must be write locked
  * 
- * @param   FI:struct fuse_file_info*  The file information
- * @return  :uint64_t                  The file's descriptor
+ * @param   cache  The file cache
+ * @param   dirfd  File descriptor for the link's directory on the HDD
+ * @param   name   The link's name relative to `dirfd`
+ * @return         Error code
  */
-#define ffd(FI)  (((struct pram_file_info*)(void*)((FI)->fh))->fd)
+static int cache_link(struct pram_file* cache, int dirfd, const char* name);
+
+/**
+ * Look up a file found while prewarming, unless it is already cached,
+ * and its target if it is a symbolic link
+ * 
+ * @param   dirfd  File descriptor for the file's directory on the HDD
+ * @param   name   The file's name in the directory
+ * @param   path   The file
+ * @return         Whether the file is a directory
+ */
+static int prewarm_file(int dirfd, const char* name, const char* path);
+
+/**
+ * Look up the files in a directory while prewarming, and queue its subdirectories
+ * 
+ * @param  prewarm  The prewarming state
+ * @param  path     The directory
+ * @param  buffer   Buffer of `PRAM_PREWARM_BUFFER` bytes for the directory entries
+ */
+static void prewarm_dir(struct pram_prewarm* prewarm, const char* path, char* buffer);
+
+/**
+ * Worker that looks up queued directories while prewarming,
+ * until all directories have been looked up
+ * 
+ * @param   prewarm  The prewarming state
+ * @return           `NULL`
+ */
+static void* prewarm_dirs(void* prewarm);
+
+/**
+ * Look up all files in `pram_prewarm` on the HDD, on `PRAM_PREWARM_THREADS` threads,
+ * so that they are cached before they are used
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* prewarm_tree(void* data);
+
+/**
+ * Load the snapshot saved when the file system was last unmounted, its
+ * entries are used when the files are looked up, if they are still valid
+ */
+static void load_snapshot(void);
+
+/**
+ * Use a file's entry in the snapshot, if it has one and the file has not
+ * changed on the HDD since the snapshot was saved, the name must be locked
+ * 
+ * @param  path   The file
+ * @param  cache  The file cache
+ */
+static void restore_snapshot(const char* path, struct pram_file* cache);
+
+/**
+ * Find an extent of a file in the snapshot
+ * 
+ * @param   file   The file's entry in the snapshot
+ * @param   index  The index of the extent
+ * @return         The extent, `NULL` if it is not in the snapshot
+ */
+static const struct pram_snapshot_chunk* snapshot_chunk(const struct pram_snapshot_file* file, size_t index);
+
+/**
+ * Gets the content of an extent of a file that shall be saved to the snapshot,
+ * the extent is saved if it is cached and unmodified, or if it has not been
+ * read since it was loaded from the last snapshot
+ * 
+ * @param   cache   The file cache
+ * @param   index   The index of the extent
+ * @param   length  Output parameter for the length of the extent
+ * @return          The content of the extent, `NULL` if it shall not be saved
+ */
+static const char* clean_extent(struct pram_file* cache, size_t index, size_t* length);
+
+/**
+ * Write to the snapshot that is being saved
+ * 
+ * @param  save  The saving state
+ * @param  buf   The data to write
+ * @param  n     The number of bytes to write
+ */
+static void write_snapshot(struct pram_snapshot_save* save, const void* buf, size_t n);
+
+/**
+ * Pad the snapshot that is being saved to a multiple of eight bytes
+ * 
+ * @param  save  The saving state
+ */
+static void align_snapshot(struct pram_snapshot_save* save);
+
+/**
+ * Callback for `pram_map_scan` that saves a name in the file cache map,
+ * and the file's unmodified extents, to the snapshot
+ * 
+ * @param  key    The file
+ * @param  value  The file's cache
+ * @param  data   The saving state
+ */
+static void save_snapshot_file(const char* key, void* value, void* data);
+
+/**
+ * Callback for `pram_map_scan` that saves an entry from the last snapshot
+ * that has not been used, unless its name is in the file cache map
+ * 
+ * @param  key    The file
+ * @param  value  The file's entry in the last snapshot
+ * @param  data   The saving state
+ */
+static void save_unused_snapshot_file(const char* key, void* value, void* data);
+
+/**
+ * Save the file cache to the snapshot on unmount, the modified
+ * extents must have been written to the HDD before this is done
+ */
+static void save_snapshot(void);
+
+/**
+ * Detect whether a file is read sequentially or with a fixed stride, and
+ * if so, read ahead of the reader, reading more the longer the pattern holds
+ * 
+ * @param  file  The open file
+ * @param  off   The offset of the read
+ * @param  len   The length of the read
+ */
+static void detect_readahead(struct pram_file_info* file, off_t off, size_t len);
+
+/**
+ * Queue reads of a file for the readahead threads
+ * 
+ * @param  cache   The file cache, it must be referenced by the caller
+ * @param  fd      File descriptor to read the file with, it is duplicated
+ * @param  off     The offset of the first read
+ * @param  len     The length of each read
+ * @param  stride  The distance between the offsets of the reads
+ * @param  count   The number of reads
+ */
+static void queue_readahead(struct pram_file* cache, int fd, off_t off, size_t len, off_t stride, size_t count);
+
+/**
+ * Release the file and the file descriptor of queued reads, and free them
+ * 
+ * @param  readahead  The queued reads
+ */
+static void free_readahead(struct pram_readahead* readahead);
+
+/**
+ * Read consecutive extents of a file into its cache ahead of the reader,
+ * the reads are made together without the file locked, and the extents
+ * are discarded if the file is modified meanwhile
+ * 
+ * @param   cache   The file cache
+ * @param   fd      File descriptor to read the file with
+ * @param   index   The index of the first extent
+ * @param   count   The number of extents, at most `PRAM_IO_DEPTH`
+ * @param   buffer  Buffer of `PRAM_IO_DEPTH * PRAM_CHUNK_SIZE` bytes
+ * @return          Zero on success, -1 if an extent is beyond the end
+ *                  of the file or if the cache is full
+ */
+static int read_ahead_chunks(struct pram_file* cache, int fd, size_t index, size_t count, char* buffer);
+
+/**
+ * Readahead thread, it makes queued reads until the file system is unmounted
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void* read_ahead(void* data);
+
+/**
+ * Set the file cache for a name in the file cache map, the name must be locked
+ * 
+ * @param  path   The file
+ * @param  cache  The file's cache, `NULL` to remove the name
+ */
+static void set_file_cache(const char* path, struct pram_file* cache);
+
+/**
+ * Take a reference to a file cache that may be being freed,
+ * the cache must be released with `put_file_cache`
+ * 
+ * @param   cache  The file cache
+ * @return         Zero on success, -1 if the file cache is being freed
+ */
+static int pin_file_cache(struct pram_file* cache);
+
+/**
+ * Lock one or two names, so that they are not looked up or changed on the HDD
+ * by another thread, names that belong to the same shard share their lock
+ * 
+ * @param  a  The file
+ * @param  b  The other file, `NULL` if only `a` shall be locked
+ */
+static void lock_names(const char* a, const char* b);
+
+/**
+ * Unlock names locked with `lock_names`
+ * 
+ * @param  a  The file
+ * @param  b  The other file, `NULL` if only `a` was locked
+ */
+static void unlock_names(const char* a, const char* b);
+
+/**
+ * Close the file descriptor a file uses for write-back if the file is no
+ * longer open and has no modified extents, the file must be write locked
+ * 
+ * @param  cache  The file cache
+ */
+static void close_write_back_fd(struct pram_file* cache);
+
+/**
+ * Check whether all extents in a range of a file are cached, the file must be locked
+ * 
+ * @param   cache  The file cache
+ * @param   off    The offset of the range
+ * @param   len    The length of the range
+ * @return         Whether all extents in the part of the range that is within the file are cached
+ */
+static int chunks_cached(struct pram_file* cache, off_t off, size_t len);
 
+/**
+ * Open or create a file
+ * 
+ * @param   path    The file
+ * @param   fi      File information
+ * @param   mode    File mode, used if the file is created
+ * @param   create  Whether the file may be created
+ * @return          Error code
+ */
+static int open_file(const char* path, struct fuse_file_info* fi, mode_t mode, int create);